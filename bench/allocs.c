@@ -0,0 +1,75 @@
+/*
+** Copyright (c) 2013 Peter Yadlowsky <pmy@virginia.edu>
+**
+** This program is free software ; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation ; either version 3 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY ; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program ; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+/*
+** Allocation counter for the microbenchmarks, preloaded into gusher
+** by run_micro. Wraps the malloc family around glibc's own entry
+** points and counts calls in bench_allocs, which gusherbench.c looks
+** up when it is loaded. Collector allocations are not counted here; they
+** show up as GC bytes instead.
+*/
+
+#include <stddef.h>
+#include <errno.h>
+
+extern void *__libc_malloc(size_t);
+extern void *__libc_calloc(size_t, size_t);
+extern void *__libc_realloc(void *, size_t);
+extern void *__libc_memalign(size_t, size_t);
+extern void __libc_free(void *);
+
+volatile unsigned long bench_allocs = 0;
+
+void *malloc(size_t size) {
+	__sync_fetch_and_add(&bench_allocs, 1);
+	return __libc_malloc(size);
+	}
+
+void *calloc(size_t n, size_t size) {
+	__sync_fetch_and_add(&bench_allocs, 1);
+	return __libc_calloc(n, size);
+	}
+
+void *realloc(void *ptr, size_t size) {
+	__sync_fetch_and_add(&bench_allocs, 1);
+	return __libc_realloc(ptr, size);
+	}
+
+void *memalign(size_t align, size_t size) {
+	__sync_fetch_and_add(&bench_allocs, 1);
+	return __libc_memalign(align, size);
+	}
+
+void *aligned_alloc(size_t align, size_t size) {
+	__sync_fetch_and_add(&bench_allocs, 1);
+	return __libc_memalign(align, size);
+	}
+
+int posix_memalign(void **ptr, size_t align, size_t size) {
+	void *mem;
+	if ((align % sizeof(void *) != 0) || ((align & (align - 1)) != 0))
+		return EINVAL;
+	__sync_fetch_and_add(&bench_allocs, 1);
+	if ((mem = __libc_memalign(align, size)) == NULL) return ENOMEM;
+	*ptr = mem;
+	return 0;
+	}
+
+void free(void *ptr) {
+	__libc_free(ptr);
+	}
@@ -0,0 +1,82 @@
+; Benchmark app: one route per request path worth measuring.
+; Loaded by run_bench as "gusher -p PORT app.scm". Set
+; GUSHER_BENCH_PG to a libpq conninfo string to enable /pg.
+
+(use-modules (ice-9 threads))
+
+; answered on the I/O thread, no Scheme involved
+(http-constant "/const" "200 OK"
+	'(("content-type" . "text/plain")) "constant\n")
+
+(define page "<html>
+<head><title>[[TITLE]]</title></head>
+<body>
+<h1>[[TITLE]]</h1>
+<p>Hello, [[NAME]]. You are visitor number [[COUNT]].</p>
+<ul>[[ITEMS]]</ul>
+</body>
+</html>
+")
+
+(define items
+	(apply string-append
+		(map (lambda (i)
+				(string-append "<li>item " (number->string i) "</li>"))
+			(iota 50))))
+
+(http "/tmpl"
+	(lambda (req)
+		(simple-response "text/html; charset=UTF-8"
+			(fill-template page #f
+				(cons 'title "Benchmark")
+				(cons 'name (or (query-value req 'name) "stranger"))
+				(cons 'count 12345)
+				(cons 'items items)))))
+
+(define record
+	(list (cons 'id 42) (cons 'name "benchmark")
+		(cons 'tags (list "alpha" "beta" "gamma"))
+		(cons 'score 98.6) (cons 'active #t)
+		(cons 'rows (map (lambda (i) (list (cons 'n i) (cons 'sq (* i i))))
+			(iota 20)))))
+
+(http "/json"
+	(lambda (req)
+		(json-response (json-encode record))))
+
+; echoes a decoded application/json body
+(http "/echo-json"
+	(lambda (req)
+		(json-response
+			(json-encode (list (cons 'got (or (assq-ref req 'json)
+				(assq-ref req 'json-error))))))))
+
+(http "/form"
+	(lambda (req)
+		(simple-response "text/plain"
+			(number->string (length (assq-ref req 'query))))))
+
+(http "/upload"
+	(lambda (req)
+		(simple-response "text/plain"
+			(number->string (length (assq-ref req 'query))))))
+
+; one connection per worker thread
+(define pg-info (getenv "GUSHER_BENCH_PG"))
+(define pg-conns (make-hash-table))
+(define pg-lock (make-mutex))
+
+(define (pg-conn)
+	(with-mutex pg-lock
+		(or (hashq-ref pg-conns (current-thread))
+			(let ([conn (pg-open-primitive pg-info)])
+				(hashq-set! pg-conns (current-thread) conn)
+				conn))))
+
+(if pg-info
+	(http "/pg"
+		(lambda (req)
+			(let ([res (pg-exec-primitive (pg-conn)
+					"select n, md5(n::text) as h from generate_series(1, 20) n")])
+				(json-response
+					(json-encode (list (cons 'rows (pg-map-rows res)))))))))
@@ -0,0 +1,218 @@
+/*
+** Copyright (c) 2013 Peter Yadlowsky <pmy@virginia.edu>
+**
+** This program is free software ; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation ; either version 3 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY ; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program ; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+/*
+** Benchmark-only primitives, kept out of the server binary. The bench
+** scripts load this with
+**
+**   (load-extension "./gusherbench.so" "init_gusherbench")
+**
+** bench-run calls a thunk a given number of times and reports wall
+** time, GC bytes and collections for the run. C heap allocations are
+** counted only when the bench/liballocs.so shim is preloaded; it
+** exports bench_allocs, which we find with dlsym. Without it the
+** allocs entry is #f. bench/micro.scm drives this over the hot
+** primitives.
+**
+** bench-latency times each call on its own, for operations slow
+** enough (database round trips) that the spread matters as much as
+** the mean.
+**
+** pg-make-result builds a result without a server, from field names,
+** type OIDs and rows of strings (#f or '() for NULL), so the row
+** decoding can be exercised and measured on its own.
+**
+** The server is linked with -rdynamic, so heap_begin, now_ns and
+** pg_result_smob resolve against it.
+*/
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <dlfcn.h>
+#include <libguile.h>
+#include <libpq-fe.h>
+#include <gc/gc.h>
+
+#include "heap.h"
+#include "gtime.h"
+#include "postgres.h"
+
+static volatile unsigned long *alloc_counter = NULL;
+
+static SCM bench_run(SCM thunk, SCM iterations) {
+	HEAP_SAMPLE sample;
+	unsigned long n, i, start, ns, allocs, collections;
+	size_t bytes;
+	SCM stats;
+	n = scm_to_ulong(iterations);
+	GC_gcollect();
+	heap_begin(&sample);
+	allocs = (alloc_counter != NULL ? *alloc_counter : 0);
+	start = now_ns();
+	for (i = 0; i < n; i++) scm_call_0(thunk);
+	ns = now_ns() - start;
+	if (alloc_counter != NULL) allocs = *alloc_counter - allocs;
+	bytes = GC_get_total_bytes() - sample.bytes;
+	collections = GC_get_gc_no() - sample.collections;
+	stats = SCM_EOL;
+	stats = scm_acons(scm_from_latin1_symbol("collections"),
+			scm_from_ulong(collections), stats);
+	stats = scm_acons(scm_from_latin1_symbol("allocs"),
+			(alloc_counter != NULL ? scm_from_ulong(allocs) :
+			SCM_BOOL_F), stats);
+	stats = scm_acons(scm_from_latin1_symbol("gc-bytes"),
+			scm_from_size_t(bytes), stats);
+	stats = scm_acons(scm_from_latin1_symbol("ns"),
+			scm_from_ulong(ns), stats);
+	stats = scm_acons(scm_from_latin1_symbol("iterations"),
+			scm_from_ulong(n), stats);
+	scm_remember_upto_here_2(thunk, iterations);
+	scm_remember_upto_here_1(stats);
+	return stats;
+	}
+
+static int cmp_ulong(const void *a, const void *b) {
+	unsigned long x = *(const unsigned long *)a;
+	unsigned long y = *(const unsigned long *)b;
+	return (x < y ? -1 : (x > y));
+	}
+
+static unsigned long rank(const unsigned long *sorted, unsigned long n,
+		double q) {
+	unsigned long i;
+	i = (unsigned long)(q * n + 0.5);
+	if (i > 0) i--;
+	return sorted[(i < n ? i : n - 1)];
+	}
+
+static SCM bench_latency(SCM thunk, SCM iterations) {
+	unsigned long n, i, start, total, *lat;
+	SCM stats;
+	n = scm_to_ulong(iterations);
+	if (n == 0) return SCM_BOOL_F;
+	if (n > SIZE_MAX / sizeof(unsigned long))
+		scm_memory_error("bench-latency");
+	lat = (unsigned long *)malloc(n * sizeof(unsigned long));
+	if (lat == NULL) scm_memory_error("bench-latency");
+	scm_dynwind_begin(0);
+	scm_dynwind_free(lat); // the thunk may throw
+	total = 0;
+	for (i = 0; i < n; i++) {
+		start = now_ns();
+		scm_call_0(thunk);
+		lat[i] = now_ns() - start;
+		total += lat[i];
+		}
+	qsort(lat, n, sizeof(unsigned long), cmp_ulong);
+	stats = SCM_EOL;
+	stats = scm_acons(scm_from_latin1_symbol("max"),
+			scm_from_ulong(lat[n - 1]), stats);
+	stats = scm_acons(scm_from_latin1_symbol("p999"),
+			scm_from_ulong(rank(lat, n, 0.999)), stats);
+	stats = scm_acons(scm_from_latin1_symbol("p99"),
+			scm_from_ulong(rank(lat, n, 0.99)), stats);
+	stats = scm_acons(scm_from_latin1_symbol("p50"),
+			scm_from_ulong(rank(lat, n, 0.50)), stats);
+	stats = scm_acons(scm_from_latin1_symbol("ns"),
+			scm_from_ulong(total), stats);
+	stats = scm_acons(scm_from_latin1_symbol("iterations"),
+			scm_from_ulong(n), stats);
+	scm_dynwind_end();
+	scm_remember_upto_here_2(thunk, iterations);
+	scm_remember_upto_here_1(stats);
+	return stats;
+	}
+
+static SCM bench_counting(void) {
+	return (alloc_counter != NULL ? SCM_BOOL_T : SCM_BOOL_F);
+	}
+
+static SCM pg_make_result(SCM fields, SCM types, SCM rows) {
+	PGresult *res;
+	PGresAttDesc *attrs;
+	SCM node, row, cell;
+	char *value;
+	int i, tuple, nfields;
+	// check everything first: nothing below may throw and leak
+	nfields = scm_ilength(fields);
+	SCM_ASSERT(nfields >= 0, fields, SCM_ARG1, "pg-make-result");
+	SCM_ASSERT(scm_ilength(types) == nfields, types, SCM_ARG2,
+			"pg-make-result");
+	for (node = fields, row = types; scm_is_pair(node);
+			node = SCM_CDR(node), row = SCM_CDR(row)) {
+		SCM_ASSERT(scm_is_symbol(SCM_CAR(node)) ||
+				scm_is_string(SCM_CAR(node)), fields, SCM_ARG1,
+				"pg-make-result");
+		SCM_ASSERT(scm_is_unsigned_integer(SCM_CAR(row), 0, UINT_MAX),
+				types, SCM_ARG2, "pg-make-result");
+		}
+	SCM_ASSERT(scm_ilength(rows) >= 0, rows, SCM_ARG3, "pg-make-result");
+	for (node = rows; scm_is_pair(node); node = SCM_CDR(node)) {
+		SCM_ASSERT(scm_ilength(SCM_CAR(node)) == nfields, rows, SCM_ARG3,
+				"pg-make-result");
+		}
+	res = PQmakeEmptyPGresult(NULL, PGRES_TUPLES_OK);
+	attrs = (PGresAttDesc *)calloc(nfields, sizeof(PGresAttDesc));
+	node = fields;
+	row = types;
+	for (i = 0; i < nfields; i++) {
+		if (scm_is_symbol(SCM_CAR(node)))
+			attrs[i].name = scm_to_utf8_string(
+				scm_symbol_to_string(SCM_CAR(node)));
+		else attrs[i].name = scm_to_utf8_string(SCM_CAR(node));
+		attrs[i].typid = scm_to_uint(SCM_CAR(row));
+		attrs[i].typlen = -1;
+		attrs[i].atttypmod = -1;
+		node = SCM_CDR(node);
+		row = SCM_CDR(row);
+		}
+	PQsetResultAttrs(res, nfields, attrs);
+	for (i = 0; i < nfields; i++) free(attrs[i].name);
+	free(attrs);
+	tuple = 0;
+	for (node = rows; !scm_is_null(node); node = SCM_CDR(node)) {
+		row = SCM_CAR(node);
+		for (i = 0; i < nfields; i++, row = SCM_CDR(row)) {
+			cell = SCM_CAR(row);
+			if (!scm_is_string(cell)) {
+				PQsetvalue(res, tuple, i, NULL, -1);
+				continue;
+				}
+			value = scm_to_utf8_string(cell);
+			PQsetvalue(res, tuple, i, value, strlen(value));
+			free(value);
+			}
+		tuple++;
+		}
+	scm_remember_upto_here_2(fields, types);
+	scm_remember_upto_here_2(rows, cell);
+	return pg_result_smob(res);
+	}
+
+void init_gusherbench(void) {
+	alloc_counter = (volatile unsigned long *)dlsym(RTLD_DEFAULT,
+			"bench_allocs");
+	scm_c_define_gsubr("bench-run", 2, 0, 0, bench_run);
+	scm_c_define_gsubr("bench-latency", 2, 0, 0, bench_latency);
+	scm_c_define_gsubr("bench-counting-allocs?", 0, 0, 0,
+			bench_counting);
+	scm_c_define_gsubr("pg-make-result", 3, 0, 0, pg_make_result);
+	}
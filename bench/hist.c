@@ -0,0 +1,64 @@
+/*
+** Copyright (c) 2013 Peter Yadlowsky <pmy@virginia.edu>
+**
+** This program is free software ; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation ; either version 3 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY ; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program ; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+#include "hist.h"
+
+static int bucket_of(unsigned long us) {
+	int e, idx;
+	if (us < SUB_COUNT) return (int)us;
+	e = 63 - __builtin_clzl(us);
+	idx = (e - SUB_BITS + 1) * SUB_COUNT +
+			(int)((us >> (e - SUB_BITS)) & (SUB_COUNT - 1));
+	return (idx < HIST_BUCKETS ? idx : HIST_BUCKETS - 1);
+	}
+
+static unsigned long bucket_top(int idx) {
+	int e, sub;
+	if (idx < SUB_COUNT) return idx + 1;
+	e = idx / SUB_COUNT + SUB_BITS - 1;
+	sub = idx % SUB_COUNT;
+	return (unsigned long)(SUB_COUNT + sub + 1) << (e - SUB_BITS);
+	}
+
+void hist_add(HIST *hist, unsigned long us) {
+	hist->count++;
+	hist->bucket[bucket_of(us)]++;
+	if (us > hist->max) hist->max = us;
+	}
+
+void hist_merge(HIST *into, const HIST *from) {
+	int b;
+	into->count += from->count;
+	if (from->max > into->max) into->max = from->max;
+	for (b = 0; b < HIST_BUCKETS; b++) into->bucket[b] += from->bucket[b];
+	}
+
+unsigned long percentile(const HIST *hist, double q) {
+	unsigned long want, seen, top;
+	int b;
+	if (hist->count == 0) return 0;
+	want = (unsigned long)(q * hist->count + 0.5);
+	if (want == 0) want = 1;
+	seen = 0;
+	for (b = 0; b < HIST_BUCKETS; b++) {
+		seen += hist->bucket[b];
+		if (seen >= want) break;
+		}
+	top = bucket_top(b);
+	return (top < hist->max ? top : hist->max);
+	}
@@ -0,0 +1,37 @@
+/*
+** Copyright (c) 2013 Peter Yadlowsky <pmy@virginia.edu>
+**
+** This program is free software ; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation ; either version 3 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY ; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program ; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+/*
+** Log-linear latency histograms for the bench tools: exact below
+** SUB_COUNT, then SUB_COUNT buckets per power of two, so any value
+** is within 1/SUB_COUNT of its bucket's top.
+*/
+
+#define SUB_BITS 3
+#define SUB_COUNT (1 << SUB_BITS)
+#define HIST_BUCKETS ((36 - SUB_BITS + 1) * SUB_COUNT)
+
+typedef struct hist {
+	unsigned long count;
+	unsigned long max;
+	unsigned long bucket[HIST_BUCKETS];
+	} HIST;
+
+void hist_add(HIST *, unsigned long);
+void hist_merge(HIST *, const HIST *);
+unsigned long percentile(const HIST *, double);
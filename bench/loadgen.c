@@ -0,0 +1,397 @@
+/*
+** Copyright (c) 2013 Peter Yadlowsky <pmy@virginia.edu>
+**
+** This program is free software ; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation ; either version 3 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY ; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program ; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+/*
+** HTTP load generator for benchmarking gusher.
+**
+**	loadgen [-H host] [-p port] [-c conns] [-d secs] [-w warmup]
+**		[-k] [-s slow-ms] [-S slow-conns] [-m mixfile] [-o results]
+**		[-b baseline] [-t tolerance-pct] [-l label]
+**
+** Each of the conns threads runs one client connection, drawing
+** requests from the weighted mix. -k reuses connections where the
+** server allows it; -s sends each request in 8-byte pieces with a
+** pause between them, like a slow client. With -S only that many of
+** the conns are slow: they run alongside the others to tie up the
+** server and are left out of the results, which then show what the
+** normal-rate clients see. A client that can't connect backs off,
+** doubling from 1 ms to 100 ms. Latency is kept in log-linear
+** microsecond histograms, merged at the end.
+**
+** Mix file lines: weight method path [json|form|multipart bytes]
+*/
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "hist.h"
+#include "net.h"
+
+#define MAX_MIX 64
+#define BOUNDARY "gusherbenchboundary"
+#define BACKOFF_MIN_US 1000
+#define BACKOFF_MAX_US 100000
+
+typedef struct mix {
+	int weight;
+	char method[8];
+	char path[256];
+	char *keep; // full request, keep-alive
+	char *close; // full request, connection: close
+	size_t klen, clen;
+	unsigned long done, errors;
+	} MIX;
+
+typedef struct client {
+	pthread_t tid;
+	unsigned int seed;
+	int sock;
+	int slow; // trickles its requests, unmeasured under -S
+	HIST hist;
+	unsigned long done, errors, reconnects;
+	unsigned long per_mix[MAX_MIX];
+	unsigned long per_mix_err[MAX_MIX];
+	} CLIENT;
+
+static const char *host = "127.0.0.1";
+static int port = 8080;
+static int conns = 16;
+static double duration = 10;
+static double warmup = 1;
+static int keep_alive = 0;
+static int slow_ms = 0;
+static int slow_conns = -1; // all of them, unless -S
+static MIX mix[MAX_MIX];
+static int nmix = 0;
+static int total_weight = 0;
+static double t_start, t_measure, t_stop;
+
+static char *make_body(const char *kind, size_t size, size_t *len,
+		char *ctype, size_t csize) {
+	char *body, *pt;
+	size_t head;
+	body = (char *)malloc(size + 512);
+	if (strcmp(kind, "json") == 0) {
+		snprintf(ctype, csize, "application/json");
+		pt = body + sprintf(body, "{\"n\":42,\"pad\":\"");
+		memset(pt, 'x', size);
+		strcpy(pt + size, "\"}");
+		}
+	else if (strcmp(kind, "form") == 0) {
+		snprintf(ctype, csize, "application/x-www-form-urlencoded");
+		pt = body + sprintf(body, "n=42&pad=");
+		memset(pt, 'x', size);
+		pt[size] = '\0';
+		}
+	else {
+		snprintf(ctype, csize, "multipart/form-data; boundary=%s",
+				BOUNDARY);
+		head = sprintf(body, "--%s\r\ncontent-disposition: form-data; "
+				"name=\"file\"; filename=\"bench.bin\"\r\n"
+				"content-type: application/octet-stream\r\n\r\n",
+				BOUNDARY);
+		memset(body + head, 'x', size);
+		sprintf(body + head + size, "\r\n--%s--\r\n", BOUNDARY);
+		}
+	*len = strlen(body);
+	return body;
+	}
+
+static char *make_request(MIX *entry, int keep, const char *body,
+		size_t blen, const char *ctype, size_t *len) {
+	char *req;
+	size_t n;
+	req = (char *)malloc(1024 + blen);
+	n = sprintf(req, "%s %s HTTP/1.1\r\nhost: %s:%d\r\n"
+			"user-agent: gusher-loadgen\r\nconnection: %s\r\n",
+			entry->method, entry->path, host, port,
+			(keep ? "keep-alive" : "close"));
+	if (body != NULL)
+		n += sprintf(req + n, "content-type: %s\r\n"
+				"content-length: %lu\r\n", ctype, (unsigned long)blen);
+	n += sprintf(req + n, "\r\n");
+	if (body != NULL) {
+		memcpy(req + n, body, blen);
+		n += blen;
+		}
+	*len = n;
+	return req;
+	}
+
+static void add_mix(int weight, const char *method, const char *path,
+		const char *kind, size_t size) {
+	MIX *entry;
+	char *body, ctype[128];
+	size_t blen;
+	if (nmix >= MAX_MIX) return;
+	entry = &mix[nmix++];
+	memset(entry, 0, sizeof(MIX));
+	entry->weight = weight;
+	snprintf(entry->method, sizeof(entry->method), "%s", method);
+	snprintf(entry->path, sizeof(entry->path), "%s", path);
+	body = NULL;
+	blen = 0;
+	if (kind != NULL) body = make_body(kind, size, &blen, ctype,
+			sizeof(ctype));
+	entry->keep = make_request(entry, 1, body, blen, ctype, &entry->klen);
+	entry->close = make_request(entry, 0, body, blen, ctype,
+			&entry->clen);
+	free(body);
+	total_weight += weight;
+	}
+
+static int load_mix(const char *path) {
+	FILE *fp;
+	char line[512], method[16], upath[256], kind[16];
+	unsigned long size;
+	int weight, n;
+	if ((fp = fopen(path, "r")) == NULL) {
+		fprintf(stderr, "can't open mix %s: %s\n", path, strerror(errno));
+		return 0;
+		}
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		if ((line[0] == '#') || (line[0] == '\n')) continue;
+		n = sscanf(line, "%d %15s %255s %15s %lu", &weight, method, upath,
+				kind, &size);
+		if (n == 3) add_mix(weight, method, upath, NULL, 0);
+		else if (n == 5) add_mix(weight, method, upath, kind, size);
+		else fprintf(stderr, "bad mix line: %s", line);
+		}
+	fclose(fp);
+	return (nmix > 0);
+	}
+
+static MIX *pick(CLIENT *client, int *idx) {
+	int r, i;
+	r = rand_r(&client->seed) % total_weight;
+	for (i = 0; i < nmix - 1; i++) {
+		if (r < mix[i].weight) break;
+		r -= mix[i].weight;
+		}
+	*idx = i;
+	return &mix[i];
+	}
+
+static void *run_client(void *data) {
+	CLIENT *client = (CLIENT *)data;
+	MIX *entry;
+	double start, now;
+	unsigned long us, backoff;
+	int idx, status, reuse, fresh;
+	client->sock = -1;
+	backoff = 0;
+	while ((now = now_secs()) < t_stop) {
+		entry = pick(client, &idx);
+		start = now;
+		status = 0;
+		for (fresh = 0; fresh < 2; fresh++) {
+			if (client->sock < 0) {
+				if ((client->sock = connect_server()) < 0) break;
+				fresh = 1;
+				}
+			if (!send_all(client->sock, (keep_alive ? entry->keep :
+					entry->close), (keep_alive ? entry->klen :
+					entry->clen), (client->slow ? slow_ms : 0), t_stop))
+				status = 0;
+			else status = read_response(client->sock, keep_alive, &reuse);
+			if ((status <= 0) || !reuse) {
+				close(client->sock);
+				client->sock = -1;
+				}
+			if (status != 0) break;
+			client->reconnects++; // stale keep-alive: retry once
+			}
+		if ((client->sock < 0) && (status == 0)) {
+			// refused or reset: don't spin on a server that's down
+			backoff = (backoff == 0 ? BACKOFF_MIN_US : backoff * 2);
+			if (backoff > BACKOFF_MAX_US) backoff = BACKOFF_MAX_US;
+			usleep(backoff);
+			}
+		else backoff = 0;
+		now = now_secs();
+		if ((status <= 0) && (now >= t_stop)) break; // cut off at the end
+		if (client->slow && (slow_conns >= 0)) continue;
+		if (start < t_measure) continue;
+		if ((status < 200) || (status >= 400)) {
+			client->errors++;
+			client->per_mix_err[idx]++;
+			continue;
+			}
+		us = (unsigned long)((now - start) * 1e6);
+		hist_add(&client->hist, us);
+		client->done++;
+		client->per_mix[idx]++;
+		}
+	if (client->sock >= 0) close(client->sock);
+	return NULL;
+	}
+
+static double baseline_value(const char *path, const char *key) {
+	FILE *fp;
+	char name[64];
+	double value;
+	if ((fp = fopen(path, "r")) == NULL) return -1;
+	while (fscanf(fp, "%63s %lf", name, &value) == 2) {
+		if (strcmp(name, key) == 0) {
+			fclose(fp);
+			return value;
+			}
+		}
+	fclose(fp);
+	return -1;
+	}
+
+/*
+** Compare against a stored run; returns the number of metrics that
+** got worse by more than tolerance percent.
+*/
+static int compare(const char *path, const char *key, double value,
+		int higher_better, double tolerance) {
+	double base, change;
+	if ((base = baseline_value(path, key)) <= 0) return 0;
+	change = (value - base) / base * 100;
+	printf("  %-10s %12.1f  baseline %12.1f  %+6.1f%%", key, value, base,
+			change);
+	if ((higher_better && (change < -tolerance)) ||
+			(!higher_better && (change > tolerance))) {
+		printf("  REGRESSION\n");
+		return 1;
+		}
+	printf("\n");
+	return 0;
+	}
+
+int main(int argc, char **argv) {
+	CLIENT *clients;
+	HIST total;
+	const char *mixfile, *outfile, *basefile, *label;
+	unsigned long done, errors, reconnects, n, e;
+	double secs, rps, tolerance;
+	int opt, i, j, worse, slow;
+	FILE *fp;
+	mixfile = outfile = basefile = NULL;
+	label = "run";
+	tolerance = 10;
+	while ((opt = getopt(argc, argv, "H:p:c:d:w:ks:S:m:o:b:t:l:")) != -1) {
+		switch (opt) {
+			case 'H': host = optarg; break;
+			case 'p': port = atoi(optarg); break;
+			case 'c': conns = atoi(optarg); break;
+			case 'd': duration = atof(optarg); break;
+			case 'w': warmup = atof(optarg); break;
+			case 'k': keep_alive = 1; break;
+			case 's': slow_ms = atoi(optarg); break;
+			case 'S': slow_conns = atoi(optarg); break;
+			case 'm': mixfile = optarg; break;
+			case 'o': outfile = optarg; break;
+			case 'b': basefile = optarg; break;
+			case 't': tolerance = atof(optarg); break;
+			case 'l': label = optarg; break;
+			default:
+				fprintf(stderr, "usage: %s [-H host] [-p port] [-c conns] "
+					"[-d secs] [-w warmup] [-k] [-s slow-ms] "
+					"[-S slow-conns] [-m mix] [-o out] [-b baseline] "
+					"[-t pct] [-l label]\n",
+					argv[0]);
+				return 2;
+			}
+		}
+	if (conns < 1) conns = 1;
+	if (slow_ms <= 0) slow_conns = 0;
+	if ((slow_conns >= conns) || (slow_conns < -1)) {
+		fprintf(stderr, "-S must leave some normal clients\n");
+		return 2;
+		}
+	slow = (slow_conns < 0 ? conns : slow_conns);
+	if (mixfile != NULL) {
+		if (!load_mix(mixfile)) return 2;
+		}
+	else add_mix(1, "GET", "/", NULL, 0);
+	if (!resolve(host, port)) {
+		fprintf(stderr, "can't resolve %s\n", host);
+		return 2;
+		}
+	clients = (CLIENT *)calloc(conns, sizeof(CLIENT));
+	t_start = now_secs();
+	t_measure = t_start + warmup;
+	t_stop = t_measure + duration;
+	for (i = 0; i < conns; i++) {
+		clients[i].seed = (unsigned int)(t_start * 1000) + i;
+		clients[i].slow = (i < slow);
+		pthread_create(&clients[i].tid, NULL, run_client, &clients[i]);
+		}
+	memset(&total, 0, sizeof(total));
+	done = errors = reconnects = 0;
+	for (i = 0; i < conns; i++) {
+		pthread_join(clients[i].tid, NULL);
+		done += clients[i].done;
+		errors += clients[i].errors;
+		reconnects += clients[i].reconnects;
+		hist_merge(&total, &clients[i].hist);
+		}
+	secs = duration;
+	rps = done / secs;
+	printf("%s: %d conns, %.0fs, %s", label, conns, secs,
+			(keep_alive ? "keep-alive" : "close"));
+	if (slow_conns > 0)
+		printf(", %d slow clients alongside (not measured)\n", slow);
+	else printf("%s\n", (slow > 0 ? ", slow client" : ""));
+	printf("  requests %lu  errors %lu  reconnects %lu  %.1f req/s\n",
+			done, errors, reconnects, rps);
+	printf("  latency us: p50 %lu  p99 %lu  p999 %lu  max %lu\n",
+			percentile(&total, 0.50), percentile(&total, 0.99),
+			percentile(&total, 0.999), total.max);
+	for (j = 0; j < nmix; j++) {
+		n = e = 0;
+		for (i = 0; i < conns; i++) {
+			n += clients[i].per_mix[j];
+			e += clients[i].per_mix_err[j];
+			}
+		printf("  %-6s %-32s %10lu ok %8lu err\n", mix[j].method,
+				mix[j].path, n, e);
+		}
+	if (outfile != NULL) {
+		if ((fp = fopen(outfile, "w")) != NULL) {
+			fprintf(fp, "rps %.1f\np50 %lu\np99 %lu\np999 %lu\n"
+					"errors %lu\n", rps, percentile(&total, 0.50),
+					percentile(&total, 0.99), percentile(&total, 0.999),
+					errors);
+			fclose(fp);
+			}
+		}
+	worse = 0;
+	if (basefile != NULL) {
+		printf("  against %s (tolerance %.0f%%):\n", basefile, tolerance);
+		worse += compare(basefile, "rps", rps, 1, tolerance);
+		worse += compare(basefile, "p50", percentile(&total, 0.50), 0,
+				tolerance);
+		worse += compare(basefile, "p99", percentile(&total, 0.99), 0,
+				tolerance);
+		worse += compare(basefile, "p999", percentile(&total, 0.999), 0,
+				tolerance);
+		}
+	free(clients);
+	return (worse > 0 ? 1 : 0);
+	}
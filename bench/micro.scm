@@ -0,0 +1,154 @@
+; Microbenchmarks for the C primitives behind the hot request paths.
+; Loaded by run_micro as "gusher -s -p PORT report.scm micro.scm";
+; each case is run under bench-run with the iteration count doubled
+; until a run takes at least GUSHER_MICRO_MS milliseconds (default
+; 200).
+;
+; Rows: {"name":"json-encode","size":4096,"iterations":..,
+;  "ns_per_op":..,"allocs_per_op":..,"gc_bytes_per_op":..}
+; allocs_per_op counts malloc-family calls and is null unless
+; bench/liballocs.so is preloaded. bench-run and pg-make-result come
+; from gusherbench.so, built alongside. Output, baseline and tolerance
+; come from GUSHER_MICRO_OUT, GUSHER_MICRO_BASELINE and
+; GUSHER_MICRO_TOLERANCE (see report.scm); a case regresses when it
+; is slower or allocates more than the tolerance allows.
+
+(load-extension "./gusherbench.so" "init_gusherbench")
+
+(define min-ns (* (bench-env "GUSHER_MICRO_MS" 200) 1000000))
+(define sizes '(64 4096 262144 1048576))
+
+; iteration counts are capped so the MB cases don't run for minutes
+(define (measure thunk)
+	(thunk)
+	(let loop ((n 1))
+		(let ((stats (bench-run thunk n)))
+			(if (or (>= (assq-ref stats 'ns) min-ns) (>= n 1048576))
+				stats
+				(loop (* n 2))))))
+
+(define results '())
+
+(define (case! name size thunk)
+	(let* ((stats (measure thunk))
+			(n (assq-ref stats 'iterations))
+			(allocs (assq-ref stats 'allocs)))
+		(set! results (cons (list (cons 'name name) (cons 'size size)
+			(cons 'iterations n)
+			(cons 'ns_per_op (/ (assq-ref stats 'ns) n 1.0))
+			(cons 'allocs_per_op (and allocs (/ allocs n 1.0)))
+			(cons 'gc_bytes_per_op (/ (assq-ref stats 'gc-bytes) n 1.0)))
+			results))))
+
+; inputs
+
+(define (filler size)
+	(make-string size #\x))
+
+(define (template-of size)
+	(let loop ((parts '()) (len 0) (i 0))
+		(if (>= len size)
+			(apply string-append (reverse parts))
+			(let ((part (string-append "<p>[[F" (number->string (modulo i 8))
+						"]] some text around the slot</p>\n")))
+				(loop (cons part parts) (+ len (string-length part))
+					(+ i 1))))))
+
+(define template-slots
+	(map (lambda (i)
+			(cons (string->symbol (string-append "f" (number->string i)))
+				(string-append "value " (number->string i))))
+		(iota 8)))
+
+(define (record-of size)
+	(let ((row (list (cons 'id 12345) (cons 'name "benchmark row")
+				(cons 'score 98.6) (cons 'active #t)
+				(cons 'tags (list "alpha" "beta")))))
+		(list (cons 'rows (make-list (max 1 (quotient size 80)) row)))))
+
+(define (query-of size)
+	(let loop ((parts '()) (len 0) (i 0))
+		(if (>= len size)
+			(string-join (reverse parts) "&")
+			(let ((part (string-append "key" (number->string i)
+						"=some+value%20with%2Fescapes")))
+				(loop (cons part parts) (+ len (string-length part) 1)
+					(+ i 1))))))
+
+(define (xml-of size)
+	(let loop ((parts '("<doc>")) (len 5) (i 0))
+		(if (>= len size)
+			(apply string-append (reverse (cons "</doc>" parts)))
+			(let ((part (string-append "<item id=\"" (number->string i)
+						"\"><name>entry</name><v>42</v></item>")))
+				(loop (cons part parts) (+ len (string-length part))
+					(+ i 1))))))
+
+(define pg-fields '(id name score created active))
+(define pg-types '(23 25 701 1114 16))
+
+(define (pg-rows-of size)
+	(make-list (max 1 (quotient size 64))
+		(list "12345" "benchmark row" "98.6" "2024-03-01 12:34:56" "t")))
+
+; cases
+
+(for-each
+	(lambda (size)
+		(let ((tmpl (template-of size)))
+			(case! "fill-template" size
+				(lambda () (apply fill-template tmpl #f template-slots)))))
+	sizes)
+
+(for-each
+	(lambda (size)
+		(let* ((rec (record-of size))
+				(text (json-encode rec)))
+			(case! "json-encode" size (lambda () (json-encode rec)))
+			(case! "json-decode" size (lambda () (json-decode text)))))
+	sizes)
+
+; pg-map-rows consumes its result, so the decode case includes
+; building the result; pg-make-result alone is listed for subtraction
+(for-each
+	(lambda (size)
+		(let ((rows (pg-rows-of size)))
+			(case! "pg-make-result" size
+				(lambda () (pg-clear (pg-make-result pg-fields pg-types rows))))
+			(case! "pg-map-rows" size
+				(lambda ()
+					(pg-map-rows (pg-make-result pg-fields pg-types rows))))))
+	'(64 4096 262144))
+
+(let ((t (time-now)))
+	(case! "time-now" 0 time-now)
+	(case! "time-format" 0
+		(lambda () (time-format t "%Y-%m-%d %H:%M:%S"))))
+
+(for-each
+	(lambda (size)
+		(let ((text (filler size)))
+			(case! "sha-256-sum" size (lambda () (sha-256-sum text)))))
+	sizes)
+
+(for-each
+	(lambda (size)
+		(let ((parts (make-list (max 1 (quotient size 16)) "sixteen chars..")))
+			(case! "string-cat" size
+				(lambda () (apply string-cat "," parts)))))
+	sizes)
+
+(for-each
+	(lambda (size)
+		(let ((query (query-of size)))
+			(case! "parse-query" size (lambda () (parse-query query)))))
+	sizes)
+
+(for-each
+	(lambda (size)
+		(let ((doc (xml-of size)))
+			(case! "xml-parse" size (lambda () (xml-parse doc)))))
+	sizes)
+
+(bench-finish "GUSHER_MICRO" (reverse results) '(name size)
+	'((ns_per_op . #f) (allocs_per_op . #f)))
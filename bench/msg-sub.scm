@@ -0,0 +1,42 @@
+; Subscriber side of the messaging benchmark; run_msg starts a few
+; of these as "gusher -p PORT msg-sub.scm". Each subscribes to the
+; bench key through messaging.scm and records, for the current run,
+; how many messages arrived and how late (microseconds from the
+; publisher's send stamp, same host clock). msg.scm resets and
+; collects these over HTTP.
+
+(use-modules (ice-9 threads) (gusher messaging))
+
+(configure-database (getenv "GUSHER_BENCH_PG"))
+
+(define run-id #f)
+(define received 0)
+(define latencies '())
+(define lock (make-mutex))
+
+(define (now-us)
+	(let ((t (gettimeofday)))
+		(+ (* (car t) 1000000) (cdr t))))
+
+(msg-subscribe 'bench
+	(lambda (msg)
+		(let ((late (- (now-us)
+						(inexact->exact (round (assq-ref msg 'sent))))))
+			(with-mutex lock
+				(when (equal? (assq-ref msg 'run) run-id)
+					(set! received (+ received 1))
+					(set! latencies (cons late latencies)))))))
+
+(http-json "/bench-reset"
+	(lambda (req)
+		(with-mutex lock
+			(set! run-id (query-value req 'run))
+			(set! received 0)
+			(set! latencies '()))
+		(list (cons 'status #t))))
+
+(http-json "/bench-stats"
+	(lambda (req)
+		(with-mutex lock
+			(list (cons 'run run-id) (cons 'received received)
+				(cons 'latencies latencies)))))
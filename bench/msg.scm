@@ -0,0 +1,133 @@
+; Messaging benchmark driver, the publisher side. Loaded by run_msg
+; as "gusher -s -p PORT report.scm msg.scm" once the msg-sub.scm
+; subscribers listed in GUSHER_MSG_PORTS are up.
+;
+; For each subscriber count and payload size the bench key's callback
+; list is set to that many URLs, spread over the subscriber processes
+; (a query string tells them apart), and msg-publish is called for a
+; batch of messages. msg-publish delivers to each callback in turn
+; and waits for it, so when the batch returns every delivery has been
+; made or has failed; the subscribers' counts then give the loss and
+; their send-to-receipt times the latency.
+;
+; Rows: {"transport":"http","subscribers":100,"payload":1024,
+;  "messages":..,"msgs_per_sec":..,"deliveries_per_sec":..,"lost":..,
+;  "p50_us":..,"p99_us":..,"p999_us":..,"max_us":..}
+; GUSHER_MSG_MAX_SUBS and GUSHER_MSG_MAX_PAYLOAD cap the grid and
+; GUSHER_MSG_BUDGET (default 20000) is the delivery count a case aims
+; for. Payloads stop at 64 KB: a 1 MB message is over the subscriber's
+; POST_MEM_MAX, so it would measure that limit, not loss. Output and
+; baseline handling is report.scm's, under GUSHER_MSG_*.
+
+(use-modules (gusher messaging) (gusher kv))
+
+(define conninfo (getenv "GUSHER_BENCH_PG"))
+(define ports
+	(map string->number
+		(string-split (or (getenv "GUSHER_MSG_PORTS") "") #\space)))
+(define max-subs (bench-env "GUSHER_MSG_MAX_SUBS" 1000))
+(define max-payload (bench-env "GUSHER_MSG_MAX_PAYLOAD" 65536))
+(define budget (bench-env "GUSHER_MSG_BUDGET" 20000))
+
+(unless (and conninfo (pair? ports) (car ports))
+	(display "GUSHER_BENCH_PG and GUSHER_MSG_PORTS must be set\n")
+	(primitive-exit 2))
+
+(configure-database conninfo)
+
+(define (now-us)
+	(let ((t (gettimeofday)))
+		(+ (* (car t) 1000000) (cdr t))))
+
+(define (subscriber-url port path)
+	(format #f "http://127.0.0.1:~a~a" port path))
+
+(define (set-callbacks! subs)
+	(let ((kvh (kv-open "subscriptions")))
+		(kv-set kvh 'bench
+			(json-encode
+				(map (lambda (i)
+						(subscriber-url
+							(list-ref ports (modulo i (length ports)))
+							(format #f "/msg-bench?sub=~a" i)))
+					(iota subs))))
+		(kv-close kvh)))
+
+(define (reset! run)
+	(for-each
+		(lambda (port)
+			(http-get (subscriber-url port
+				(string-append "/bench-reset?run=" run))))
+		ports))
+
+; (received . latencies) summed over the subscribers
+(define (collect run)
+	(let loop ((ports ports) (received 0) (latencies '()))
+		(if (null? ports)
+			(cons received latencies)
+			(let* ((reply (http-get (subscriber-url (car ports)
+								"/bench-stats")))
+					(stats (and reply (pair? (cdr reply)) (cdr reply))))
+				(if (and stats (equal? (assq-ref stats 'run) run))
+					(loop (cdr ports)
+						(+ received (assq-ref stats 'received))
+						(let ((more (assq-ref stats 'latencies)))
+							(if (list? more) (append more latencies) latencies)))
+					(loop (cdr ports) received latencies))))))
+
+(define (rank sorted q)
+	(if (null? sorted)
+		0
+		(let ((i (inexact->exact (round (* q (length sorted))))))
+			(list-ref sorted (max 0 (min (- (length sorted) 1) (- i 1)))))))
+
+(define results '())
+
+(define (case! subs size)
+	(let* ((run (format #f "s~a-p~a" subs size))
+			(pad (make-string size #\x))
+			(weight (* subs (max 1 (quotient size 65536))))
+			(messages (max 3 (min 1000 (quotient budget weight))))
+			(start 0)
+			(secs 0))
+		(set-callbacks! subs)
+		(reset! run)
+		(set! start (now-us))
+		(do ((i 0 (+ i 1))) ((= i messages))
+			(msg-publish 'bench
+				(json-encode (list (cons 'run run) (cons 'seq i)
+					(cons 'sent (exact->inexact (now-us)))
+					(cons 'pad pad)))))
+		(set! secs (/ (- (now-us) start) 1e6))
+		(let* ((got (collect run))
+				(sorted (sort (cdr got) <))
+				(expected (* messages subs)))
+			(set! results (cons (list (cons 'transport "http")
+				(cons 'subscribers subs) (cons 'payload size)
+				(cons 'messages messages)
+				(cons 'msgs_per_sec (/ messages secs))
+				(cons 'deliveries_per_sec (/ (car got) secs))
+				(cons 'lost (- expected (car got)))
+				(cons 'p50_us (rank sorted 0.50))
+				(cons 'p99_us (rank sorted 0.99))
+				(cons 'p999_us (rank sorted 0.999))
+				(cons 'max_us (if (null? sorted) 0 (car (last-pair sorted)))))
+				results))
+			(format #t "http ~5d subs ~8d B ~10,1f deliveries/s  lost ~a  p50 ~a  p99 ~a us\n"
+				subs size (/ (car got) secs) (- expected (car got))
+				(rank sorted 0.50) (rank sorted 0.99)))))
+
+(for-each
+	(lambda (subs)
+		(for-each
+			(lambda (size) (case! subs size))
+			(filter (lambda (size) (<= size max-payload))
+				'(10 1024 65536))))
+	(filter (lambda (subs) (<= subs max-subs)) '(1 10 100 1000)))
+
+(let ((kvh (kv-open "subscriptions")))
+	(kv-del kvh 'bench)
+	(kv-close kvh))
+
+(bench-finish "GUSHER_MSG" (reverse results) '(transport subscribers payload)
+	'((deliveries_per_sec . #t) (p99_us . #f) (lost . #f)))
@@ -0,0 +1,142 @@
+/*
+** Copyright (c) 2013 Peter Yadlowsky <pmy@virginia.edu>
+**
+** This program is free software ; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation ; either version 3 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY ; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program ; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "net.h"
+
+#define RBUF_SIZE 65536
+
+static struct sockaddr_storage addr;
+static socklen_t addrlen;
+
+double now_secs(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+	}
+
+int resolve(const char *host, int port) {
+	struct addrinfo hints, *res;
+	char sport[16];
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	snprintf(sport, sizeof(sport), "%d", port);
+	if (getaddrinfo(host, sport, &hints, &res) != 0) return 0;
+	memcpy(&addr, res->ai_addr, res->ai_addrlen);
+	addrlen = res->ai_addrlen;
+	freeaddrinfo(res);
+	return 1;
+	}
+
+int connect_server(void) {
+	int sock, one;
+	sock = socket(addr.ss_family, SOCK_STREAM, 0);
+	if (sock < 0) return -1;
+	one = 1;
+	setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	if (connect(sock, (struct sockaddr *)&addr, addrlen) != 0) {
+		close(sock);
+		return -1;
+		}
+	return sock;
+	}
+
+/*
+** With pause_ms set, send in 8-byte pieces with that pause between
+** them, like a slow client, giving up once the clock passes until.
+*/
+int send_all(int sock, const char *buf, size_t len, int pause_ms,
+		double until) {
+	ssize_t n;
+	size_t step;
+	while (len > 0) {
+		step = (pause_ms > 0 && len > 8 ? 8 : len);
+		n = send(sock, buf, step, MSG_NOSIGNAL);
+		if (n <= 0) return 0;
+		buf += n;
+		len -= n;
+		if ((pause_ms > 0) && (len > 0)) {
+			if (now_secs() >= until) return 0;
+			usleep(pause_ms * 1000);
+			}
+		}
+	return 1;
+	}
+
+/*
+** Read one response. Returns the status, 0 if the connection
+** closed before any byte (stale keep-alive), -1 on error. *reuse
+** says whether the connection can carry another request; it never
+** can unless keep is set.
+*/
+int read_response(int sock, int keep, int *reuse) {
+	char buf[RBUF_SIZE], *end, *pt;
+	size_t have, need;
+	long clen;
+	ssize_t n;
+	int status;
+	have = 0;
+	end = NULL;
+	*reuse = 0;
+	while (end == NULL) {
+		if (have >= sizeof(buf) - 1) return -1;
+		n = recv(sock, buf + have, sizeof(buf) - 1 - have, 0);
+		if (n <= 0) return (have == 0 ? 0 : -1);
+		have += n;
+		buf[have] = '\0';
+		end = strstr(buf, "\r\n\r\n");
+		}
+	if (sscanf(buf, "HTTP/%*s %d", &status) != 1) return -1;
+	*end = '\0';
+	clen = -1;
+	*reuse = keep;
+	for (pt = strstr(buf, "\r\n"); pt != NULL; pt = strstr(pt + 2, "\r\n")) {
+		if (strncasecmp(pt + 2, "content-length:", 15) == 0)
+			clen = atol(pt + 17);
+		else if ((strncasecmp(pt + 2, "connection:", 11) == 0) &&
+				(strcasestr(pt + 13, "close") != NULL))
+			*reuse = 0;
+		}
+	have -= (end + 4) - buf;
+	if (clen < 0) { // body runs to EOF
+		*reuse = 0;
+		while ((n = recv(sock, buf, sizeof(buf), 0)) > 0) ;
+		return status;
+		}
+	need = ((size_t)clen > have ? clen - have : 0);
+	while (need > 0) {
+		n = recv(sock, buf, (need < sizeof(buf) ? need : sizeof(buf)), 0);
+		if (n <= 0) return -1;
+		need -= n;
+		}
+	return status;
+	}
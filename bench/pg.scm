@@ -0,0 +1,143 @@
+; Database-path benchmarks: connection open, query round trips and
+; row decoding from 1 to 1M rows, kv and session operations.
+; Loaded by run_pg as "gusher -s -p PORT report.scm pg.scm" with
+; GUSHER_BENCH_PG set to the libpq conninfo of a scratch database,
+; which this script seeds (_kv_ through configure-database, plus
+; bench_rows) and leaves in place for the next run.
+;
+; Each case times every call with bench-latency, from gusherbench.so.
+; Rows:
+; {"name":"pg-map-rows","rows":10000,"iterations":..,"ops_per_sec":..,
+;  "rows_per_sec":..,"p50_us":..,"p99_us":..,"p999_us":..,"max_us":..}
+; GUSHER_PG_OPS sets the iterations for the single-row cases
+; (default 2000) and GUSHER_PG_MAX_ROWS caps the decode sizes.
+; Output and baseline handling is report.scm's, under GUSHER_PG_*;
+; a case regresses when ops/s drops or p99 grows past the tolerance.
+
+(use-modules (gusher kv) (gusher session))
+
+(load-extension "./gusherbench.so" "init_gusherbench")
+
+(define conninfo (getenv "GUSHER_BENCH_PG"))
+(define ops (bench-env "GUSHER_PG_OPS" 2000))
+(define max-rows (bench-env "GUSHER_PG_MAX_ROWS" 1000000))
+(define kv-keys-seeded 10000)
+(define sessions-seeded 1000)
+
+(unless conninfo
+	(display "GUSHER_BENCH_PG is not set\n")
+	(primitive-exit 2))
+
+(configure-database conninfo)
+(define dbh (pg-open))
+
+(define (sql query . args)
+	(let ((res (apply pg-exec dbh query args)))
+		(when (pg-error-msg res)
+			(display (pg-error-msg res))
+			(primitive-exit 2))
+		res))
+
+; seed
+
+(define (count-of table)
+	(pg-cell (pg-one-row dbh (string-append "select count(*) as n from "
+		table)) 'n))
+
+(sql "create table if not exists bench_rows (
+	id integer primary key,
+	name varchar,
+	score float8,
+	created timestamp,
+	active boolean,
+	note text)")
+(when (< (count-of "bench_rows") 1000000)
+	(sql "truncate bench_rows")
+	(sql "insert into bench_rows
+		select i, 'row ' || i, i * 1.5,
+			timestamp '2024-01-01' + i * interval '1 second',
+			i % 2 = 0, repeat('x', 40)
+		from generate_series(1, 1000000) as i")
+	(sql "analyze bench_rows"))
+
+(sql "delete from _kv_ where namespace in ('bench', 'bench-new', 'sessions')")
+(sql "insert into _kv_ (namespace, key, value)
+	select 'bench', 'key-' || i, repeat('v', 200)
+	from generate_series(0, ~a) as i" (- kv-keys-seeded 1))
+(sql "insert into _kv_ (namespace, key, value)
+	select 'sessions', 'bench-session-' || i,
+		'{\"user\":' || i || ',\"stamp\":0}'
+	from generate_series(0, ~a) as i" (- sessions-seeded 1))
+
+; cases
+
+(define results '())
+
+(define (case! name rows n thunk)
+	(thunk)
+	(let* ((stats (bench-latency thunk n))
+			(secs (/ (assq-ref stats 'ns) 1e9)))
+		(set! results (cons (list (cons 'name name) (cons 'rows rows)
+			(cons 'iterations n)
+			(cons 'ops_per_sec (/ n secs))
+			(cons 'rows_per_sec (/ (* n rows) secs))
+			(cons 'p50_us (/ (assq-ref stats 'p50) 1000.0))
+			(cons 'p99_us (/ (assq-ref stats 'p99) 1000.0))
+			(cons 'p999_us (/ (assq-ref stats 'p999) 1000.0))
+			(cons 'max_us (/ (assq-ref stats 'max) 1000.0)))
+			results))
+		(format #t "~20a ~8d ~10,1f ops/s  p50 ~10,1f  p99 ~10,1f us\n"
+			name rows (/ n secs) (/ (assq-ref stats 'p50) 1000.0)
+			(/ (assq-ref stats 'p99) 1000.0))))
+
+(case! "pg-open" 0 (max 1 (quotient ops 10))
+	(lambda () (pg-close (pg-open))))
+
+(case! "pg-exec" 1 ops
+	(lambda () (pg-clear (sql "select 1"))))
+
+; exec alone against exec and decode; the difference is pg_decode
+; and build_row
+(for-each
+	(lambda (rows)
+		(let ((query (format #f "select * from bench_rows where id <= ~a"
+						rows))
+				(n (max 3 (quotient 200000 rows))))
+			(case! "pg-exec" rows n
+				(lambda () (pg-clear (sql query))))
+			(case! "pg-map-rows" rows n
+				(lambda () (pg-map-rows (sql query))))))
+	(filter (lambda (rows) (<= rows max-rows))
+		'(1000 10000 100000 1000000)))
+
+(define kvh (cons dbh "bench"))
+
+(define (some-key)
+	(format #f "key-~a" (random kv-keys-seeded)))
+
+(case! "kv-get" 1 ops (lambda () (kv-get kvh (some-key))))
+(case! "kv-exists" 1 ops (lambda () (kv-exists kvh (some-key))))
+(case! "kv-set-update" 1 ops
+	(lambda () (kv-set kvh (some-key) (make-string 200 #\w))))
+
+(define new-key 0)
+(case! "kv-set-insert" 1 ops
+	(lambda ()
+		(set! new-key (+ new-key 1))
+		(kv-set (cons dbh "bench-new") (format #f "key-~a" new-key)
+			(make-string 200 #\n))))
+
+; the session calls open and close their own connection each time
+(define (some-session)
+	(list (cons 'session
+		(format #f "bench-session-~a" (random sessions-seeded)))))
+
+(case! "session-get" 1 (max 1 (quotient ops 4))
+	(lambda () (session-get (some-session) 'user)))
+(case! "session-set" 1 (max 1 (quotient ops 4))
+	(lambda () (session-set (some-session) 'seen #t)))
+
+(pg-close dbh)
+
+(bench-finish "GUSHER_PG" (reverse results) '(name rows)
+	'((ops_per_sec . #t) (p99_us . #f)))
@@ -0,0 +1,241 @@
+/*
+** Copyright (c) 2013 Peter Yadlowsky <pmy@virginia.edu>
+**
+** This program is free software ; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation ; either version 3 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY ; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program ; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+/*
+** Replay a gusher capture file (see capture-to) against a server.
+**
+**	replay [-H host] [-p port] [-c conns] [-x speed] [-n max] capture
+**
+** Requests go out in capture order on up to conns concurrent
+** connections, each at its original arrival offset divided by speed
+** (2 replays twice as fast; 0 sends as fast as the connections
+** allow). When paced, latency is taken from the scheduled send time,
+** so a replay that falls behind shows up in the tail rather than
+** quietly slowing the offered load; sends more than a millisecond
+** behind schedule are counted as late. Latency is reported overall
+** and per route (method and path, query dropped).
+*/
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "hist.h"
+#include "net.h"
+#include "../src/capture.h"
+
+#define MAX_ROUTES 256
+
+typedef struct route {
+	char name[280];
+	unsigned long errors;
+	HIST hist;
+	} ROUTE;
+
+typedef struct entry {
+	unsigned long offset_ns;
+	const char *data;
+	size_t len;
+	int route;
+	} ENTRY;
+
+static const char *host = "127.0.0.1";
+static int port = 8080;
+static int conns = 16;
+static double speed = 1;
+static ENTRY *entries = NULL;
+static int nentries = 0;
+static ROUTE routes[MAX_ROUTES];
+static int nroutes = 0;
+static pthread_mutex_t route_mutex = PTHREAD_MUTEX_INITIALIZER;
+static volatile int next_entry = 0;
+static volatile unsigned long late = 0;
+static double t_start;
+
+static int route_of(const char *head, size_t len) {
+	char name[280];
+	const char *sp, *end;
+	int i, n;
+	sp = memchr(head, ' ', len);
+	end = memchr(head, '\r', len);
+	if ((sp == NULL) || (end == NULL)) return 0;
+	for (n = 0; (head + n < end) && (n < sizeof(name) - 1); n++) {
+		if ((head + n > sp) && ((head[n] == '?') || (head[n] == ' ')))
+			break;
+		name[n] = head[n];
+		}
+	name[n] = '\0';
+	for (i = 0; i < nroutes; i++)
+		if (strcmp(routes[i].name, name) == 0) return i;
+	if (nroutes == MAX_ROUTES) return MAX_ROUTES - 1;
+	strcpy(routes[nroutes].name, name);
+	return nroutes++;
+	}
+
+/*
+** Load the whole capture; entries point into the one buffer.
+*/
+static int load_capture(const char *path, int max) {
+	FILE *fp;
+	char *data;
+	long size, at;
+	CAPTURE_RECORD rec;
+	int room;
+	if ((fp = fopen(path, "r")) == NULL) {
+		fprintf(stderr, "can't open %s: %s\n", path, strerror(errno));
+		return 0;
+		}
+	fseek(fp, 0, SEEK_END);
+	size = ftell(fp);
+	rewind(fp);
+	data = (char *)malloc(size + 1);
+	if (fread(data, 1, size, fp) != size) size = 0;
+	fclose(fp);
+	if ((size < CAPTURE_MAGIC_LEN) ||
+			(memcmp(data, CAPTURE_MAGIC, CAPTURE_MAGIC_LEN) != 0)) {
+		fprintf(stderr, "%s is not a gusher capture\n", path);
+		return 0;
+		}
+	strcpy(routes[0].name, "?");
+	nroutes = 1;
+	room = 1024;
+	entries = (ENTRY *)malloc(room * sizeof(ENTRY));
+	at = CAPTURE_MAGIC_LEN;
+	while ((at + sizeof(rec) <= size) && ((max <= 0) || (nentries < max))) {
+		memcpy(&rec, data + at, sizeof(rec));
+		at += sizeof(rec);
+		if (at + rec.head_len + rec.body_len > size) break; // torn tail
+		if (nentries == room) {
+			room *= 2;
+			entries = (ENTRY *)realloc(entries, room * sizeof(ENTRY));
+			}
+		entries[nentries].offset_ns = rec.offset_ns;
+		entries[nentries].data = data + at;
+		entries[nentries].len = rec.head_len + rec.body_len;
+		entries[nentries].route = route_of(data + at, rec.head_len);
+		nentries++;
+		at += rec.head_len + rec.body_len;
+		}
+	return (nentries > 0);
+	}
+
+static void *run_client(void *data) {
+	ENTRY *entry;
+	ROUTE *route;
+	double due, now, start;
+	int i, sock, status, reuse;
+	while ((i = __sync_fetch_and_add(&next_entry, 1)) < nentries) {
+		entry = &entries[i];
+		start = now_secs();
+		if (speed > 0) {
+			due = t_start + entry->offset_ns / 1e9 / speed;
+			if (due > start) {
+				usleep((useconds_t)((due - start) * 1e6));
+				start = due;
+				}
+			else {
+				if (start - due > 0.001) __sync_fetch_and_add(&late, 1);
+				start = due;
+				}
+			}
+		status = -1;
+		if ((sock = connect_server()) >= 0) {
+			if (send_all(sock, entry->data, entry->len, 0, 0))
+				status = read_response(sock, 0, &reuse);
+			close(sock);
+			}
+		now = now_secs();
+		route = &routes[entry->route];
+		pthread_mutex_lock(&route_mutex);
+		if ((status < 200) || (status >= 400)) route->errors++;
+		else hist_add(&route->hist, (unsigned long)((now - start) * 1e6));
+		pthread_mutex_unlock(&route_mutex);
+		}
+	return NULL;
+	}
+
+static void report(const char *name, const HIST *hist,
+		unsigned long errors) {
+	printf("  %-40s %8lu %6lu %8lu %8lu %8lu %8lu\n", name, hist->count,
+			errors, percentile(hist, 0.50), percentile(hist, 0.99),
+			percentile(hist, 0.999), hist->max);
+	}
+
+int main(int argc, char **argv) {
+	pthread_t *tids;
+	HIST total;
+	unsigned long errors;
+	double secs, span;
+	int opt, i, max;
+	max = 0;
+	while ((opt = getopt(argc, argv, "H:p:c:x:n:")) != -1) {
+		switch (opt) {
+			case 'H': host = optarg; break;
+			case 'p': port = atoi(optarg); break;
+			case 'c': conns = atoi(optarg); break;
+			case 'x': speed = atof(optarg); break;
+			case 'n': max = atoi(optarg); break;
+			default:
+				fprintf(stderr, "usage: %s [-H host] [-p port] [-c conns] "
+					"[-x speed] [-n max] capture\n", argv[0]);
+				return 2;
+			}
+		}
+	if (optind >= argc) {
+		fprintf(stderr, "usage: %s [-H host] [-p port] [-c conns] "
+			"[-x speed] [-n max] capture\n", argv[0]);
+		return 2;
+		}
+	if (conns < 1) conns = 1;
+	if (!load_capture(argv[optind], max)) return 2;
+	if (!resolve(host, port)) {
+		fprintf(stderr, "can't resolve %s\n", host);
+		return 2;
+		}
+	tids = (pthread_t *)calloc(conns, sizeof(pthread_t));
+	t_start = now_secs();
+	for (i = 0; i < conns; i++)
+		pthread_create(&tids[i], NULL, run_client, NULL);
+	for (i = 0; i < conns; i++) pthread_join(tids[i], NULL);
+	secs = now_secs() - t_start;
+	span = entries[nentries - 1].offset_ns / 1e9;
+	memset(&total, 0, sizeof(total));
+	errors = 0;
+	for (i = 0; i < nroutes; i++) {
+		hist_merge(&total, &routes[i].hist);
+		errors += routes[i].errors;
+		}
+	printf("replayed %d requests in %.2fs (captured over %.2fs), "
+			"%d conns, speed %g\n", nentries, secs, span, conns, speed);
+	printf("  %.1f req/s  errors %lu  late %lu\n", nentries / secs,
+			errors, late);
+	printf("  %-40s %8s %6s %8s %8s %8s %8s\n", "route (latency us)",
+			"ok", "err", "p50", "p99", "p999", "max");
+	report("all", &total, errors);
+	for (i = 0; i < nroutes; i++)
+		if (routes[i].hist.count + routes[i].errors > 0)
+			report(routes[i].name, &routes[i].hist, routes[i].errors);
+	free(tids);
+	return (errors > 0 ? 1 : 0);
+	}
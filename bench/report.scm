@@ -0,0 +1,90 @@
+; Result output shared by the Scheme benchmark scripts; the run
+; scripts load it ahead of them, as in "gusher report.scm micro.scm".
+;
+; A result row is an alist whose order is the output order. Rows are
+; written as a JSON array, one object per line, reals to one decimal
+; place, so that runs diff cleanly. bench-finish writes the rows,
+; compares them with a baseline file and exits 1 on a regression.
+
+(use-modules (ice-9 format) (ice-9 rdelim) (srfi srfi-1))
+
+(define (bench-env name default)
+	(let ((v (getenv name)))
+		(if v (string->number v) default)))
+
+(define (bench-json-value v)
+	(cond
+		((string? v) (format #f "~s" v))
+		((and (number? v) (exact? v)) (number->string v))
+		((number? v) (format #f "~,1f" v))
+		(else "null")))
+
+(define (bench-write-json rows port)
+	(display "[\n" port)
+	(let loop ((rows rows))
+		(when (pair? rows)
+			(display "{" port)
+			(display
+				(string-join
+					(map (lambda (pair)
+							(format #f "~s:~a" (symbol->string (car pair))
+								(bench-json-value (cdr pair))))
+						(car rows))
+					",")
+				port)
+			(display (if (null? (cdr rows)) "}\n" "},\n") port)
+			(loop (cdr rows))))
+	(display "]\n" port)
+	(force-output port))
+
+(define (bench-read-json path)
+	(and path (file-exists? path)
+		(json-decode (call-with-input-file path
+			(lambda (port) (read-delimited "" port))))))
+
+; checks: (key . higher-is-better); rows match on id-keys. A zero
+; baseline can't scale, so it is skipped, except that any loss where
+; there was none counts.
+(define (bench-compare rows baseline id-keys checks tolerance)
+	(define (same? a b)
+		(every (lambda (k) (equal? (assq-ref a k) (assq-ref b k))) id-keys))
+	(define (worse? key now then higher)
+		(and (number? now) (number? then)
+			(cond
+				((and (eq? key 'lost) (= then 0)) (> now 0))
+				((<= then 0) #f)
+				(higher (< now (* then (- 1 (/ tolerance 100.0)))))
+				(else (> now (* then (+ 1 (/ tolerance 100.0))))))))
+	(let ((failed #f))
+		(for-each
+			(lambda (r)
+				(let ((base (find (lambda (b) (same? r b)) baseline)))
+					(when base
+						(for-each
+							(lambda (check)
+								(let ((now (assq-ref r (car check)))
+										(then (assq-ref base (car check))))
+									(when (worse? (car check) now then (cdr check))
+										(format #t "REGRESSION ~a ~a: ~,1f, baseline ~,1f\n"
+											(map (lambda (k) (assq-ref r k)) id-keys)
+											(car check) now then)
+										(set! failed #t))))
+							checks))))
+			rows)
+		failed))
+
+; write rows to $<prefix>_OUT (or stdout), compare with
+; $<prefix>_BASELINE within $<prefix>_TOLERANCE percent, and exit
+(define (bench-finish prefix rows id-keys checks)
+	(let ((out (getenv (string-append prefix "_OUT")))
+			(baseline (bench-read-json
+				(getenv (string-append prefix "_BASELINE"))))
+			(tolerance (bench-env (string-append prefix "_TOLERANCE") 10)))
+		(if out
+			(call-with-output-file out
+				(lambda (port) (bench-write-json rows port)))
+			(bench-write-json rows (current-output-port)))
+		(let ((failed (and (pair? baseline)
+						(bench-compare rows baseline id-keys checks tolerance))))
+			(force-output)
+			(primitive-exit (if failed 1 0)))))
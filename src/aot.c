@@ -0,0 +1,303 @@
+/*
+** Copyright (c) 2013 Peter Yadlowsky <pmy@virginia.edu>
+**
+** This program is free software ; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation ; either version 3 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY ; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program ; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+/*
+** Ahead-of-time compilation of application files. Each file given
+** on the command line (and boot.scm) is compiled once into
+** gusher_root/cache and the .go is loaded on later starts. A .go
+** holds expansions of macros from the other sources, so it is
+** reused only while a hash over its own source, every application
+** file, the (gusher ...) modules and the Guile version still
+** matches; changing macros in modules outside those calls for
+** clearing the cache. A .go that won't load (truncated, corrupt,
+** from another Guile) is deleted and the source loaded instead.
+** (gusher ...) modules go through Guile's own auto-compiler,
+** pointed at the same cache, while these files load.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <libguile.h>
+
+#include "log.h"
+#include "aot.h"
+
+extern char gusher_root[];
+
+static int enabled = 0;
+static char cache_dir[PATH_MAX];
+static SCM compile_file;
+static SCM load_compiled;
+static SCM output_kw, env_kw;
+static SCM auto_compile, saved_auto_compile;
+static char **sources = NULL;
+static int nsources = 0;
+static unsigned long long deps_sum = 0;
+static int have_deps = 0;
+static volatile unsigned long compiled = 0, cached = 0, interpreted = 0;
+static volatile unsigned long rejected = 0;
+
+static unsigned long long hash_file(const char *path) {
+	unsigned long long hash;
+	unsigned char buf[8192];
+	ssize_t n, i;
+	int fd;
+	hash = 14695981039346656037ULL; // FNV-1a
+	if ((fd = open(path, O_RDONLY)) < 0) return 0;
+	while ((n = read(fd, buf, sizeof(buf))) > 0) {
+		for (i = 0; i < n; i++) {
+			hash ^= buf[i];
+			hash *= 1099511628211ULL;
+			}
+		}
+	close(fd);
+	return hash;
+	}
+
+static unsigned long long mix(unsigned long long sum,
+		unsigned long long hash) {
+	hash ^= hash >> 33;
+	hash *= 0xff51afd7ed558ccdULL;
+	hash ^= hash >> 33;
+	return sum + hash; // order doesn't matter
+	}
+
+/*
+** Application files, resolved before anything changes directory.
+*/
+void aot_sources(int n, char **paths) {
+	char path[PATH_MAX];
+	int i;
+	sources = (char **)calloc(n + 1, sizeof(char *));
+	nsources = 0;
+	for (i = 0; i < n; i++) {
+		if (realpath(paths[i], path) != NULL)
+			sources[nsources++] = strdup(path);
+		}
+	}
+
+static unsigned long long dependencies(void) {
+	char path[PATH_MAX], *version;
+	struct dirent *ent;
+	size_t len;
+	DIR *dir;
+	int i;
+	if (have_deps) return deps_sum;
+	for (i = 0; i < nsources; i++)
+		deps_sum = mix(deps_sum, hash_file(sources[i]));
+	snprintf(path, sizeof(path), "%s/boot.scm", gusher_root);
+	deps_sum = mix(deps_sum, hash_file(path));
+	snprintf(path, sizeof(path), "%s/gusher", gusher_root);
+	if ((dir = opendir(path)) != NULL) {
+		while ((ent = readdir(dir)) != NULL) {
+			len = strlen(ent->d_name);
+			if ((len < 4) || (strcmp(ent->d_name + len - 4, ".scm") != 0))
+				continue;
+			snprintf(path, sizeof(path), "%s/gusher/%s", gusher_root,
+					ent->d_name);
+			deps_sum = mix(deps_sum, hash_file(path));
+			}
+		closedir(dir);
+		}
+	version = scm_to_locale_string(scm_version());
+	for (i = 0; version[i]; i++) deps_sum = mix(deps_sum, version[i] + i);
+	free(version);
+	have_deps = 1;
+	return deps_sum;
+	}
+
+static unsigned long long read_sum(const char *path) {
+	unsigned long long sum;
+	FILE *fp;
+	if ((fp = fopen(path, "r")) == NULL) return 0;
+	if (fscanf(fp, "%llx", &sum) != 1) sum = 0;
+	fclose(fp);
+	return sum;
+	}
+
+static void write_sum(const char *path, unsigned long long sum) {
+	FILE *fp;
+	if ((fp = fopen(path, "w")) == NULL) return;
+	fprintf(fp, "%016llx\n", sum);
+	fclose(fp);
+	return;
+	}
+
+/*
+** Flatten an absolute source path into one cache file name.
+*/
+static void cache_name(char *buf, size_t size, const char *source,
+		const char *ext) {
+	char flat[PATH_MAX], *pt;
+	strncpy(flat, source + 1, sizeof(flat) - 1);
+	flat[sizeof(flat) - 1] = '\0';
+	for (pt = flat; *pt; pt++) if (*pt == '/') *pt = '!';
+	snprintf(buf, size, "%s/%s%s", cache_dir, flat, ext);
+	return;
+	}
+
+static SCM compile_body(void *data) {
+	SCM args[5];
+	const char **paths = (const char **)data;
+	args[0] = scm_from_locale_string(paths[0]);
+	args[1] = output_kw;
+	args[2] = scm_from_locale_string(paths[1]);
+	args[3] = env_kw;
+	args[4] = scm_current_module();
+	scm_call_n(compile_file, args, 5);
+	return SCM_BOOL_T;
+	}
+
+static SCM compile_catch(void *data, SCM key, SCM params) {
+	const char **paths = (const char **)data;
+	log_msg("compile %s failed, loading source\n", paths[0]);
+	return SCM_BOOL_F;
+	}
+
+/*
+** Make sure the .go for source is current; returns 1 if it can be
+** loaded, 0 if the source has to be interpreted.
+*/
+static int refresh(const char *source, const char *object,
+		const char *sumfile) {
+	unsigned long long sum;
+	const char *paths[2];
+	if (access(source, R_OK) != 0) return 0;
+	sum = hash_file(source) ^ dependencies();
+	if ((access(object, R_OK) == 0) && (read_sum(sumfile) == sum))
+		return 1;
+	paths[0] = source;
+	paths[1] = object;
+	if (scm_c_catch(SCM_BOOL_T, compile_body, (void *)paths,
+			compile_catch, (void *)paths, NULL, NULL) != SCM_BOOL_T)
+		return 0;
+	write_sum(sumfile, sum);
+	__sync_fetch_and_add(&compiled, 1);
+	log_msg("compiled %s\n", source);
+	return 1;
+	}
+
+static SCM load_body(void *data) {
+	scm_call_1(load_compiled, scm_from_locale_string((const char *)data));
+	return SCM_BOOL_T;
+	}
+
+/*
+** Guile refuses a bad object file with a misc-error from its loader;
+** anything else came from running the file and goes on up.
+*/
+static SCM load_catch(void *data, SCM key, SCM params) {
+	SCM subr;
+	char *name;
+	int bad;
+	bad = 0;
+	if (scm_is_eq(key, scm_from_latin1_symbol("misc-error")) &&
+			scm_is_pair(params)) {
+		subr = SCM_CAR(params);
+		if (scm_is_symbol(subr)) subr = scm_symbol_to_string(subr);
+		if (scm_is_string(subr)) {
+			name = scm_to_locale_string(subr);
+			bad = ((strncmp(name, "load-objcode", 12) == 0) ||
+					(strncmp(name, "load-thunk", 10) == 0));
+			free(name);
+			}
+		}
+	if (!bad) scm_throw(key, params);
+	__sync_fetch_and_add(&rejected, 1);
+	log_msg("can't load %s, discarding it\n", (const char *)data);
+	return SCM_BOOL_F;
+	}
+
+static void restore_auto_compile(void *data) {
+	scm_variable_set_x(auto_compile, saved_auto_compile);
+	}
+
+void aot_load(const char *path) {
+	char source[PATH_MAX], object[PATH_MAX], sumfile[PATH_MAX];
+	if (!enabled || (realpath(path, source) == NULL)) {
+		__sync_fetch_and_add(&interpreted, 1);
+		scm_c_primitive_load(path);
+		return;
+		}
+	cache_name(object, sizeof(object), source, ".go");
+	cache_name(sumfile, sizeof(sumfile), source, ".sum");
+	scm_dynwind_begin(0);
+	saved_auto_compile = scm_variable_ref(auto_compile);
+	scm_variable_set_x(auto_compile, SCM_BOOL_T); // for (gusher ...)
+	scm_dynwind_unwind_handler(restore_auto_compile, NULL,
+			SCM_F_WIND_EXPLICITLY);
+	if (refresh(source, object, sumfile) &&
+			(scm_c_catch(SCM_BOOL_T, load_body, (void *)object,
+				load_catch, (void *)object, NULL, NULL) == SCM_BOOL_T))
+		__sync_fetch_and_add(&cached, 1);
+	else {
+		unlink(object);
+		unlink(sumfile);
+		__sync_fetch_and_add(&interpreted, 1);
+		scm_c_primitive_load(path);
+		}
+	scm_dynwind_end();
+	return;
+	}
+
+static SCM aot_stats(void) {
+	SCM stats;
+	stats = SCM_EOL;
+	stats = scm_acons(scm_from_latin1_symbol("rejected"),
+			scm_from_ulong(rejected), stats);
+	stats = scm_acons(scm_from_latin1_symbol("interpreted"),
+			scm_from_ulong(interpreted), stats);
+	stats = scm_acons(scm_from_latin1_symbol("loaded-compiled"),
+			scm_from_ulong(cached), stats);
+	stats = scm_acons(scm_from_latin1_symbol("compiled"),
+			scm_from_ulong(compiled), stats);
+	stats = scm_acons(scm_from_latin1_symbol("cache"),
+			(enabled ? scm_from_locale_string(cache_dir) : SCM_BOOL_F),
+			stats);
+	scm_remember_upto_here_1(stats);
+	return stats;
+	}
+
+void init_aot(int on) {
+	scm_c_define_gsubr("aot-stats", 0, 0, 0, aot_stats);
+	if (!on) return;
+	snprintf(cache_dir, sizeof(cache_dir), "%s/%s", gusher_root,
+			AOT_CACHE_DIR);
+	mkdir(cache_dir, 0775);
+	if (access(cache_dir, W_OK) != 0) {
+		log_msg("AOT cache %s not writable, interpreting\n", cache_dir);
+		return;
+		}
+	compile_file = scm_c_public_ref("system base compile", "compile-file");
+	load_compiled = scm_c_public_ref("guile", "load-compiled");
+	output_kw = scm_from_latin1_keyword("output-file");
+	env_kw = scm_from_latin1_keyword("env");
+	scm_gc_protect_object(compile_file);
+	scm_gc_protect_object(load_compiled);
+	scm_variable_set_x(scm_c_lookup("%compile-fallback-path"),
+			scm_from_locale_string(cache_dir));
+	auto_compile = scm_c_lookup("%load-should-auto-compile");
+	scm_gc_protect_object(auto_compile);
+	enabled = 1;
+	}
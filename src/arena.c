@@ -0,0 +1,151 @@
+/*
+** Copyright (c) 2013 Peter Yadlowsky <pmy@virginia.edu>
+**
+** This program is free software ; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation ; either version 3 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY ; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program ; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+/*
+** Per-thread bump allocator for C scratch memory that lives no
+** longer than one request: parse buffers, header copies, template
+** and JSON staging. Nothing is freed piecemeal. The dispatcher resets
+** the arena after each request; code that may run outside a request
+** brackets its use with arena_mark/arena_release. Chunks are kept
+** for reuse, apart from oversized ones, which go back at reset.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <libguile.h>
+
+#include "arena.h"
+
+#define ALIGN 16
+
+typedef struct chunk {
+	struct chunk *next;
+	size_t size;
+	size_t used;
+	char data[];
+	} CHUNK;
+
+static __thread CHUNK *first = NULL;
+static __thread CHUNK *cur = NULL;
+static volatile unsigned long chunks_made = 0, resets = 0;
+static volatile unsigned long big_allocs = 0;
+
+static CHUNK *new_chunk(size_t size) {
+	CHUNK *chunk;
+	chunk = (CHUNK *)malloc(sizeof(CHUNK) + size);
+	chunk->next = NULL;
+	chunk->size = size;
+	chunk->used = 0;
+	__sync_fetch_and_add(&chunks_made, 1);
+	return chunk;
+	}
+
+void *arena_alloc(size_t size) {
+	CHUNK *chunk;
+	void *mem;
+	size = (size + ALIGN - 1) & ~(size_t)(ALIGN - 1);
+	if (cur == NULL) first = cur = new_chunk(ARENA_CHUNK);
+	while (cur->used + size > cur->size) {
+		if ((cur->next != NULL) && (cur->next->size >= size)) {
+			cur = cur->next;
+			cur->used = 0;
+			continue;
+			}
+		if (size > ARENA_CHUNK) __sync_fetch_and_add(&big_allocs, 1);
+		chunk = new_chunk(size > ARENA_CHUNK ? size : ARENA_CHUNK);
+		chunk->next = cur->next;
+		cur->next = chunk;
+		cur = chunk;
+		}
+	mem = cur->data + cur->used;
+	cur->used += size;
+	return mem;
+	}
+
+char *arena_strndup(const char *src, size_t len) {
+	char *dst;
+	dst = (char *)arena_alloc(len + 1);
+	memcpy(dst, src, len);
+	dst[len] = '\0';
+	return dst;
+	}
+
+ARENA_MARK arena_mark(void) {
+	ARENA_MARK mark;
+	mark.chunk = cur;
+	mark.used = (cur != NULL ? cur->used : 0);
+	return mark;
+	}
+
+void arena_release(ARENA_MARK mark) {
+	if (mark.chunk == NULL) {
+		if (first != NULL) first->used = 0;
+		cur = first;
+		return;
+		}
+	cur = (CHUNK *)mark.chunk;
+	cur->used = mark.used;
+	}
+
+static void unwind_release(void *data) {
+	arena_release(*(ARENA_MARK *)data);
+	}
+
+/*
+** Inside a dynwind context, release to *mark when the context is
+** left, whether normally or by a throw; threads outside a request
+** never reset, so a Scheme error between mark and release would
+** otherwise leave the scratch behind for good.
+*/
+void arena_dynwind_release(ARENA_MARK *mark) {
+	scm_dynwind_unwind_handler(unwind_release, mark,
+			SCM_F_WIND_EXPLICITLY);
+	}
+
+void arena_reset(void) {
+	CHUNK *chunk, *prev;
+	if (first == NULL) return;
+	prev = first;
+	while ((chunk = prev->next) != NULL) { // drop oversized chunks
+		if (chunk->size > ARENA_CHUNK) {
+			prev->next = chunk->next;
+			free(chunk);
+			}
+		else prev = chunk;
+		}
+	first->used = 0;
+	cur = first;
+	__sync_fetch_and_add(&resets, 1);
+	}
+
+static SCM arena_stats(void) {
+	SCM stats;
+	stats = SCM_EOL;
+	stats = scm_acons(scm_from_latin1_symbol("oversized"),
+			scm_from_ulong(big_allocs), stats);
+	stats = scm_acons(scm_from_latin1_symbol("resets"),
+			scm_from_ulong(resets), stats);
+	stats = scm_acons(scm_from_latin1_symbol("chunks"),
+			scm_from_ulong(chunks_made), stats);
+	scm_remember_upto_here_1(stats);
+	return stats;
+	}
+
+void init_arena(void) {
+	scm_c_define_gsubr("arena-stats", 0, 0, 0, arena_stats);
+	}
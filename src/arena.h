@@ -0,0 +1,34 @@
+/*
+** Copyright (c) 2013 Peter Yadlowsky <pmy@virginia.edu>
+**
+** This program is free software ; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation ; either version 3 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY ; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program ; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+#include <stddef.h>
+
+#define ARENA_CHUNK (64 * 1024)
+
+typedef struct arena_mark {
+	void *chunk;
+	size_t used;
+	} ARENA_MARK;
+
+void *arena_alloc(size_t);
+char *arena_strndup(const char *, size_t);
+ARENA_MARK arena_mark(void);
+void arena_release(ARENA_MARK);
+void arena_dynwind_release(ARENA_MARK *);
+void arena_reset(void);
+void init_arena(void);
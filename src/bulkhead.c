@@ -0,0 +1,262 @@
+/*
+** Copyright (c) 2013 Peter Yadlowsky <pmy@virginia.edu>
+**
+** This program is free software ; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation ; either version 3 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY ; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program ; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+/*
+** Bulkheads: per-route limits on concurrent executions. A request
+** over the limit waits in the route's own queue and is picked up by
+** whichever thread finishes a request on that route, so a slow
+** route holds at most max-concurrent threads however many requests
+** pile up. With a pool, the route gets dedicated threads and the
+** dispatcher only hands requests over. A full queue gets 503.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <libguile.h>
+
+#include "log.h"
+#include "bulkhead.h"
+
+typedef struct job {
+	int sock;
+	SCM args; // (request . path-info), protected while queued
+	void *route;
+	unsigned long accepted; // the request's deadline runs from here
+	struct job *next;
+	} JOB;
+
+struct bulkhead {
+	char *name;
+	int max_active;
+	int max_queue;
+	int pool;
+	int active;
+	int threads;
+	int qlen;
+	int peak;
+	JOB *head;
+	JOB *tail;
+	bulkhead_run run;
+	SCM mutex;
+	SCM condvar;
+	unsigned long ran;
+	unsigned long queued;
+	unsigned long rejected;
+	struct bulkhead *link;
+	};
+
+struct run_ctx {
+	BULKHEAD *bh;
+	JOB *job;
+	};
+
+static BULKHEAD *bulkheads = NULL;
+
+static const char *busy_msg = "HTTP/1.1 503 Service Unavailable\r\n"
+	"retry-after: 1\r\ncontent-type: text/plain\r\n"
+	"content-length: 20\r\n\r\nService Unavailable\n";
+
+static const char *err_msg = "HTTP/1.1 500 Internal Server Error\r\n"
+	"content-type: text/plain\r\n\r\nGusher application error.\r\n";
+
+void bulkhead_reject(int sock) {
+	send(sock, busy_msg, strlen(busy_msg), MSG_NOSIGNAL);
+	close(sock);
+	}
+
+static SCM run_body(void *data) {
+	struct run_ctx *ctx = (struct run_ctx *)data;
+	ctx->bh->run(ctx->job->sock, SCM_CAR(ctx->job->args),
+			ctx->job->route, SCM_CDR(ctx->job->args),
+			ctx->job->accepted);
+	return SCM_BOOL_T;
+	}
+
+static SCM run_error(void *data, SCM key, SCM params) {
+	struct run_ctx *ctx = (struct run_ctx *)data;
+	SCM format;
+	char *buf;
+	format = scm_c_public_ref("guile", "format");
+	buf = scm_to_locale_string(scm_call_4(format, SCM_BOOL_F,
+		scm_from_locale_string("~s ~s"), key, params));
+	log_msg("ERROR (%s): %s\n", ctx->bh->name, buf);
+	free(buf);
+	send(ctx->job->sock, err_msg, strlen(err_msg), MSG_NOSIGNAL);
+	close(ctx->job->sock);
+	scm_remember_upto_here_1(format);
+	scm_remember_upto_here_2(key, params);
+	return SCM_BOOL_F;
+	}
+
+static void run_job(BULKHEAD *bh, JOB *job) {
+	struct run_ctx ctx;
+	ctx.bh = bh;
+	ctx.job = job;
+	scm_c_catch(SCM_BOOL_T, run_body, (void *)&ctx,
+			run_error, (void *)&ctx, NULL, NULL);
+	scm_gc_unprotect_object(job->args);
+	free(job);
+	}
+
+// caller holds bh->mutex
+static JOB *pop_job(BULKHEAD *bh) {
+	JOB *job;
+	if ((job = bh->head) == NULL) return NULL;
+	if ((bh->head = job->next) == NULL) bh->tail = NULL;
+	bh->qlen--;
+	return job;
+	}
+
+// caller holds bh->mutex
+static void push_job(BULKHEAD *bh, JOB *job) {
+	job->next = NULL;
+	if (bh->tail == NULL) bh->head = job;
+	else bh->tail->next = job;
+	bh->tail = job;
+	bh->qlen++;
+	bh->queued++;
+	if (bh->qlen > bh->peak) bh->peak = bh->qlen;
+	}
+
+static SCM pool_worker(void *data) {
+	BULKHEAD *bh = (BULKHEAD *)data;
+	JOB *job;
+	while (1) {
+		scm_lock_mutex(bh->mutex);
+		while ((job = pop_job(bh)) == NULL)
+			scm_wait_condition_variable(bh->condvar, bh->mutex);
+		bh->active++;
+		scm_unlock_mutex(bh->mutex);
+		run_job(bh, job);
+		scm_lock_mutex(bh->mutex);
+		bh->active--;
+		bh->ran++;
+		scm_unlock_mutex(bh->mutex);
+		}
+	return SCM_BOOL_T;
+	}
+
+/*
+** Run the request now, queue it, or refuse it. Returns -1 when
+** refused; the caller still owns the socket then.
+*/
+int bulkhead_submit(BULKHEAD *bh, int sock, SCM request, void *route,
+		SCM path_info, unsigned long accepted) {
+	JOB *job;
+	job = (JOB *)malloc(sizeof(JOB));
+	job->sock = sock;
+	job->route = route;
+	job->accepted = accepted;
+	job->args = scm_cons(request, path_info);
+	scm_gc_protect_object(job->args);
+	scm_lock_mutex(bh->mutex);
+	if (bh->pool > 0) {
+		if (bh->qlen >= bh->max_queue) goto refuse;
+		push_job(bh, job);
+		while (bh->threads < bh->pool) {
+			bh->threads++;
+			scm_spawn_thread(pool_worker, (void *)bh, NULL, NULL);
+			}
+		scm_signal_condition_variable(bh->condvar);
+		scm_unlock_mutex(bh->mutex);
+		return 0;
+		}
+	if (bh->active >= bh->max_active) {
+		if (bh->qlen >= bh->max_queue) goto refuse;
+		push_job(bh, job);
+		scm_unlock_mutex(bh->mutex);
+		return 0;
+		}
+	bh->active++;
+	while (job != NULL) { // then take over whatever queued behind us
+		scm_unlock_mutex(bh->mutex);
+		run_job(bh, job);
+		scm_lock_mutex(bh->mutex);
+		bh->ran++;
+		job = pop_job(bh);
+		}
+	bh->active--;
+	scm_unlock_mutex(bh->mutex);
+	return 0;
+refuse:
+	bh->rejected++;
+	scm_unlock_mutex(bh->mutex);
+	scm_gc_unprotect_object(job->args);
+	free(job);
+	scm_remember_upto_here_2(request, path_info);
+	return -1;
+	}
+
+/*
+** Find or make the bulkhead for a route and apply its limits. Pool
+** threads already running stay when the pool shrinks.
+*/
+BULKHEAD *bulkhead_get(BULKHEAD *bh, const char *name, int max_active,
+		int max_queue, int pool, bulkhead_run run) {
+	if (bh == NULL) {
+		bh = (BULKHEAD *)malloc(sizeof(BULKHEAD));
+		memset(bh, 0, sizeof(BULKHEAD));
+		bh->name = strdup(name);
+		scm_permanent_object(bh->mutex = scm_make_mutex());
+		scm_permanent_object(bh->condvar =
+				scm_make_condition_variable());
+		bh->run = run;
+		bh->link = bulkheads;
+		bulkheads = bh;
+		}
+	scm_lock_mutex(bh->mutex);
+	bh->max_active = (max_active > 0 ? max_active : 1);
+	bh->max_queue = (max_queue >= 0 ? max_queue : DEFAULT_BULKHEAD_QUEUE);
+	bh->pool = pool;
+	scm_unlock_mutex(bh->mutex);
+	return bh;
+	}
+
+static SCM bulkhead_stats(void) {
+	BULKHEAD *bh;
+	SCM stats, entry;
+	stats = SCM_EOL;
+	entry = SCM_EOL;
+	for (bh = bulkheads; bh != NULL; bh = bh->link) {
+		scm_lock_mutex(bh->mutex);
+		entry = SCM_EOL;
+		entry = scm_acons(scm_from_locale_symbol("rejected"),
+				scm_from_ulong(bh->rejected), entry);
+		entry = scm_acons(scm_from_locale_symbol("queued"),
+				scm_from_ulong(bh->queued), entry);
+		entry = scm_acons(scm_from_locale_symbol("ran"),
+				scm_from_ulong(bh->ran), entry);
+		entry = scm_acons(scm_from_locale_symbol("peak"),
+				scm_from_int(bh->peak), entry);
+		entry = scm_acons(scm_from_locale_symbol("waiting"),
+				scm_from_int(bh->qlen), entry);
+		entry = scm_acons(scm_from_locale_symbol("active"),
+				scm_from_int(bh->active), entry);
+		scm_unlock_mutex(bh->mutex);
+		stats = scm_acons(scm_from_locale_string(bh->name), entry, stats);
+		}
+	scm_remember_upto_here_2(stats, entry);
+	return stats;
+	}
+
+void init_bulkhead(void) {
+	scm_c_define_gsubr("bulkhead-stats", 0, 0, 0, bulkhead_stats);
+	}
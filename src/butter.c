@@ -21,6 +21,7 @@
 #include <time.h>
 #include <stdarg.h>
 #include <gcrypt.h>
+#include <stdint.h>
 
 static SCM radix10;
 static SCM infix;
@@ -110,7 +111,90 @@ static SCM string_cat(SCM glue, SCM items) {
 	}
 
 
+/*
+** wyhash (final 4), a fast non-cryptographic 64-bit hash; used for
+** ETags and response-variant cache keys
+*/
+static inline uint64_t wymix(uint64_t a, uint64_t b) {
+	__uint128_t r = (__uint128_t)a * b;
+	return (uint64_t)r ^ (uint64_t)(r >> 64);
+	}
+
+static inline uint64_t wyr8(const uint8_t *p) {
+	uint64_t v;
+	memcpy(&v, p, 8);
+	return v;
+	}
+
+static inline uint64_t wyr4(const uint8_t *p) {
+	uint32_t v;
+	memcpy(&v, p, 4);
+	return v;
+	}
+
+static inline uint64_t wyr3(const uint8_t *p, size_t k) {
+	return (((uint64_t)p[0]) << 16) | (((uint64_t)p[k >> 1]) << 8) |
+			p[k - 1];
+	}
+
+uint64_t hash64(const void *key, size_t len) {
+	static const uint64_t s[4] = {
+		0xa0761d6478bd642full, 0xe7037ed1a0b428dbull,
+		0x8ebc6af09c88c6e3ull, 0x589965cc75374cc3ull };
+	const uint8_t *p = (const uint8_t *)key;
+	uint64_t a, b, seed, see1, see2;
+	__uint128_t r;
+	size_t i;
+	seed = wymix(s[0], s[1]);
+	if (len <= 16) {
+		if (len >= 4) {
+			a = (wyr4(p) << 32) | wyr4(p + ((len >> 3) << 2));
+			b = (wyr4(p + len - 4) << 32) |
+				wyr4(p + len - 4 - ((len >> 3) << 2));
+			}
+		else if (len > 0) {
+			a = wyr3(p, len);
+			b = 0;
+			}
+		else a = b = 0;
+		}
+	else {
+		i = len;
+		if (i > 48) {
+			see1 = see2 = seed;
+			do {
+				seed = wymix(wyr8(p) ^ s[1], wyr8(p + 8) ^ seed);
+				see1 = wymix(wyr8(p + 16) ^ s[2], wyr8(p + 24) ^ see1);
+				see2 = wymix(wyr8(p + 32) ^ s[3], wyr8(p + 40) ^ see2);
+				p += 48;
+				i -= 48;
+				} while (i > 48);
+			seed ^= see1 ^ see2;
+			}
+		while (i > 16) {
+			seed = wymix(wyr8(p) ^ s[1], wyr8(p + 8) ^ seed);
+			i -= 16;
+			p += 16;
+			}
+		a = wyr8(p + i - 16);
+		b = wyr8(p + i - 8);
+		}
+	a ^= s[1];
+	b ^= seed;
+	r = (__uint128_t)a * b;
+	a = (uint64_t)r;
+	b = (uint64_t)(r >> 64);
+	return wymix(a ^ s[0] ^ len, b ^ s[1]);
+	}
+
 SCM safe_from_utf8(const char *string) {
+	const unsigned char *pt;
+	// pure ASCII is already Latin-1: a narrow string, no conversion
+	for (pt = (const unsigned char *)string; *pt; pt++)
+		if (*pt & 0x80) break;
+	if (*pt == '\0')
+		return scm_from_latin1_stringn(string,
+				(const char *)pt - string);
 	return scm_from_stringn(string, strlen(string), "UTF-8",
 				SCM_FAILED_CONVERSION_QUESTION_MARK);
 	}
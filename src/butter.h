@@ -16,6 +16,9 @@
 ** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
 */
 
+#include <stdint.h>
+
 void init_butter(void);
 SCM safe_from_utf8(const char *);
 SCM to_s(SCM obj);
+uint64_t hash64(const void *, size_t);
@@ -0,0 +1,109 @@
+/*
+** Copyright (c) 2013 Peter Yadlowsky <pmy@virginia.edu>
+**
+** This program is free software ; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation ; either version 3 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY ; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program ; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <libguile.h>
+
+#include "bytes.h"
+#include "arena.h"
+
+/*
+** Copy a string's chars, as bytes, into buf (always terminated,
+** truncated to fit). Returns the string's full length.
+*/
+size_t scm_to_bytes(SCM str, char *buf, size_t size) {
+	size_t len, i;
+	scm_t_wchar c;
+	len = scm_c_string_length(str);
+	for (i = 0; (i < len) && (i + 1 < size); i++) {
+		c = SCM_CHAR(scm_c_string_ref(str, i));
+		buf[i] = (c < 256 ? (char)c : '?');
+		}
+	if (size > 0) buf[i] = '\0';
+	scm_remember_upto_here_1(str);
+	return len;
+	}
+
+/*
+** Latin-1 copy in buf if it fits, otherwise in the request arena.
+*/
+char *scm_to_scratch(SCM str, char *buf, size_t size) {
+	size_t len;
+	len = scm_c_string_length(str);
+	if (len >= size) {
+		size = len + 1;
+		buf = (char *)arena_alloc(size);
+		}
+	scm_to_bytes(str, buf, size);
+	return buf;
+	}
+
+/*
+** Latin-1 copy in malloc'd memory, for strings kept past the request
+** (route paths), so they compare byte for byte with the wire.
+*/
+char *scm_to_bytes_dup(SCM str) {
+	size_t len;
+	char *buf;
+	len = scm_c_string_length(str);
+	buf = (char *)malloc(len + 1);
+	scm_to_bytes(str, buf, len + 1);
+	return buf;
+	}
+
+/*
+** UTF-8 encoding of str in the request arena; length in *lenp.
+** The encoded length is counted first so the arena holds no more
+** than the string needs.
+*/
+char *scm_to_utf8_arena(SCM str, size_t *lenp) {
+	size_t len, need, i;
+	scm_t_wchar c;
+	unsigned char *buf, *pt;
+	len = scm_c_string_length(str);
+	need = len;
+	for (i = 0; i < len; i++) {
+		c = SCM_CHAR(scm_c_string_ref(str, i));
+		if (c >= 0x80) need += (c < 0x800 ? 1 : (c < 0x10000 ? 2 : 3));
+		}
+	buf = pt = (unsigned char *)arena_alloc(need + 1);
+	for (i = 0; i < len; i++) {
+		c = SCM_CHAR(scm_c_string_ref(str, i));
+		if (c < 0x80) *pt++ = (unsigned char)c;
+		else if (c < 0x800) {
+			*pt++ = 0xc0 | (c >> 6);
+			*pt++ = 0x80 | (c & 0x3f);
+			}
+		else if (c < 0x10000) {
+			*pt++ = 0xe0 | (c >> 12);
+			*pt++ = 0x80 | ((c >> 6) & 0x3f);
+			*pt++ = 0x80 | (c & 0x3f);
+			}
+		else {
+			*pt++ = 0xf0 | (c >> 18);
+			*pt++ = 0x80 | ((c >> 12) & 0x3f);
+			*pt++ = 0x80 | ((c >> 6) & 0x3f);
+			*pt++ = 0x80 | (c & 0x3f);
+			}
+		}
+	*pt = '\0';
+	if (lenp != NULL) *lenp = pt - buf;
+	scm_remember_upto_here_1(str);
+	return (char *)buf;
+	}
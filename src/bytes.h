@@ -0,0 +1,39 @@
+/*
+** Copyright (c) 2013 Peter Yadlowsky <pmy@virginia.edu>
+**
+** This program is free software ; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation ; either version 3 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY ; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program ; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+/*
+** Wire strings. HTTP request lines, header names and values are
+** octets; they go into Scheme as Latin-1, one char per byte, which
+** needs no iconv and round-trips exactly. Bodies and database text are
+** UTF-8. Coming back out, short strings are copied into a caller's
+** stack buffer rather than a fresh malloc.
+*/
+
+#include <libguile.h>
+
+#define SCRATCH_SIZE 512
+
+#define bytes_to_scm(s) (scm_from_latin1_string(s))
+#define bytes_to_scmn(s, n) (scm_from_latin1_stringn(s, n))
+#define bytes_to_sym(s) (scm_from_latin1_symbol(s))
+#define utf8_to_scm(s) (scm_from_utf8_string(s))
+
+size_t scm_to_bytes(SCM, char *, size_t);
+char *scm_to_scratch(SCM, char *, size_t);
+char *scm_to_bytes_dup(SCM);
+char *scm_to_utf8_arena(SCM, size_t *);
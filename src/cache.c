@@ -27,6 +27,8 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <time.h>
+#include <curl/curl.h>
 
 #include "log.h"
 #include "json.h"
@@ -45,6 +47,7 @@ typedef struct make_node {
 	char *filepath;
 	int type;
 	int dirty;
+	time_t stamp;
 	} MAKE_NODE;
 
 typedef struct file_node {
@@ -59,13 +62,20 @@ static SCM stamp_sym;
 static FILE_NODE *file_nodes = NULL;
 static scm_t_bits make_node_tag;
 static SCM sessions_db;
+static SCM ims_sym;
 
-static void invalidate(MAKE_NODE *node) {
+/*
+** A node's stamp is when its content last changed: file mtime,
+** touch time, or the newest stamp among a chain's ingredients.
+** It moves on invalidation, so it is valid without regenerating.
+*/
+static void invalidate(MAKE_NODE *node, time_t stamp) {
 	SCM cursor;
 	node->dirty = 1;
+	if (stamp > node->stamp) node->stamp = stamp;
 	cursor = node->ascendants;
 	while (cursor != SCM_EOL) {
-		invalidate((MAKE_NODE *)SCM_SMOB_DATA(SCM_CAR(cursor)));
+		invalidate((MAKE_NODE *)SCM_SMOB_DATA(SCM_CAR(cursor)), stamp);
 		cursor = SCM_CDR(cursor);
 		}
 	scm_remember_upto_here_1(cursor);
@@ -82,7 +92,7 @@ static SCM touch_node(SCM doc, SCM args) {
 	MAKE_NODE *node;
 	node = (MAKE_NODE *)SCM_SMOB_DATA(doc);
 	scm_lock_mutex(node->mutex);
-	invalidate(node);
+	invalidate(node, time(NULL));
 	if (scm_is_null(args)) {
 		scm_unlock_mutex(node->mutex);
 		return SCM_BOOL_T;
@@ -161,13 +171,16 @@ static MAKE_NODE *make_node(int type) {
 	node->ascendants = SCM_EOL;
 	node->mutex = scm_make_mutex();
 	node->type = type;
+	node->stamp = time(NULL);
 	return node;
 	}
 
 static void add_ascendant(SCM dependent, SCM self) {
-	MAKE_NODE *node;
+	MAKE_NODE *node, *me;
 	SCM list;
 	node = (MAKE_NODE *)SCM_SMOB_DATA(dependent);
+	me = (MAKE_NODE *)SCM_SMOB_DATA(self);
+	if (node->stamp > me->stamp) me->stamp = node->stamp;
 	scm_lock_mutex(node->mutex);
 	list = node->ascendants;
 	while (list != SCM_EOL) {
@@ -185,12 +198,15 @@ static void add_ascendant(SCM dependent, SCM self) {
 static SCM make_doc(SCM ingredients, SCM recipe) {
 	MAKE_NODE *node;
 	FILE_NODE *fnode;
+	struct stat fstat;
 	SCM smob, cursor;
 	if (scm_is_symbol(ingredients)) {
 		if (ingredients == file_sym) {
 			node = make_node(TYPE_FILE);
 			node->filepath = scm_to_locale_string(recipe);
 			node->dirty = 1;
+			if (stat(node->filepath, &fstat) == 0)
+				node->stamp = fstat.st_mtime;
 			fnode = (FILE_NODE *)malloc(sizeof(FILE_NODE));
 			fnode->node = node;
 			fnode->mtime = 0;
@@ -207,6 +223,7 @@ static SCM make_doc(SCM ingredients, SCM recipe) {
 	node = make_node(TYPE_CHAIN);
 	node->dirty = 1;
 	node->callback = recipe;
+	if (ingredients != SCM_EOL) node->stamp = 0;
 	SCM_NEWSMOB(smob, make_node_tag, node);
 	cursor = ingredients;
 	while (cursor != SCM_EOL) {
@@ -241,6 +258,43 @@ inline char *symstr(SCM key) {
 	return scm_to_locale_string(key);
 	}
 
+static SCM doc_stamp(SCM doc) {
+	MAKE_NODE *node;
+	scm_assert_smob_type(make_node_tag, doc);
+	node = (MAKE_NODE *)SCM_SMOB_DATA(doc);
+	scm_remember_upto_here_1(doc);
+	return scm_from_long((long)node->stamp);
+	}
+
+static SCM doc_last_modified(SCM doc) {
+	MAKE_NODE *node;
+	struct tm gmt;
+	char buf[64];
+	scm_assert_smob_type(make_node_tag, doc);
+	node = (MAKE_NODE *)SCM_SMOB_DATA(doc);
+	gmtime_r(&node->stamp, &gmt);
+	strftime(buf, sizeof(buf), "%a, %d %b %Y %H:%M:%S GMT", &gmt);
+	scm_remember_upto_here_1(doc);
+	return scm_from_latin1_string(buf);
+	}
+
+static SCM doc_not_modified(SCM request, SCM doc) {
+	MAKE_NODE *node;
+	SCM ims;
+	char *buf;
+	time_t since;
+	scm_assert_smob_type(make_node_tag, doc);
+	node = (MAKE_NODE *)SCM_SMOB_DATA(doc);
+	ims = scm_assq_ref(request, ims_sym);
+	if (!scm_is_string(ims)) return SCM_BOOL_F;
+	buf = scm_to_latin1_string(ims);
+	since = curl_getdate(buf, NULL);
+	free(buf);
+	scm_remember_upto_here_2(request, doc);
+	scm_remember_upto_here_1(ims);
+	return ((since > 0) && (node->stamp <= since) ? SCM_BOOL_T : SCM_BOOL_F);
+	}
+
 void police_cache(void) {
 	FILE_NODE *node;
 	struct stat nstat;
@@ -252,7 +306,7 @@ void police_cache(void) {
 			}
 		if (nstat.st_mtime <= node->mtime) continue;
 		node->mtime = nstat.st_mtime;
-		invalidate(node->node);
+		invalidate(node->node, nstat.st_mtime);
 		}
 	return;
 	}
@@ -276,8 +330,12 @@ void init_cache(void) {
 	scm_permanent_object(file_sym = scm_from_utf8_symbol("file"));
 	scm_permanent_object(data_sym = scm_from_utf8_symbol("data"));
 	scm_permanent_object(stamp_sym = scm_from_utf8_symbol("stamp"));
+	scm_permanent_object(ims_sym = scm_from_utf8_symbol("if-modified-since"));
 	scm_c_define_gsubr("make-doc", 2, 0, 0, make_doc);
 	scm_c_define_gsubr("touch-doc", 1, 0, 1, touch_node);
 	scm_c_define_gsubr("fetch-doc", 1, 0, 1, fetch_node);
 	scm_c_define_gsubr("touched-doc?", 1, 0, 0, touched_node);
+	scm_c_define_gsubr("doc-stamp", 1, 0, 0, doc_stamp);
+	scm_c_define_gsubr("doc-last-modified", 1, 0, 0, doc_last_modified);
+	scm_c_define_gsubr("doc-not-modified?", 2, 0, 0, doc_not_modified);
 	}
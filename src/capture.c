@@ -0,0 +1,216 @@
+/*
+** Copyright (c) 2013 Peter Yadlowsky <pmy@virginia.edu>
+**
+** This program is free software ; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation ; either version 3 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY ; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program ; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+/*
+** Traffic capture for replay benchmarks. While a capture file is
+** open, a sampled share of requests is recorded as the bytes the
+** parser consumed: head lines as they are read, then whatever body
+** the form readers take in. The record is written once the request
+** has been read, before it is dispatched, so the handler's own time
+** doesn't delay the next writer. Requests answered before parsing
+** (constants, native handlers, rate limited) are not recorded.
+** Credential headers (cookie and authorization unless capture-to is
+** told otherwise) are written with their values replaced by
+** CAPTURE_REDACTED.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <libguile.h>
+
+#include "log.h"
+#include "reply.h"
+#include "bytes.h"
+#include "gtime.h"
+#include "capture.h"
+
+struct capture {
+	int sampled;
+	int over; // body went past the size limit, drop the record
+	unsigned long arrived;
+	size_t head_len;
+	RBUF buf;
+	};
+
+static __thread struct capture current;
+static FILE *sink = NULL;
+static double sample_rate = 0;
+static size_t max_bytes = DEFAULT_CAPTURE_MAX;
+static const char *default_redact[] = { "cookie", "authorization" };
+static char redact[CAPTURE_REDACT_MAX][64];
+static int nredact = 0;
+static unsigned long started = 0;
+static SCM sink_mutex;
+static volatile unsigned long captured = 0, skipped = 0;
+static volatile unsigned long bytes_written = 0;
+
+/*
+** arrived is the accept time from now_ns, on the same clock.
+*/
+void capture_begin(unsigned long arrived) {
+	current.sampled = 0;
+	if ((sink == NULL) || (sample_rate <= 0)) return;
+	if ((sample_rate < 1) && (random() >= sample_rate * RAND_MAX)) return;
+	if (current.buf.data == NULL) rbuf_init(&current.buf, 4096);
+	current.buf.len = 0;
+	current.sampled = 1;
+	current.over = 0;
+	current.head_len = 0;
+	current.arrived = arrived;
+	}
+
+static int redacted(const char *line, size_t *name_len) {
+	const char *colon;
+	int i;
+	if ((colon = strchr(line, ':')) == NULL) return 0;
+	*name_len = colon - line;
+	for (i = 0; i < nredact; i++) {
+		if ((strlen(redact[i]) == *name_len) &&
+				(strncasecmp(line, redact[i], *name_len) == 0)) return 1;
+		}
+	return 0;
+	}
+
+void capture_line(const char *line) {
+	size_t name_len;
+	if (!current.sampled) return;
+	if ((current.buf.len > 0) && redacted(line, &name_len)) {
+		rbuf_put(&current.buf, line, name_len);
+		rbuf_puts(&current.buf, ": " CAPTURE_REDACTED);
+		}
+	else rbuf_puts(&current.buf, line);
+	rbuf_put(&current.buf, "\r\n", 2);
+	if (line[0] == '\0') current.head_len = current.buf.len;
+	}
+
+void capture_body(const char *data, size_t len) {
+	if (!current.sampled || current.over) return;
+	if (current.buf.len + len > max_bytes) {
+		current.over = 1;
+		return;
+		}
+	rbuf_put(&current.buf, data, len);
+	}
+
+void capture_end(void) {
+	CAPTURE_RECORD rec;
+	if (!current.sampled) return;
+	current.sampled = 0;
+	if (current.over || (current.head_len == 0)) {
+		__sync_fetch_and_add(&skipped, 1);
+		return;
+		}
+	rec.head_len = current.head_len;
+	rec.body_len = current.buf.len - current.head_len;
+	scm_lock_mutex(sink_mutex);
+	if (sink != NULL) {
+		rec.offset_ns = (current.arrived > started ?
+				current.arrived - started : 0);
+		fwrite(&rec, sizeof(rec), 1, sink);
+		fwrite(current.buf.data, 1, current.buf.len, sink);
+		fflush(sink);
+		bytes_written += sizeof(rec) + current.buf.len;
+		captured++;
+		}
+	scm_unlock_mutex(sink_mutex);
+	// don't let one big upload pin memory on this thread
+	if (current.buf.size > 65536) rbuf_free(&current.buf);
+	}
+
+/*
+** (capture-to path [rate [max-bytes [redact]]]): record a share of
+** requests (default all) into path, replacing it. Requests larger
+** than max-bytes are skipped. redact lists the headers, as strings
+** or symbols, whose values are not recorded; #f or '() records them
+** all verbatim. #f for path stops capturing.
+*/
+static SCM capture_to(SCM path, SCM rate, SCM limit, SCM names) {
+	char *spath;
+	FILE *fp;
+	SCM name;
+	int n;
+	name = SCM_BOOL_F;
+	if ((names != SCM_UNDEFINED) && (names != SCM_BOOL_F)) {
+		n = scm_ilength(names);
+		SCM_ASSERT((n >= 0) && (n <= CAPTURE_REDACT_MAX), names,
+				SCM_ARG4, "capture-to");
+		}
+	fp = NULL;
+	if (scm_is_string(path)) {
+		spath = scm_to_locale_string(path);
+		fp = fopen(spath, "w");
+		if (fp == NULL) log_msg("capture-to: can't open %s\n", spath);
+		free(spath);
+		if (fp == NULL) return SCM_BOOL_F;
+		fwrite(CAPTURE_MAGIC, 1, CAPTURE_MAGIC_LEN, fp);
+		}
+	scm_lock_mutex(sink_mutex);
+	if (sink != NULL) fclose(sink);
+	sink = fp;
+	sample_rate = (scm_is_real(rate) ? scm_to_double(rate) : 1.0);
+	max_bytes = (scm_is_integer(limit) ? scm_to_size_t(limit) :
+			DEFAULT_CAPTURE_MAX);
+	if (names == SCM_BOOL_F) nredact = 0;
+	else if (names == SCM_UNDEFINED) {
+		for (n = 0; n < (int)(sizeof(default_redact) /
+				sizeof(default_redact[0])); n++)
+			strcpy(redact[n], default_redact[n]);
+		nredact = n;
+		}
+	else {
+		n = 0;
+		for (; scm_is_pair(names); names = SCM_CDR(names)) {
+			name = SCM_CAR(names);
+			if (scm_is_symbol(name)) name = scm_symbol_to_string(name);
+			if (!scm_is_string(name)) continue;
+			scm_to_bytes(name, redact[n], sizeof(redact[n]));
+			n++;
+			}
+		nredact = n;
+		}
+	started = now_ns();
+	captured = skipped = bytes_written = 0;
+	scm_unlock_mutex(sink_mutex);
+	scm_remember_upto_here_2(path, rate);
+	scm_remember_upto_here_2(limit, names);
+	scm_remember_upto_here_1(name);
+	return SCM_BOOL_T;
+	}
+
+static SCM capture_stats(void) {
+	SCM stats;
+	stats = SCM_EOL;
+	stats = scm_acons(scm_from_latin1_symbol("bytes"),
+			scm_from_ulong(bytes_written), stats);
+	stats = scm_acons(scm_from_latin1_symbol("skipped"),
+			scm_from_ulong(skipped), stats);
+	stats = scm_acons(scm_from_latin1_symbol("captured"),
+			scm_from_ulong(captured), stats);
+	stats = scm_acons(scm_from_latin1_symbol("sample-rate"),
+			scm_from_double(sink != NULL ? sample_rate : 0), stats);
+	scm_remember_upto_here_1(stats);
+	return stats;
+	}
+
+void init_capture(void) {
+	scm_permanent_object(sink_mutex = scm_make_mutex());
+	scm_c_define_gsubr("capture-to", 1, 3, 0, capture_to);
+	scm_c_define_gsubr("capture-stats", 0, 0, 0, capture_stats);
+	}
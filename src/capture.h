@@ -0,0 +1,47 @@
+/*
+** Copyright (c) 2013 Peter Yadlowsky <pmy@virginia.edu>
+**
+** This program is free software ; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation ; either version 3 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY ; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program ; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+** Capture file: CAPTURE_MAGIC, then one record per request, each a
+** CAPTURE_RECORD followed by head_len bytes of request head (request
+** line and headers, CRLF terminated, ending with the blank line) and
+** body_len bytes of body. offset_ns is the request's arrival time
+** since capture started. Integers are in host byte order. bench/replay
+** reads these files.
+*/
+
+#define CAPTURE_MAGIC "GUSHCAP1"
+#define CAPTURE_MAGIC_LEN 8
+#define DEFAULT_CAPTURE_MAX (1024 * 1024)
+#define CAPTURE_REDACT_MAX 16
+#define CAPTURE_REDACTED "REDACTED"
+
+typedef struct capture_record {
+	uint64_t offset_ns;
+	uint32_t head_len;
+	uint32_t body_len;
+	} CAPTURE_RECORD;
+
+void capture_begin(unsigned long);
+void capture_line(const char *);
+void capture_body(const char *, size_t);
+void capture_end(void);
+void init_capture(void);
@@ -0,0 +1,313 @@
+/*
+** Copyright (c) 2013 Peter Yadlowsky <pmy@virginia.edu>
+**
+** This program is free software ; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation ; either version 3 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY ; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program ; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+/*
+** Response body compression. Each thread keeps its own zlib streams
+** and resets them between bodies. Compressed variants of shared
+** bodies (coalesced replies, and routes that say their replies are
+** shared, such as make-doc payloads) are cached by body hash, with a
+** copy of the body to check a hit against, so they are compressed
+** once. Any other body is compressed for its one reply and dropped.
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <zlib.h>
+#ifdef HAVE_LIBBROTLIENC
+#include <brotli/encode.h>
+#endif
+#include <libguile.h>
+
+#include "log.h"
+#include "compress.h"
+
+#define DEFAULT_MIN_SIZE 1024
+#define DEFAULT_LEVEL 6
+#define VARIANT_BUCKETS 256
+#define VARIANT_MAX_BYTES (16 * 1024 * 1024)
+
+static int enabled = 0;
+static size_t min_size = DEFAULT_MIN_SIZE;
+static int level = DEFAULT_LEVEL;
+static __thread z_stream *zstreams[ENC_GZIP + 1];
+static VARIANT *variants[VARIANT_BUCKETS];
+static VARIANT *newest = NULL;
+static VARIANT *oldest = NULL;
+static size_t cached_bytes = 0;
+static SCM vmutex;
+static unsigned long n_hits = 0;
+static unsigned long n_misses = 0;
+static unsigned long n_uncached = 0;
+static unsigned long n_bytes_in = 0;
+static unsigned long n_bytes_out = 0;
+
+int compress_wanted(size_t len, const char *ctype) {
+	if (!enabled || (len < min_size) || (ctype == NULL)) return 0;
+	if (strncasecmp(ctype, "text/", 5) == 0) return 1;
+	if (strncasecmp(ctype, "application/json", 16) == 0) return 1;
+	if (strncasecmp(ctype, "application/javascript", 22) == 0) return 1;
+	if (strncasecmp(ctype, "application/xml", 15) == 0) return 1;
+	if (strstr(ctype, "+xml") != NULL) return 1;
+	return 0;
+	}
+
+static int token_accepted(const char *accept, const char *token) {
+	const char *pt, *q;
+	size_t n;
+	n = strlen(token);
+	for (pt = accept; *pt; pt++) {
+		while ((*pt == ' ') || (*pt == ',')) pt++;
+		if ((strncasecmp(pt, token, n) == 0) &&
+				((pt[n] == '\0') || (pt[n] == ',') ||
+				(pt[n] == ';') || (pt[n] == ' '))) {
+			q = pt + n;
+			while (*q == ' ') q++;
+			if (*q != ';') return 1;
+			if ((q = strchr(q, '=')) == NULL) return 1;
+			return (atof(q + 1) > 0);
+			}
+		if ((pt = strchr(pt, ',')) == NULL) break;
+		}
+	return 0;
+	}
+
+int compress_negotiate(const char *accept) {
+	if (accept == NULL) return ENC_IDENTITY;
+#ifdef HAVE_LIBBROTLIENC
+	if (token_accepted(accept, "br")) return ENC_BROTLI;
+#endif
+	if (token_accepted(accept, "gzip")) return ENC_GZIP;
+	if (token_accepted(accept, "deflate")) return ENC_DEFLATE;
+	return ENC_IDENTITY;
+	}
+
+const char *compress_name(int encoding) {
+	switch (encoding) {
+	case ENC_DEFLATE: return "deflate";
+	case ENC_GZIP: return "gzip";
+	case ENC_BROTLI: return "br";
+		}
+	return "identity";
+	}
+
+static VARIANT *deflate_body(int encoding, const char *src, size_t len) {
+	z_stream *zs;
+	VARIANT *var;
+	size_t bound;
+	if ((zs = zstreams[encoding]) == NULL) {
+		zs = (z_stream *)malloc(sizeof(z_stream));
+		memset(zs, 0, sizeof(z_stream));
+		if (deflateInit2(zs, level, Z_DEFLATED,
+				(encoding == ENC_GZIP ? 31 : 15), 8,
+				Z_DEFAULT_STRATEGY) != Z_OK) {
+			log_msg("compress: deflateInit2 failed\n");
+			free(zs);
+			return NULL;
+			}
+		zstreams[encoding] = zs;
+		}
+	else deflateReset(zs);
+	bound = deflateBound(zs, len);
+	var = (VARIANT *)malloc(sizeof(VARIANT) + bound);
+	zs->next_in = (Bytef *)src;
+	zs->avail_in = len;
+	zs->next_out = (Bytef *)var->data;
+	zs->avail_out = bound;
+	if (deflate(zs, Z_FINISH) != Z_STREAM_END) {
+		log_msg("compress: deflate failed\n");
+		free(var);
+		return NULL;
+		}
+	var->len = bound - zs->avail_out;
+	return var;
+	}
+
+#ifdef HAVE_LIBBROTLIENC
+static VARIANT *brotli_body(const char *src, size_t len) {
+	VARIANT *var;
+	size_t bound;
+	bound = BrotliEncoderMaxCompressedSize(len);
+	var = (VARIANT *)malloc(sizeof(VARIANT) + bound);
+	var->len = bound;
+	if (!BrotliEncoderCompress(level > 9 ? 9 : level, BROTLI_DEFAULT_WINDOW,
+			BROTLI_MODE_TEXT, len, (const uint8_t *)src,
+			&var->len, (uint8_t *)var->data)) {
+		log_msg("compress: brotli failed\n");
+		free(var);
+		return NULL;
+		}
+	return var;
+	}
+#endif
+
+static void evict(void) {
+	VARIANT *var, **pt;
+	while ((cached_bytes > VARIANT_MAX_BYTES) && (oldest != NULL)) {
+		var = oldest;
+		oldest = var->older;
+		if (oldest == NULL) newest = NULL;
+		for (pt = &variants[var->hash % VARIANT_BUCKETS]; *pt != NULL;
+				pt = &((*pt)->link)) {
+			if (*pt == var) {
+				*pt = var->link;
+				break;
+				}
+			}
+		cached_bytes -= var->len + var->src_len;
+		if (--var->refs == 0) free(var);
+		}
+	return;
+	}
+
+static VARIANT *compress_body(int encoding, const char *src, size_t len) {
+#ifdef HAVE_LIBBROTLIENC
+	if (encoding == ENC_BROTLI) return brotli_body(src, len);
+#endif
+	return deflate_body(encoding, src, len);
+	}
+
+/*
+** Fetch or make the compressed form of a body. A shared body's
+** variant is cached, with the body copied in after the compressed
+** bytes; one-off bodies are only compressed. The caller holds a
+** reference to the result until variant_release().
+*/
+VARIANT *compress_variant(int encoding, const char *src, size_t len,
+				uint64_t hash, int shared) {
+	VARIANT *var, *grown;
+	if (!shared) {
+		if ((var = compress_body(encoding, src, len)) == NULL)
+			return NULL;
+		var->source = NULL;
+		var->src_len = len;
+		var->refs = 1;
+		scm_lock_mutex(vmutex);
+		n_uncached++;
+		n_bytes_in += len;
+		n_bytes_out += var->len;
+		scm_unlock_mutex(vmutex);
+		return var;
+		}
+	scm_lock_mutex(vmutex);
+	for (var = variants[hash % VARIANT_BUCKETS]; var != NULL;
+			var = var->link) {
+		if ((var->hash == hash) && (var->src_len == len) &&
+				(var->encoding == encoding) &&
+				(memcmp(var->source, src, len) == 0)) {
+			var->refs++;
+			n_hits++;
+			scm_unlock_mutex(vmutex);
+			return var;
+			}
+		}
+	n_misses++;
+	scm_unlock_mutex(vmutex);
+	if ((var = compress_body(encoding, src, len)) == NULL) return NULL;
+	if ((grown = (VARIANT *)realloc(var,
+			sizeof(VARIANT) + var->len + len)) == NULL) {
+		free(var);
+		return NULL;
+		}
+	var = grown;
+	memcpy(var->data + var->len, src, len);
+	var->source = var->data + var->len;
+	var->hash = hash;
+	var->src_len = len;
+	var->encoding = encoding;
+	var->refs = 2; // cache and caller
+	var->older = NULL;
+	scm_lock_mutex(vmutex);
+	n_bytes_in += len;
+	n_bytes_out += var->len;
+	var->link = variants[hash % VARIANT_BUCKETS];
+	variants[hash % VARIANT_BUCKETS] = var;
+	if (newest != NULL) newest->older = var;
+	newest = var;
+	if (oldest == NULL) oldest = var;
+	cached_bytes += var->len + len;
+	evict();
+	scm_unlock_mutex(vmutex);
+	return var;
+	}
+
+void variant_release(VARIANT *var) {
+	int refs;
+	scm_lock_mutex(vmutex);
+	refs = --var->refs;
+	scm_unlock_mutex(vmutex);
+	if (refs == 0) free(var);
+	return;
+	}
+
+static SCM http_compression(SCM enable, SCM size, SCM lvl) {
+	enabled = scm_is_true(enable);
+	if (size != SCM_UNDEFINED) min_size = scm_to_size_t(size);
+	if (lvl != SCM_UNDEFINED) {
+		level = scm_to_int(lvl);
+		if (level < 1) level = 1;
+		else if (level > 9) level = 9;
+		}
+	log_msg("compression %s, min %lu bytes, level %d\n",
+		(enabled ? "on" : "off"), (unsigned long)min_size, level);
+	return SCM_UNSPECIFIED;
+	}
+
+static SCM compression_stats(void) {
+	SCM stats;
+	scm_lock_mutex(vmutex);
+	stats = SCM_EOL;
+	stats = scm_acons(scm_from_utf8_symbol("cached-bytes"),
+			scm_from_size_t(cached_bytes), stats);
+	stats = scm_acons(scm_from_utf8_symbol("bytes-out"),
+			scm_from_ulong(n_bytes_out), stats);
+	stats = scm_acons(scm_from_utf8_symbol("bytes-in"),
+			scm_from_ulong(n_bytes_in), stats);
+	stats = scm_acons(scm_from_utf8_symbol("uncached"),
+			scm_from_ulong(n_uncached), stats);
+	stats = scm_acons(scm_from_utf8_symbol("misses"),
+			scm_from_ulong(n_misses), stats);
+	stats = scm_acons(scm_from_utf8_symbol("hits"),
+			scm_from_ulong(n_hits), stats);
+	scm_unlock_mutex(vmutex);
+	scm_remember_upto_here_1(stats);
+	return stats;
+	}
+
+void init_compress(void) {
+	int i;
+	for (i = 0; i < VARIANT_BUCKETS; i++) variants[i] = NULL;
+	scm_permanent_object(vmutex = scm_make_mutex());
+	scm_c_define_gsubr("http-compression", 1, 2, 0, http_compression);
+	scm_c_define_gsubr("compression-stats", 0, 0, 0, compression_stats);
+	log_msg("zlib version %s\n", zlibVersion());
+	}
+
+void shutdown_compress(void) {
+	VARIANT *var;
+	while (oldest != NULL) {
+		var = oldest;
+		oldest = var->older;
+		free(var);
+		}
+	newest = NULL;
+	return;
+	}
@@ -0,0 +1,44 @@
+/*
+** Copyright (c) 2013 Peter Yadlowsky <pmy@virginia.edu>
+**
+** This program is free software ; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation ; either version 3 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY ; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program ; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+#include <stdint.h>
+
+#define ENC_IDENTITY 0
+#define ENC_DEFLATE 1
+#define ENC_GZIP 2
+#define ENC_BROTLI 3
+
+typedef struct variant {
+	uint64_t hash;
+	size_t src_len;
+	const char *source; // copy of the body, if cached
+	int encoding;
+	int refs;
+	size_t len;
+	struct variant *link;
+	struct variant *older;
+	char data[];
+	} VARIANT;
+
+void init_compress(void);
+void shutdown_compress(void);
+int compress_wanted(size_t, const char *);
+int compress_negotiate(const char *);
+const char *compress_name(int);
+VARIANT *compress_variant(int, const char *, size_t, uint64_t, int);
+void variant_release(VARIANT *);
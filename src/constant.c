@@ -0,0 +1,170 @@
+/*
+** Copyright (c) 2013 Peter Yadlowsky <pmy@virginia.edu>
+**
+** This program is free software ; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation ; either version 3 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY ; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program ; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+/*
+** Constant responses: status, headers and body serialized once at
+** registration, then answered with a single write and no trip
+** through Guile. Entries are only ever prepended, and a replaced
+** buffer is never freed, so readers need no lock.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <errno.h>
+#include <libguile.h>
+
+#include "log.h"
+#include "reply.h"
+#include "constant.h"
+
+#define CONSTANT_MAX_PATH 1024
+
+static CONSTANT *constants = NULL;
+static SCM radix10;
+
+static char *header_value(SCM val) {
+	if (scm_is_string(val)) return scm_to_latin1_string(val);
+	if (scm_is_number(val))
+		return scm_to_latin1_string(scm_number_to_string(val, radix10));
+	if (scm_is_symbol(val))
+		return scm_to_latin1_string(scm_symbol_to_string(val));
+	return NULL;
+	}
+
+static SCM http_constant(SCM path, SCM status, SCM headers, SCM body) {
+	CONSTANT *entry;
+	RBUF buf;
+	SCM node;
+	char *str, line[64];
+	size_t blen;
+	rbuf_init(&buf, 1024);
+	rbuf_puts(&buf, "HTTP/1.1 ");
+	str = scm_to_latin1_string(status);
+	rbuf_puts(&buf, str);
+	free(str);
+	rbuf_put(&buf, "\r\n", 2);
+	for (node = headers; node != SCM_EOL; node = SCM_CDR(node)) {
+		str = scm_to_latin1_string(SCM_CAR(SCM_CAR(node)));
+		rbuf_puts(&buf, str);
+		free(str);
+		rbuf_put(&buf, ": ", 2);
+		if ((str = header_value(SCM_CDR(SCM_CAR(node)))) != NULL) {
+			rbuf_puts(&buf, str);
+			free(str);
+			}
+		rbuf_put(&buf, "\r\n", 2);
+		}
+	if (scm_is_bytevector(body)) {
+		blen = SCM_BYTEVECTOR_LENGTH(body);
+		str = NULL;
+		}
+	else str = scm_to_utf8_stringn(body, &blen);
+	snprintf(line, sizeof(line), "content-length: %lu\r\n\r\n",
+			(unsigned long)blen);
+	rbuf_puts(&buf, line);
+	entry = (CONSTANT *)malloc(sizeof(CONSTANT));
+	entry->head = buf.len;
+	if (str != NULL) {
+		rbuf_put(&buf, str, blen);
+		free(str);
+		}
+	else rbuf_put(&buf, (const char *)SCM_BYTEVECTOR_CONTENTS(body), blen);
+	entry->wire = buf.data;
+	entry->len = buf.len;
+	entry->hits = 0;
+	entry->path = scm_to_latin1_string(path);
+	entry->link = constants;
+	log_msg("set constant for %s (%lu bytes)\n", entry->path,
+			(unsigned long)entry->len);
+	constants = entry; // newest shadows any older entry for the path
+	scm_remember_upto_here_2(path, status);
+	scm_remember_upto_here_2(headers, body);
+	return SCM_UNSPECIFIED;
+	}
+
+/*
+** Match a raw request line ("GET /path?query HTTP/1.1") against the
+** registered constants. Only GET and HEAD qualify; the query string
+** is ignored.
+*/
+CONSTANT *constant_match(const char *line) {
+	CONSTANT *entry;
+	const char *path;
+	size_t n;
+	if (constants == NULL) return NULL;
+	if (strncmp(line, "GET ", 4) == 0) path = line + 4;
+	else if (strncmp(line, "HEAD ", 5) == 0) path = line + 5;
+	else return NULL;
+	n = strcspn(path, " ?\r\n");
+	if (n >= CONSTANT_MAX_PATH) return NULL;
+	for (entry = constants; entry != NULL; entry = entry->link) {
+		if ((strncmp(entry->path, path, n) == 0) &&
+				(entry->path[n] == '\0')) return entry;
+		}
+	return NULL;
+	}
+
+/*
+** Write the reply (only the head if head_only) from byte offset sent
+** on. With MSG_DONTWAIT in flags this stops when the socket buffer
+** is full. Returns the new offset, or -1 on error.
+*/
+ssize_t constant_write(int sock, CONSTANT *entry, int head_only,
+		size_t sent, int flags) {
+	size_t len;
+	ssize_t n;
+	len = constant_length(entry, head_only);
+	while (sent < len) {
+		n = send(sock, entry->wire + sent, len - sent,
+				MSG_NOSIGNAL | flags);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) return sent;
+			return -1;
+			}
+		sent += n;
+		}
+	entry->hits++;
+	return sent;
+	}
+
+int constant_send(int sock, CONSTANT *entry, const char *line) {
+	if (constant_write(sock, entry, line[0] == 'H', 0, 0) < 0) return -1;
+	return 0;
+	}
+
+static SCM constant_stats(void) {
+	CONSTANT *entry;
+	SCM stats;
+	stats = SCM_EOL;
+	for (entry = constants; entry != NULL; entry = entry->link) {
+		stats = scm_acons(scm_from_latin1_string(entry->path),
+				scm_from_ulong(entry->hits), stats);
+		}
+	scm_remember_upto_here_1(stats);
+	return stats;
+	}
+
+void init_constant(void) {
+	scm_permanent_object(radix10 = scm_from_int(10));
+	scm_c_define_gsubr("http-constant", 4, 0, 0, http_constant);
+	scm_c_define_gsubr("constant-stats", 0, 0, 0, constant_stats);
+	}
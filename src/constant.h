@@ -0,0 +1,34 @@
+/*
+** Copyright (c) 2013 Peter Yadlowsky <pmy@virginia.edu>
+**
+** This program is free software ; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation ; either version 3 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY ; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program ; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+typedef struct constant {
+	char *path;
+	const char *wire;
+	size_t len;
+	size_t head; // length of status line and headers, for HEAD
+	unsigned long hits;
+	struct constant *link;
+	} CONSTANT;
+
+void init_constant(void);
+CONSTANT *constant_match(const char *);
+ssize_t constant_write(int, CONSTANT *, int, size_t, int);
+int constant_send(int, CONSTANT *, const char *);
+
+#define constant_length(entry, head_only) \
+	((head_only) ? (entry)->head : (entry)->len)
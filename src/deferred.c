@@ -0,0 +1,251 @@
+/*
+** Copyright (c) 2013 Peter Yadlowsky <pmy@virginia.edu>
+**
+** This program is free software ; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation ; either version 3 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY ; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program ; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+/*
+** After-response work. Thunks handed to after-response during a
+** request are held per thread until the connection is closed, then
+** queued for a small background pool. The queue is a fixed ring; when
+** it is full the worker runs the thunk itself, which costs it time
+** but never the client.
+*/
+
+#include <stdlib.h>
+#include <libguile.h>
+
+#include "log.h"
+#include "deferred.h"
+
+#define DEFAULT_DEFERRED_THREADS 2
+#define DEFAULT_DEFERRED_QUEUE 1024
+
+static SCM pending; // fluid: thunks for the current request, or #f
+static SCM ring = SCM_BOOL_F;
+static size_t ring_size = DEFAULT_DEFERRED_QUEUE;
+static size_t head = 0, depth = 0, peak = 0;
+static int nthreads = 0;
+static int max_threads = DEFAULT_DEFERRED_THREADS;
+static SCM dmutex;
+static SCM dcondvar;
+static unsigned long queued = 0, ran = 0, failed = 0, overflow = 0;
+static unsigned long dropped = 0;
+
+static SCM run_body(void *data) {
+	return scm_call_0(*((SCM *)data));
+	}
+
+static SCM run_error(void *data, SCM key, SCM params) {
+	SCM format;
+	char *buf;
+	format = scm_c_public_ref("guile", "format");
+	buf = scm_to_locale_string(scm_call_4(format, SCM_BOOL_F,
+		scm_from_locale_string("~s ~s"), key, params));
+	log_msg("after-response: %s\n", buf);
+	free(buf);
+	*((int *)data) = 1;
+	scm_remember_upto_here_1(format);
+	scm_remember_upto_here_2(key, params);
+	return SCM_BOOL_F;
+	}
+
+static void run_thunk(SCM thunk) {
+	int err;
+	err = 0;
+	scm_c_catch(SCM_BOOL_T, run_body, (void *)&thunk,
+			run_error, (void *)&err, NULL, NULL);
+	scm_lock_mutex(dmutex);
+	if (err) failed++;
+	else ran++;
+	scm_unlock_mutex(dmutex);
+	scm_remember_upto_here_1(thunk);
+	}
+
+static SCM deferred_worker(void *data) {
+	SCM thunk;
+	while (1) {
+		scm_lock_mutex(dmutex);
+		while (depth == 0)
+			scm_wait_condition_variable(dcondvar, dmutex);
+		thunk = scm_c_vector_ref(ring, head);
+		scm_c_vector_set_x(ring, head, SCM_BOOL_F);
+		head = (head + 1) % ring_size;
+		depth--;
+		scm_unlock_mutex(dmutex);
+		run_thunk(thunk);
+		}
+	return SCM_BOOL_T;
+	}
+
+static void enqueue(SCM thunk) {
+	int full;
+	scm_lock_mutex(dmutex);
+	if (ring == SCM_BOOL_F)
+		scm_permanent_object(ring = scm_c_make_vector(ring_size,
+				SCM_BOOL_F));
+	while (nthreads < max_threads) {
+		nthreads++;
+		scm_spawn_thread(deferred_worker, NULL, NULL, NULL);
+		}
+	if ((full = (depth >= ring_size))) overflow++;
+	else {
+		scm_c_vector_set_x(ring, (head + depth) % ring_size, thunk);
+		depth++;
+		queued++;
+		if (depth > peak) peak = depth;
+		scm_signal_condition_variable(dcondvar);
+		}
+	scm_unlock_mutex(dmutex);
+	if (full) run_thunk(thunk);
+	scm_remember_upto_here_1(thunk);
+	}
+
+static void drop(SCM thunks, const char *why) {
+	long n;
+	if ((thunks == SCM_BOOL_F) || ((n = scm_ilength(thunks)) <= 0))
+		return;
+	scm_lock_mutex(dmutex);
+	dropped += n;
+	scm_unlock_mutex(dmutex);
+	log_msg("after-response: %s, dropped %ld thunk%s\n", why,
+			n, (n == 1 ? "" : "s"));
+	scm_remember_upto_here_1(thunks);
+	}
+
+static void drop_pending(void *data) {
+	SCM thunks;
+	thunks = scm_fluid_ref(pending);
+	scm_fluid_set_x(pending, SCM_BOOL_F);
+	drop(thunks, "request failed");
+	scm_remember_upto_here_1(thunks);
+	}
+
+/*
+** Called by the dispatcher inside its dynwind context before the
+** responder runs, and deferred_flush after the connection is
+** closed. If the request unwinds in between, its thunks are dropped
+** and logged, not left for the next request to find.
+*/
+void deferred_begin(void) {
+	scm_fluid_set_x(pending, SCM_EOL);
+	scm_dynwind_unwind_handler(drop_pending, NULL, 0);
+	}
+
+void deferred_flush(void) {
+	SCM thunks;
+	thunks = scm_fluid_ref(pending);
+	scm_fluid_set_x(pending, SCM_BOOL_F);
+	if (thunks == SCM_BOOL_F) return;
+	for (thunks = scm_reverse(thunks); thunks != SCM_EOL;
+			thunks = SCM_CDR(thunks))
+		enqueue(SCM_CAR(thunks));
+	scm_remember_upto_here_1(thunks);
+	}
+
+/*
+** A par task runs in a copy of the request's dynamic state, so what
+** it hands to after-response would be lost with the copy. The task
+** collects its own thunks between deferred_task_begin and
+** deferred_task_end; the request adopts them with deferred_adopt, or
+** they are dropped and logged if it stopped waiting for the task.
+*/
+void deferred_task_begin(void) {
+	if (scm_fluid_ref(pending) != SCM_BOOL_F)
+		scm_fluid_set_x(pending, SCM_EOL);
+	}
+
+SCM deferred_task_end(void) {
+	SCM thunks;
+	thunks = scm_fluid_ref(pending);
+	scm_fluid_set_x(pending, SCM_BOOL_F);
+	return thunks;
+	}
+
+// thunks newest first, as a task's list is kept
+void deferred_adopt(SCM thunks) {
+	SCM list;
+	if ((thunks == SCM_BOOL_F) || (thunks == SCM_EOL)) return;
+	list = scm_fluid_ref(pending);
+	if (list != SCM_BOOL_F)
+		scm_fluid_set_x(pending, scm_append(scm_list_2(thunks, list)));
+	else {
+		for (list = scm_reverse(thunks); list != SCM_EOL;
+				list = SCM_CDR(list))
+			enqueue(SCM_CAR(list));
+		}
+	scm_remember_upto_here_2(thunks, list);
+	}
+
+void deferred_drop(SCM thunks) {
+	drop(thunks, "par task abandoned");
+	}
+
+static SCM after_response(SCM thunk) {
+	SCM list;
+	list = scm_fluid_ref(pending);
+	if (list == SCM_BOOL_F) enqueue(thunk); // not inside a request
+	else scm_fluid_set_x(pending, scm_cons(thunk, list));
+	scm_remember_upto_here_2(thunk, list);
+	return SCM_UNSPECIFIED;
+	}
+
+static SCM after_response_pool(SCM threads, SCM queue) {
+	scm_lock_mutex(dmutex);
+	max_threads = scm_to_int(threads);
+	if ((queue != SCM_UNDEFINED) && (ring == SCM_BOOL_F)) {
+		ring_size = scm_to_size_t(queue);
+		if (ring_size < 1) ring_size = 1;
+		}
+	scm_unlock_mutex(dmutex);
+	scm_remember_upto_here_2(threads, queue);
+	return SCM_UNSPECIFIED;
+	}
+
+static SCM after_response_stats(void) {
+	SCM stats;
+	scm_lock_mutex(dmutex);
+	stats = SCM_EOL;
+	stats = scm_acons(scm_from_locale_symbol("threads"),
+			scm_from_int(nthreads), stats);
+	stats = scm_acons(scm_from_locale_symbol("dropped"),
+			scm_from_ulong(dropped), stats);
+	stats = scm_acons(scm_from_locale_symbol("overflow"),
+			scm_from_ulong(overflow), stats);
+	stats = scm_acons(scm_from_locale_symbol("failed"),
+			scm_from_ulong(failed), stats);
+	stats = scm_acons(scm_from_locale_symbol("ran"),
+			scm_from_ulong(ran), stats);
+	stats = scm_acons(scm_from_locale_symbol("queued"),
+			scm_from_ulong(queued), stats);
+	stats = scm_acons(scm_from_locale_symbol("peak"),
+			scm_from_size_t(peak), stats);
+	stats = scm_acons(scm_from_locale_symbol("depth"),
+			scm_from_size_t(depth), stats);
+	scm_unlock_mutex(dmutex);
+	scm_remember_upto_here_1(stats);
+	return stats;
+	}
+
+void init_deferred(void) {
+	scm_permanent_object(pending = scm_make_fluid());
+	scm_permanent_object(dmutex = scm_make_mutex());
+	scm_permanent_object(dcondvar = scm_make_condition_variable());
+	scm_c_define_gsubr("after-response", 1, 0, 0, after_response);
+	scm_c_define_gsubr("after-response-pool", 1, 1, 0,
+			after_response_pool);
+	scm_c_define_gsubr("after-response-stats", 0, 0, 0,
+			after_response_stats);
+	}
@@ -0,0 +1,208 @@
+/*
+** Copyright (c) 2013 Peter Yadlowsky <pmy@virginia.edu>
+**
+** This program is free software ; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation ; either version 3 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY ; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program ; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+/*
+** Request coalescing ("single flight"): concurrent requests for the
+** same key wait on the first one in flight and share its serialized
+** response. Flights are unlinked as soon as they land, so nothing
+** outlives the request that produced it.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <libguile.h>
+
+#include "log.h"
+#include "reply.h"
+#include "flight.h"
+
+#define FLIGHT_BUCKETS 64
+#define AIRBORNE 0
+#define LANDED 1
+#define CRASHED 2
+
+struct flight {
+	char *key;
+	unsigned int hash;
+	int state;
+	int waiters;
+	int refs;
+	REPLY reply;
+	struct flight *next;
+	};
+
+static FLIGHT *flights[FLIGHT_BUCKETS];
+static SCM fmutex;
+static SCM fcondvar;
+static unsigned long n_led = 0;
+static unsigned long n_coalesced = 0;
+static unsigned long n_timeouts = 0;
+static unsigned long n_overflow = 0;
+static unsigned long n_crashed = 0;
+
+static unsigned int hash_key(const char *key) {
+	unsigned int h;
+	h = 5381;
+	while (*key) h = (h * 33) ^ (unsigned char)*key++;
+	return h;
+	}
+
+static void unlink_flight(FLIGHT *flight) {
+	FLIGHT **pt;
+	for (pt = &flights[flight->hash % FLIGHT_BUCKETS];
+			*pt != NULL; pt = &((*pt)->next)) {
+		if (*pt == flight) {
+			*pt = flight->next;
+			break;
+			}
+		}
+	flight->next = NULL;
+	return;
+	}
+
+FLIGHT *flight_board(const char *key, int max_waiters, int *leader) {
+	FLIGHT *flight;
+	unsigned int hash;
+	hash = hash_key(key);
+	scm_lock_mutex(fmutex);
+	for (flight = flights[hash % FLIGHT_BUCKETS]; flight != NULL;
+			flight = flight->next) {
+		if ((flight->hash == hash) && (strcmp(flight->key, key) == 0))
+			break;
+		}
+	if (flight != NULL) {
+		if (flight->waiters >= max_waiters) {
+			n_overflow++;
+			scm_unlock_mutex(fmutex);
+			return NULL;
+			}
+		flight->waiters++;
+		flight->refs++;
+		*leader = 0;
+		scm_unlock_mutex(fmutex);
+		return flight;
+		}
+	flight = (FLIGHT *)malloc(sizeof(FLIGHT));
+	flight->key = strdup(key);
+	flight->hash = hash;
+	flight->state = AIRBORNE;
+	flight->waiters = 0;
+	flight->refs = 1;
+	reply_init(&flight->reply);
+	flight->next = flights[hash % FLIGHT_BUCKETS];
+	flights[hash % FLIGHT_BUCKETS] = flight;
+	n_led++;
+	*leader = 1;
+	scm_unlock_mutex(fmutex);
+	return flight;
+	}
+
+int flight_wait(FLIGHT *flight, double timeout) {
+	struct timeval now;
+	SCM deadline;
+	int landed;
+	gettimeofday(&now, NULL);
+	now.tv_sec += (time_t)timeout;
+	now.tv_usec += (long)((timeout - (time_t)timeout) * 1000000);
+	if (now.tv_usec >= 1000000) {
+		now.tv_sec++;
+		now.tv_usec -= 1000000;
+		}
+	deadline = scm_cons(scm_from_long(now.tv_sec),
+				scm_from_long(now.tv_usec));
+	scm_lock_mutex(fmutex);
+	while (flight->state == AIRBORNE) {
+		if (scm_timed_wait_condition_variable(fcondvar, fmutex,
+				deadline) == SCM_BOOL_F) break;
+		}
+	flight->waiters--;
+	landed = (flight->state == LANDED);
+	if (landed) n_coalesced++;
+	else if (flight->state == AIRBORNE) n_timeouts++;
+	scm_unlock_mutex(fmutex);
+	scm_remember_upto_here_1(deadline);
+	return landed;
+	}
+
+void flight_land(FLIGHT *flight, const REPLY *reply) {
+	REPLY copy;
+	reply_copy(&copy, reply);
+	scm_lock_mutex(fmutex);
+	flight->reply = copy;
+	flight->state = LANDED;
+	unlink_flight(flight);
+	scm_broadcast_condition_variable(fcondvar);
+	scm_unlock_mutex(fmutex);
+	flight_release(flight);
+	return;
+	}
+
+void flight_crash(FLIGHT *flight) {
+	scm_lock_mutex(fmutex);
+	flight->state = CRASHED;
+	n_crashed++;
+	unlink_flight(flight);
+	scm_broadcast_condition_variable(fcondvar);
+	scm_unlock_mutex(fmutex);
+	flight_release(flight);
+	return;
+	}
+
+void flight_release(FLIGHT *flight) {
+	int refs;
+	scm_lock_mutex(fmutex);
+	refs = --flight->refs;
+	scm_unlock_mutex(fmutex);
+	if (refs > 0) return;
+	free(flight->key);
+	reply_free(&flight->reply);
+	free(flight);
+	return;
+	}
+
+const REPLY *flight_payload(FLIGHT *flight) {
+	return &flight->reply;
+	}
+
+static SCM flight_stats(void) {
+	SCM stats;
+	scm_lock_mutex(fmutex);
+	stats = SCM_EOL;
+	stats = scm_acons(scm_from_utf8_symbol("crashed"),
+			scm_from_ulong(n_crashed), stats);
+	stats = scm_acons(scm_from_utf8_symbol("overflow"),
+			scm_from_ulong(n_overflow), stats);
+	stats = scm_acons(scm_from_utf8_symbol("timeouts"),
+			scm_from_ulong(n_timeouts), stats);
+	stats = scm_acons(scm_from_utf8_symbol("coalesced"),
+			scm_from_ulong(n_coalesced), stats);
+	stats = scm_acons(scm_from_utf8_symbol("led"),
+			scm_from_ulong(n_led), stats);
+	scm_unlock_mutex(fmutex);
+	scm_remember_upto_here_1(stats);
+	return stats;
+	}
+
+void init_flight(void) {
+	int i;
+	for (i = 0; i < FLIGHT_BUCKETS; i++) flights[i] = NULL;
+	scm_permanent_object(fmutex = scm_make_mutex());
+	scm_permanent_object(fcondvar = scm_make_condition_variable());
+	scm_c_define_gsubr("coalesce-stats", 0, 0, 0, flight_stats);
+	}
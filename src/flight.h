@@ -0,0 +1,27 @@
+/*
+** Copyright (c) 2013 Peter Yadlowsky <pmy@virginia.edu>
+**
+** This program is free software ; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation ; either version 3 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY ; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program ; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+typedef struct flight FLIGHT;
+
+void init_flight(void);
+FLIGHT *flight_board(const char *, int, int *);
+int flight_wait(FLIGHT *, double);
+void flight_land(FLIGHT *, const REPLY *);
+void flight_crash(FLIGHT *);
+void flight_release(FLIGHT *);
+const REPLY *flight_payload(FLIGHT *);
@@ -22,6 +22,8 @@
 #include <curl/curl.h>
 #include <regex.h>
 
+#include "park.h"
+
 struct g_time {
 	struct tm time;
 	int usec;
@@ -129,6 +131,23 @@ SCM format_time(SCM time, SCM format) {
 	return ftime;
 	}
 
+/*
+** Interval clocks for the telemetry modules, in nanoseconds: now_ns
+** is CLOCK_MONOTONIC, the one request timestamps are taken on, and
+** cpu_ns is the calling thread's CPU time.
+*/
+unsigned long now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long)ts.tv_sec * 1000000000UL + ts.tv_nsec;
+	}
+
+unsigned long cpu_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return (unsigned long)ts.tv_sec * 1000000000UL + ts.tv_nsec;
+	}
+
 inline double epoch_sec(struct g_time *time) {
 	return (time->epoch + time->usec / 1000000.0);
 	}
@@ -251,6 +270,10 @@ static SCM time_zone(SCM time) {
 	return scm_from_locale_string(gtime->time.tm_zone);
 	}
 
+static void *nap(void *data) {
+	return (void *)(long)nanosleep((struct timespec *)data, NULL);
+	}
+
 static SCM snooze(SCM sec) {
 	double naptime, dsec;
 	struct timespec ts;
@@ -258,7 +281,7 @@ static SCM snooze(SCM sec) {
 	ts.tv_sec = (time_t)(dsec = floor(naptime));
 	ts.tv_nsec = (naptime - dsec) * 1000000000;
 	scm_remember_upto_here_1(sec);
-	return (nanosleep(&ts, NULL) == 0 ? SCM_BOOL_T : SCM_BOOL_F);
+	return (park(nap, &ts) == NULL ? SCM_BOOL_T : SCM_BOOL_F);
 	}
 
 static SCM time_decode(SCM stamp) {
@@ -21,5 +21,7 @@
 extern scm_t_bits time_tag;
 SCM local_time_intern(int, int, int, int, int, int);
 SCM format_time(SCM, SCM);
+unsigned long now_ns(void);
+unsigned long cpu_ns(void);
 void init_time(void);
 void shutdown_time(void);
@@ -0,0 +1,89 @@
+/*
+** Copyright (c) 2013 Peter Yadlowsky <pmy@virginia.edu>
+**
+** This program is free software ; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation ; either version 3 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY ; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program ; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+/*
+** Native handler ABI. A shared object registered with http-native
+** exports a function of type gusher_handler; it runs on a worker
+** thread with no access to Scheme. Everything it needs from the
+** server comes through the GUSHER_API table, which only ever grows
+** at the end, so objects built against an older header keep working.
+**
+**   #include <gusher.h>
+**   int hello(const GUSHER_REQ *req, GUSHER_RESP *resp,
+**		const GUSHER_API *api) {
+**	api->puts(resp, "hello\n");
+**	return 0;
+**	}
+*/
+
+#include <stddef.h>
+
+#define GUSHER_ABI 1
+
+typedef struct gusher_header {
+	const char *name; // lower case
+	const char *value;
+	} GUSHER_HEADER;
+
+typedef struct gusher_req {
+	const char *method; // "GET", "POST", ...
+	const char *path; // undecoded, without query string
+	const char *path_info; // remainder after the registered prefix
+	const char *query; // undecoded query string, "" if none
+	const char *remote_host;
+	int remote_port;
+	int nheaders;
+	const GUSHER_HEADER *headers;
+	const char *body; // NUL-terminated for convenience
+	size_t body_len;
+	} GUSHER_REQ;
+
+typedef struct gusher_resp {
+	int status; // 200 unless set
+	char content_type[64]; // "text/plain" unless set
+	void *priv; // server-owned
+	} GUSHER_RESP;
+
+typedef struct gusher_api {
+	int abi;
+	size_t size; // sizeof(GUSHER_API) as seen by the server
+	void (*write)(GUSHER_RESP *, const void *, size_t);
+	void (*puts)(GUSHER_RESP *, const char *);
+	void (*printf)(GUSHER_RESP *, const char *, ...);
+	void (*header)(GUSHER_RESP *, const char *, const char *);
+	const char *(*req_header)(const GUSHER_REQ *, const char *);
+	// decoded query or form parameter into buf, -1 if absent
+	int (*param)(const GUSHER_REQ *, const char *, char *, size_t);
+	// PGconn * cached per worker thread and conninfo
+	void *(*pg_conn)(const char *);
+	// PGresult * with status checked, NULL on error; free with pg_clear
+	void *(*pg_exec)(const char *, const char *, int,
+			const char *const *);
+	void (*pg_clear)(void *);
+	void (*json_string)(GUSHER_RESP *, const char *);
+	// rows of a PGresult as a JSON array of objects, or the first
+	// row as a lone object (null if none) when single is set
+	void (*json_rows)(GUSHER_RESP *, void *, int);
+	// fill-template: slots are name/value pairs, nslots pairs long
+	void (*fill_template)(GUSHER_RESP *, const char *,
+			const char *const *, int, int);
+	void (*log)(const char *, ...);
+	} GUSHER_API;
+
+typedef int (*gusher_handler)(const GUSHER_REQ *, GUSHER_RESP *,
+		const GUSHER_API *);
@@ -0,0 +1,279 @@
+/*
+** Copyright (c) 2013 Peter Yadlowsky <pmy@virginia.edu>
+**
+** This program is free software ; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation ; either version 3 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY ; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program ; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+/*
+** Boehm GC knobs and telemetry. Startup settings (-G) go into the
+** GC_* environment before Guile brings the collector up, and are
+** applied again through the API afterwards. Pause time is taken from
+** the collector's own start and end events where libgc has them
+** (7.4 on). Otherwise it falls back to Guile's before-gc and after-gc
+** C hooks. The after-gc hook runs from an async at the triggering
+** thread's next safe point, which may come after arbitrary Scheme or
+** blocking time, so those pauses are upper bounds only; gc-stats
+** says which it is. The collector only keeps process-wide allocation
+** counts, so per-route bytes include whatever other threads
+** allocated during the request.
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <libguile.h>
+#include <gc/gc.h>
+
+#include "log.h"
+#include "stats.h"
+#include "heap.h"
+#include "bytes.h"
+#include "gtime.h"
+
+struct gc_account {
+	volatile unsigned long requests;
+	volatile unsigned long bytes;
+	volatile unsigned long collections;
+	volatile unsigned long pause_ns;
+	};
+
+static size_t initial_heap = 0;
+static long divisor = 0;
+static int incremental = 0;
+static volatile unsigned long gc_started = 0;
+static volatile unsigned long pause_total = 0, pause_max = 0;
+static volatile unsigned long pauses = 0;
+
+static size_t parse_size(const char *spec) {
+	char *end;
+	size_t size;
+	size = strtoul(spec, &end, 10);
+	switch (*end) {
+		case 'g': case 'G': size <<= 10;
+		case 'm': case 'M': size <<= 10;
+		case 'k': case 'K': size <<= 10;
+		}
+	return size;
+	}
+
+/*
+** -G heap=512M,divisor=4,incremental,markers=4
+** Must run before scm_init_guile. Returns 0 on a bad spec.
+*/
+int heap_option(const char *spec) {
+	char buf[256], num[32], *item, *save, *val;
+	strncpy(buf, spec, sizeof(buf) - 1);
+	buf[sizeof(buf) - 1] = '\0';
+	for (item = strtok_r(buf, ",", &save); item != NULL;
+			item = strtok_r(NULL, ",", &save)) {
+		if ((val = index(item, '=')) != NULL) *val++ = '\0';
+		if ((strcmp(item, "heap") == 0) && (val != NULL)) {
+			initial_heap = parse_size(val);
+			snprintf(num, sizeof(num), "%lu",
+					(unsigned long)initial_heap);
+			setenv("GC_INITIAL_HEAP_SIZE", num, 1);
+			}
+		else if ((strcmp(item, "divisor") == 0) && (val != NULL)) {
+			divisor = atol(val);
+			setenv("GC_FREE_SPACE_DIVISOR", val, 1);
+			}
+		else if ((strcmp(item, "markers") == 0) && (val != NULL))
+			setenv("GC_MARKERS", val, 1);
+		else if (strcmp(item, "incremental") == 0) {
+			incremental = 1;
+			setenv("GC_ENABLE_INCREMENTAL", "1", 1);
+			}
+		else {
+			log_msg("unknown GC option: %s\n", item);
+			return 0;
+			}
+		}
+	return 1;
+	}
+
+static void pause_done(void) {
+	unsigned long started, pause, max;
+	started = gc_started;
+	if ((started == 0) ||
+			!__sync_bool_compare_and_swap(&gc_started, started, 0))
+		return;
+	pause = now_ns() - started;
+	__sync_fetch_and_add(&pause_total, pause);
+	__sync_fetch_and_add(&pauses, 1);
+	while ((max = pause_max) < pause)
+		__sync_bool_compare_and_swap(&pause_max, max, pause);
+	}
+
+#ifdef HAVE_GC_SET_ON_COLLECTION_EVENT
+static GC_on_collection_event_proc chained_event = NULL;
+
+// allocation lock held: no consing here
+static void collection_event(GC_EventType event) {
+	if (event == GC_EVENT_START) gc_started = now_ns();
+	else if (event == GC_EVENT_END) pause_done();
+	if (chained_event != NULL) chained_event(event);
+	}
+#else
+static void *before_gc(void *hook_data, void *fn_data, void *data) {
+	gc_started = now_ns(); // allocation lock held: no consing here
+	return NULL;
+	}
+
+static void *after_gc(void *hook_data, void *fn_data, void *data) {
+	pause_done();
+	return NULL;
+	}
+#endif
+
+GC_ACCOUNT *heap_counters(void) {
+	return (GC_ACCOUNT *)calloc(1, sizeof(GC_ACCOUNT));
+	}
+
+void heap_begin(HEAP_SAMPLE *sample) {
+	sample->bytes = GC_get_total_bytes();
+	sample->collections = GC_get_gc_no();
+	sample->pause_ns = pause_total;
+	}
+
+/*
+** Fold a request into its route.
+*/
+void heap_end(ROUTE_STATS *route, const HEAP_SAMPLE *sample) {
+	GC_ACCOUNT *acct;
+	if (route == NULL) route = stats_route(NULL);
+	acct = route->gc;
+	__sync_fetch_and_add(&acct->requests, 1);
+	__sync_fetch_and_add(&acct->bytes,
+			GC_get_total_bytes() - sample->bytes);
+	__sync_fetch_and_add(&acct->collections,
+			GC_get_gc_no() - sample->collections);
+	__sync_fetch_and_add(&acct->pause_ns,
+			pause_total - sample->pause_ns);
+	}
+
+static SCM gc_stats(void) {
+	ROUTE_STATS *route;
+	GC_ACCOUNT *acct;
+	SCM stats, routes, entry;
+	routes = SCM_EOL;
+	entry = SCM_EOL;
+	for (route = stats_routes(); route != NULL; route = route->link) {
+		acct = route->gc;
+		entry = SCM_EOL;
+		entry = scm_acons(scm_from_latin1_symbol("pause-ms"),
+			scm_from_double(acct->pause_ns / 1e6), entry);
+		entry = scm_acons(scm_from_latin1_symbol("collections"),
+			scm_from_ulong(acct->collections), entry);
+		entry = scm_acons(scm_from_latin1_symbol("bytes"),
+			scm_from_ulong(acct->bytes), entry);
+		entry = scm_acons(scm_from_latin1_symbol("requests"),
+			scm_from_ulong(acct->requests), entry);
+		routes = scm_acons(scm_from_locale_string(route->path),
+			entry, routes);
+		}
+	stats = SCM_EOL;
+	stats = scm_acons(scm_from_latin1_symbol("routes"), routes, stats);
+#ifdef HAVE_GC_SET_ON_COLLECTION_EVENT
+	stats = scm_acons(scm_from_latin1_symbol("pause-upper-bound"),
+			SCM_BOOL_F, stats);
+#else
+	stats = scm_acons(scm_from_latin1_symbol("pause-upper-bound"),
+			SCM_BOOL_T, stats);
+#endif
+	stats = scm_acons(scm_from_latin1_symbol("pause-max-ms"),
+			scm_from_double(pause_max / 1e6), stats);
+	stats = scm_acons(scm_from_latin1_symbol("pause-total-ms"),
+			scm_from_double(pause_total / 1e6), stats);
+	stats = scm_acons(scm_from_latin1_symbol("pauses"),
+			scm_from_ulong(pauses), stats);
+	stats = scm_acons(scm_from_latin1_symbol("collections"),
+			scm_from_ulong(GC_get_gc_no()), stats);
+	stats = scm_acons(scm_from_latin1_symbol("incremental"),
+			scm_from_bool(GC_is_incremental_mode()), stats);
+	stats = scm_acons(scm_from_latin1_symbol("free-space-divisor"),
+			scm_from_ulong(GC_get_free_space_divisor()), stats);
+	stats = scm_acons(scm_from_latin1_symbol("total-bytes"),
+			scm_from_size_t(GC_get_total_bytes()), stats);
+	stats = scm_acons(scm_from_latin1_symbol("bytes-since-gc"),
+			scm_from_size_t(GC_get_bytes_since_gc()), stats);
+	stats = scm_acons(scm_from_latin1_symbol("unmapped-bytes"),
+			scm_from_size_t(GC_get_unmapped_bytes()), stats);
+	stats = scm_acons(scm_from_latin1_symbol("free-bytes"),
+			scm_from_size_t(GC_get_free_bytes()), stats);
+	stats = scm_acons(scm_from_latin1_symbol("heap-size"),
+			scm_from_size_t(GC_get_heap_size()), stats);
+	scm_remember_upto_here_2(stats, routes);
+	scm_remember_upto_here_1(entry);
+	return stats;
+	}
+
+/*
+** (gc-tune '((free-space-divisor . 4) (incremental . #t)
+**	(expand . 67108864) (collect . #t)))
+*/
+static SCM gc_tune(SCM options) {
+	SCM node, pair, key;
+	const char *name;
+	char sym[32];
+	pair = SCM_EOL;
+	key = SCM_EOL;
+	for (node = options; scm_is_pair(node); node = SCM_CDR(node)) {
+		pair = SCM_CAR(node);
+		if (!scm_is_pair(pair) || !scm_is_symbol(SCM_CAR(pair))) continue;
+		key = scm_symbol_to_string(SCM_CAR(pair));
+		scm_to_bytes(key, sym, sizeof(sym));
+		name = sym;
+		if ((strcmp(name, "free-space-divisor") == 0) &&
+				scm_is_integer(SCM_CDR(pair)))
+			GC_set_free_space_divisor(scm_to_ulong(SCM_CDR(pair)));
+		else if ((strcmp(name, "incremental") == 0) &&
+				scm_is_true(SCM_CDR(pair)))
+			GC_enable_incremental();
+		else if ((strcmp(name, "expand") == 0) &&
+				scm_is_integer(SCM_CDR(pair)))
+			GC_expand_hp(scm_to_size_t(SCM_CDR(pair)));
+		else if ((strcmp(name, "collect") == 0) &&
+				scm_is_true(SCM_CDR(pair)))
+			scm_gc();
+		else {
+			log_msg("gc-tune: unknown option %s\n", name);
+			return SCM_BOOL_F;
+			}
+		}
+	scm_remember_upto_here_2(options, pair);
+	scm_remember_upto_here_1(key);
+	return SCM_BOOL_T;
+	}
+
+void init_heap(void) {
+	size_t heap;
+	if (divisor > 0) GC_set_free_space_divisor(divisor);
+	if (incremental) GC_enable_incremental();
+	heap = GC_get_heap_size();
+	if (initial_heap > heap) GC_expand_hp(initial_heap - heap);
+#ifdef HAVE_GC_SET_ON_COLLECTION_EVENT
+	chained_event = GC_get_on_collection_event();
+	GC_set_on_collection_event(collection_event);
+#else
+	scm_c_hook_add(&scm_before_gc_c_hook, before_gc, NULL, 0);
+	scm_c_hook_add(&scm_after_gc_c_hook, after_gc, NULL, 0);
+#endif
+	scm_c_define_gsubr("gc-stats", 0, 0, 0, gc_stats);
+	scm_c_define_gsubr("gc-tune", 1, 0, 0, gc_tune);
+	}
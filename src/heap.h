@@ -0,0 +1,34 @@
+/*
+** Copyright (c) 2013 Peter Yadlowsky <pmy@virginia.edu>
+**
+** This program is free software ; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation ; either version 3 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY ; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program ; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+#include <libguile.h>
+
+typedef struct heap_sample {
+	size_t bytes;
+	unsigned long collections;
+	unsigned long pause_ns;
+	} HEAP_SAMPLE;
+
+typedef struct gc_account GC_ACCOUNT;
+struct route_stats;
+
+int heap_option(const char *);
+GC_ACCOUNT *heap_counters(void);
+void heap_begin(HEAP_SAMPLE *);
+void heap_end(struct route_stats *, const HEAP_SAMPLE *);
+void init_heap(void);
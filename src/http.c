@@ -25,12 +25,18 @@
 
 #include "json.h"
 #include "log.h"
+#include "park.h"
+#include "watchdog.h"
+#include "trace.h"
+#include "usage.h"
+#include "bytes.h"
 
 #define match(a,b) (strcmp(a,b) == 0)
 #define symbol(s) (scm_from_utf8_symbol(s))
 
 typedef struct chandle {
 	CURL *handle;
+	char *url; // for trace spans
 	} CHANDLE;
 
 typedef struct cnode {
@@ -68,27 +74,60 @@ inline SCM scm_from_string(const char *str) {
 
 static size_t header_handler(void *data, size_t size,
 			size_t n, void *userp) {
-	char *buf, *pt, *value;
 	size_t rsize;
-	SCM sym, val;
-	buf = (char *)data;
+	CNODE *node;
 	rsize = size * n;
-	buf[rsize] = '\0';
-	if ((pt = index(buf, ':')) == NULL) return rsize;
-	*pt++ = '\0';
-	while (isspace(*pt)) pt++;
-	sym = symbol(downcase(buf));
-	value = pt;
-	pt = value + strlen(value) - 1;
-	while (isspace(*pt)) {
-		*pt = '\0';
-		if (pt == value) break;
-		pt--;
+	node = (CNODE *)malloc(sizeof(CNODE) + rsize + 1);
+	memcpy(node->content, data, rsize);
+	node->content[rsize] = '\0';
+	node->size = rsize;
+	node->next = *((CNODE **)userp);
+	*((CNODE **)userp) = node;
+	return rsize;
+	}
+
+/*
+** Header lines are collected raw while the transfer runs outside
+** Guile, then turned into an alist here, newest first as before.
+*/
+static SCM parse_headers(CNODE *lines) {
+	CNODE *node, *prev;
+	char *buf, *pt, *value;
+	SCM headers, sym, val;
+	prev = NULL;
+	while (lines != NULL) {
+		node = lines->next;
+		lines->next = prev;
+		prev = lines;
+		lines = node;
+		}
+	headers = SCM_EOL;
+	sym = val = SCM_EOL;
+	while ((node = prev) != NULL) {
+		prev = node->next;
+		buf = node->content;
+		if ((pt = index(buf, ':')) != NULL) {
+			*pt++ = '\0';
+			while (isspace(*pt)) pt++;
+			sym = symbol(downcase(buf));
+			value = pt;
+			pt = value + strlen(value) - 1;
+			while (isspace(*pt)) {
+				*pt = '\0';
+				if (pt == value) break;
+				pt--;
+				}
+			val = scm_from_latin1_string(value);
+			headers = scm_acons(sym, val, headers);
+			}
+		free(node);
 		}
-	val = scm_from_latin1_string(value);
-	*((SCM *)userp) = scm_acons(sym, val, *((SCM *)userp));
 	scm_remember_upto_here_2(sym, val);
-	return rsize;
+	return headers;
+	}
+
+static void *perform(void *handle) {
+	return (void *)(long)curl_easy_perform((CURL *)handle);
 	}
 
 static SCM trim_cat(SCM list) {
@@ -268,17 +307,18 @@ static SCM http_url_encode(SCM src) {
 		if (encode_handle != NULL) {
 			char *ssrc = scm_to_utf8_string(src);
 			char *enc = curl_easy_escape(encode_handle, ssrc, 0);
-			out = scm_take_locale_string(enc);
+			out = bytes_to_scm(enc);
+			curl_free(enc);
 			free(ssrc);
 			}
 		else {
-			out = scm_from_locale_string("");
+			out = bytes_to_scm("");
 			log_msg("http_url_encode: curl init failed\n");
 			}
 		return out;
 		scm_remember_upto_here_1(out);
 		}
-	return scm_from_locale_string("");
+	return bytes_to_scm("");
 	}
 
 static CURL *new_handle(const char *url) {
@@ -297,41 +337,50 @@ static SCM http_handle(SCM url) {
 	scm_remember_upto_here_1(url);
 	CHANDLE *node = (CHANDLE *)scm_gc_malloc(sizeof(CHANDLE), "chandle");
 	node->handle = new_handle(surl);
-	free(surl);
-	if (node->handle == NULL) return SCM_BOOL_F;
+	node->url = surl;
+	if (node->handle == NULL) {
+		free(surl);
+		node->url = NULL;
+		return SCM_BOOL_F;
+		}
 	SCM_RETURN_NEWSMOB(chandle_tag, node);
 	}
 
 static SCM http_get_master(SCM url, SCM args, int raw) {
 	CURL *handle;
-	char errbuf[CURL_ERROR_SIZE], *bag, *pt, *userpwd, *post_str;
+	char errbuf[CURL_ERROR_SIZE], *bag, *pt, *userpwd, *post_str, *surl;
 	CURLcode res;
-	CNODE *chunks, *next;
+	CNODE *chunks, *hlines, *next;
 	long rescode;
-	int local_handle;
+	int local_handle, span;
+	unsigned long io;
 	size_t tsize;
+	struct curl_slist *trace_hdrs;
+	char rid[TRACE_ID_MAX + 32], tp[80];
 	if (SCM_SMOB_PREDICATE(chandle_tag, url)) {
 		local_handle = 0;
 		CHANDLE *obj = (CHANDLE *)SCM_SMOB_DATA(url);
 		handle = obj->handle;
+		surl = obj->url;
 		}
 	else {
 		local_handle = 1;
-		char *surl = scm_to_utf8_string(url);
+		surl = scm_to_utf8_string(url);
 		handle = new_handle(surl);
-		free(surl);
 		if (handle == NULL) {
+			free(surl);
 			log_msg("http_get: curl init failed\n");
 			return SCM_BOOL_F;
 			}
 		}
 	scm_remember_upto_here_1(url);
 	chunks = NULL;
+	hlines = NULL;
 	userpwd = NULL;
 	post_str = NULL;
 	SCM headers = SCM_EOL;
 	curl_easy_setopt(handle, CURLOPT_WRITEDATA, (void *)&chunks);
-	curl_easy_setopt(handle, CURLOPT_HEADERDATA, (void *)&headers);
+	curl_easy_setopt(handle, CURLOPT_HEADERDATA, (void *)&hlines);
 	curl_easy_setopt(handle, CURLOPT_ERRORBUFFER, errbuf);
 	if ((post_str = post_data(handle, args)) != NULL) {
 		curl_easy_setopt(handle, CURLOPT_POST, 1);
@@ -344,7 +393,24 @@ static SCM http_get_master(SCM url, SCM args, int raw) {
 		curl_easy_setopt(handle, CURLOPT_USERPWD, userpwd);
 		}
 	scm_remember_upto_here_1(args);
-	res = curl_easy_perform(handle);
+	// no longer than the current request has left, if it has a deadline
+	curl_easy_setopt(handle, CURLOPT_TIMEOUT_MS,
+			(long)(watch_remaining() * 1000));
+	trace_hdrs = NULL;
+	if (trace_outbound(rid, sizeof(rid), tp, sizeof(tp))) {
+		trace_hdrs = curl_slist_append(trace_hdrs, rid);
+		if (tp[0]) trace_hdrs = curl_slist_append(trace_hdrs, tp);
+		}
+	curl_easy_setopt(handle, CURLOPT_HTTPHEADER, trace_hdrs);
+	span = trace_span_begin("http", surl);
+	if (local_handle) free(surl);
+	io = usage_io_begin();
+	res = (CURLcode)(long)park(perform, handle);
+	usage_io_end(USAGE_HTTP, io);
+	trace_span_end(span);
+	curl_easy_setopt(handle, CURLOPT_HTTPHEADER, NULL);
+	curl_slist_free_all(trace_hdrs);
+	headers = parse_headers(hlines);
 	free(userpwd);
 	free(post_str);
 	curl_easy_getinfo(handle, CURLINFO_RESPONSE_CODE, &rescode);
@@ -403,6 +469,8 @@ static size_t free_chandle(SCM smob) {
 		curl_easy_cleanup(obj->handle);
 		obj->handle = NULL;
 		}
+	free(obj->url);
+	obj->url = NULL;
 	return 0;
 	}
 
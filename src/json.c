@@ -22,14 +22,18 @@
 #include <stdio.h>
 
 #include "log.h"
+#include "reply.h"
+#include "json.h"
 #include "gtime.h"
+#include "bytes.h"
+#include "arena.h"
 
 static char *make_key(SCM obj) {
 	SCM string;
 	char *key;
 	if (scm_is_string(obj)) string = obj;
 	else string = scm_symbol_to_string(obj);
-	key = scm_to_utf8_string(string);
+	key = scm_to_utf8_arena(string, NULL);
 	scm_remember_upto_here_2(obj, string);
 	return key;
 	}
@@ -43,20 +47,26 @@ static void ds(const char *src) {
 	return;
 	}
 
+/*
+** jansson copies keys and strings, so each staging copy is released
+** as soon as it has been handed over.
+*/
 static json_t *json_build(SCM obj) {
+	ARENA_MARK mark;
 	json_t *jobj;
 	SCM node;
 	char *buf;
+	mark = arena_mark();
 	if (scm_is_string(obj)) {
-		buf = scm_to_utf8_string(obj);
+		buf = scm_to_utf8_arena(obj, NULL);
 //ds(buf);
 		jobj = json_string(buf);
-		free(buf);
+		arena_release(mark);
 		}
 	else if (scm_is_symbol(obj)) {
-		buf = scm_to_utf8_string(scm_symbol_to_string(obj));
+		buf = scm_to_utf8_arena(scm_symbol_to_string(obj), NULL);
 		jobj = json_string(buf);
-		free(buf);
+		arena_release(mark);
 		}
 	else if (scm_boolean_p(obj) == SCM_BOOL_T)
 		jobj = (obj == SCM_BOOL_T ? json_true() : json_false());
@@ -79,7 +89,7 @@ static json_t *json_build(SCM obj) {
 			key = make_key(SCM_CAR(pair));
 			json_object_set_new(jobj, key,
 					json_build(SCM_CDR(pair)));
-			free(key);
+			arena_release(mark);
 			}
 		scm_remember_upto_here_1(pair);
 		}
@@ -90,10 +100,10 @@ static json_t *json_build(SCM obj) {
 					json_build(SCM_CAR(node)));
 		}
 	else if (SCM_SMOB_PREDICATE(time_tag, obj)) {
-		buf = scm_to_utf8_string(format_time(obj,
-			scm_from_utf8_string("%Y-%m-%d %H:%M:%S")));
+		buf = scm_to_utf8_arena(format_time(obj,
+			scm_from_utf8_string("%Y-%m-%d %H:%M:%S")), NULL);
 		jobj = json_string(buf);
-		free(buf);
+		arena_release(mark);
 		}
 	else jobj = json_null();
 	scm_remember_upto_here_2(obj, node);
@@ -110,10 +120,15 @@ static void discard(json_t *obj) {
 	}
 */
 SCM json_encode(SCM obj) {
+	ARENA_MARK mark;
 	char *buf;
 	SCM out;
 	json_t *root;
+	scm_dynwind_begin(0);
+	mark = arena_mark();
+	arena_dynwind_release(&mark);
 	root = json_build(obj);
+	scm_dynwind_end();
 	scm_remember_upto_here_1(obj);
 	buf = json_dumps(root, JSON_COMPACT);
 //ds(buf);
@@ -167,13 +182,19 @@ static SCM parse(json_t *obj) {
 	}
 
 SCM json_decode(SCM string) {
+	ARENA_MARK mark;
 	char *buf;
+	size_t len;
 	SCM obj;
 	json_t *root;
 	json_error_t err;
-	buf = scm_to_utf8_string(string);
+	scm_dynwind_begin(0);
+	mark = arena_mark();
+	arena_dynwind_release(&mark);
+	buf = scm_to_utf8_arena(string, &len);
 //ds(buf);
-	root = json_loads(buf, 0, &err);
+	root = json_loadb(buf, len, 0, &err);
+	scm_dynwind_end();
 	if (root == NULL) {
 		/*log_msg("json decode: \"%s\" %s %d:%d:%d \"%s\"\n",
 				buf, err.source, err.line, err.column, err.position,
@@ -183,11 +204,60 @@ SCM json_decode(SCM string) {
 	else obj = parse(root);
 	//discard(root);
 	json_decref(root);
-	free(buf);
 	scm_remember_upto_here_2(string, obj);
 	return obj;
 	}
 
+/*
+** Decode straight from a byte buffer, no NUL needed. On failure,
+** returns #f and leaves jansson's message in errmsg.
+*/
+SCM json_decode_buffer(const char *buf, size_t len, char *errmsg,
+		size_t errlen) {
+	json_t *root;
+	json_error_t err;
+	SCM obj;
+	root = json_loadb(buf, len, JSON_DECODE_ANY, &err);
+	if (root == NULL) {
+		snprintf(errmsg, errlen, "%s at %d:%d", err.text, err.line,
+				err.column);
+		return SCM_BOOL_F;
+		}
+	obj = parse(root);
+	json_decref(root);
+	scm_remember_upto_here_1(obj);
+	return obj;
+	}
+
+/*
+** Append a C string as a quoted JSON string. UTF-8 passes through
+** untouched; only quotes, backslashes and controls are escaped.
+*/
+void json_put_string(RBUF *out, const char *src) {
+	const unsigned char *pt, *mark;
+	char esc[8];
+	rbuf_put(out, "\"", 1);
+	mark = (const unsigned char *)src;
+	for (pt = mark; *pt; pt++) {
+		if ((*pt >= 0x20) && (*pt != '"') && (*pt != '\\')) continue;
+		rbuf_put(out, (const char *)mark, pt - mark);
+		mark = pt + 1;
+		switch (*pt) {
+		case '"': rbuf_put(out, "\\\"", 2); break;
+		case '\\': rbuf_put(out, "\\\\", 2); break;
+		case '\n': rbuf_put(out, "\\n", 2); break;
+		case '\r': rbuf_put(out, "\\r", 2); break;
+		case '\t': rbuf_put(out, "\\t", 2); break;
+		default:
+			snprintf(esc, sizeof(esc), "\\u%04x", *pt);
+			rbuf_put(out, esc, 6);
+			}
+		}
+	rbuf_put(out, (const char *)mark, pt - mark);
+	rbuf_put(out, "\"", 1);
+	return;
+	}
+
 void init_json(void) {
 	scm_c_define_gsubr("json-encode", 1, 0, 0, json_encode);
 	scm_c_define_gsubr("json-decode", 1, 0, 0, json_decode);
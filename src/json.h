@@ -18,6 +18,10 @@
 
 #include <libguile.h>
 
+struct rbuf;
+
 void init_json(void);
+void json_put_string(struct rbuf *, const char *);
 SCM json_decode(SCM);
 SCM json_encode(SCM);
+SCM json_decode_buffer(const char *, size_t, char *, size_t);
@@ -21,6 +21,8 @@
 #include <time.h>
 #include <stdarg.h>
 
+#include "trace.h"
+
 static FILE *logfile;
 static char *logpath = NULL;
 static SCM lmutex;
@@ -29,12 +31,15 @@ void log_msg(const char *format, ...) {
 	va_list args;
 	time_t now;
 	struct tm *lt;
+	const char *trace;
+	trace = trace_id();
 	scm_lock_mutex(lmutex);
 	now = time(NULL);
 	lt = localtime(&now);
 	fprintf(logfile, "%d-%02d-%02d %02d:%02d:%02d ",
 		lt->tm_year + 1900, lt->tm_mon + 1, lt->tm_mday,
 		lt->tm_hour, lt->tm_min, lt->tm_sec);
+	if (trace != NULL) fprintf(logfile, "[%s] ", trace);
 	va_start(args, format);
 	vfprintf(logfile, format, args);
 	va_end(args);
@@ -24,6 +24,7 @@
 #include <sys/time.h>
 #include <sys/mman.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -38,6 +39,8 @@
 #include <readline/readline.h>
 #include <readline/history.h>
 #include <poll.h>
+#include <sys/uio.h>
+#include <curl/curl.h>
 
 #include "postgres.h"
 #include "gtime.h"
@@ -48,15 +51,39 @@
 #include "http.h"
 #include "smtp.h"
 #include "butter.h"
-
-#define makesym(s) (scm_from_locale_symbol(s))
+#include "reply.h"
+#include "flight.h"
+#include "compress.h"
+#include "constant.h"
+#include "gusher.h"
+#include "native.h"
+#include "park.h"
+#include "deferred.h"
+#include "par.h"
+#include "ratelimit.h"
+#include "bulkhead.h"
+#include "watchdog.h"
+#include "bytes.h"
+#include "arena.h"
+#include "aot.h"
+#include "stats.h"
+#include "heap.h"
+#include "metrics.h"
+#include "trace.h"
+#include "usage.h"
+#include "profile.h"
+#include "capture.h"
+
+#define makesym(s) (bytes_to_sym(s))
 #define DEFAULT_PORT 8080
 #define BOOT_FILE "boot.scm"
 #define COOKIE_KEY "GUSHERID"
 #define DEFAULT_MAX_THREADS 32
+#define DEFAULT_MAX_PARKED 256
 #define POLL_TIMEOUT 2000
 #define POLICE_INTVL 6
 #define POST_MEM_MAX 1000000
+#define JSON_BODY_MAX 4000000
 #define DEFAULT_GUSHER_ROOT "/var/lib/gusher"
 #define GETLINE_OK 1
 #define GETLINE_PEER_CLOSED 2
@@ -64,10 +91,21 @@
 #define GETLINE_TOO_LONG 4
 #define GETLINE_DRAINED 5
 #define MAX_POLL_ITEMS 256
+#define DEFAULT_COALESCE_WAITERS 64
+#define DEFAULT_COALESCE_TIMEOUT 5.0
+#define COMPRESS_SHARED 2
 
 struct handler_entry {
 	char *path;
 	SCM handler;
+	int coalesce;
+	double coalesce_timeout;
+	SCM coalesce_vary; // request headers that join the flight key
+	int etag;
+	int compress; // 0, 1, or COMPRESS_SHARED: cache compressed replies
+	BULKHEAD *bulkhead;
+	double timeout;
+	ROUTE_STATS *stats;
 	struct handler_entry *link;
 	};
 
@@ -76,6 +114,11 @@ typedef struct rframe {
 	char ipaddr[32];
 	int rport;
 	int count;
+	int vetted; // rate limit already checked on accept
+	CONSTANT *constant; // reply the I/O thread left unfinished
+	int head_only;
+	size_t sent;
+	unsigned long queued;
 	struct rframe *next;
 	} RFRAME;
 
@@ -97,13 +140,29 @@ static SCM ctype_sym;
 static SCM clength_sym;
 static SCM post_sym;
 static SCM qstring_sym;
+static SCM get_sym;
+static SCM url_sym;
+static SCM url_path_sym;
+static SCM path_info_sym;
+static SCM cookie_sym;
+static SCM remote_host_sym;
+static SCM remote_port_sym;
+static SCM inm_sym;
+static SCM ims_sym;
+static SCM accept_enc_sym;
+static SCM request_id_sym;
+static SCM traceparent_sym;
 SCM session_sym;
 static SCM radix10;
 static int nthreads = 0;
 static int busy_threads = 0;
+static long queue_depth = 0;
 static int threading;
+static int aot = 1;
 static int tcount = 0;
 static int max_threads = DEFAULT_MAX_THREADS;
+static int max_parked = DEFAULT_MAX_PARKED;
+static int json_body_max = JSON_BODY_MAX;
 static int http_port = DEFAULT_PORT;
 static RFRAME *req_pool = NULL;
 static RFRAME *req_queue = NULL;
@@ -117,18 +176,94 @@ static int sorter(const void *a, const void *b) {
 	return (strlen((*e2)->path) - strlen((*e1)->path));
 	}
 
-static SCM set_handler(SCM path, SCM lambda) {
+static void dispatch(int, SCM, void *, SCM, unsigned long);
+static void load_file(const char *);
+
+static void route_options(struct handler_entry *entry, SCM opts) {
+	int max_active, max_queue, pool;
+	SCM opt, vary;
+	vary = SCM_EOL;
+	max_active = pool = 0;
+	max_queue = -1;
+	entry->coalesce = 0;
+	entry->coalesce_timeout = DEFAULT_COALESCE_TIMEOUT;
+	if (entry->coalesce_vary != SCM_EOL)
+		scm_gc_unprotect_object(entry->coalesce_vary);
+	entry->coalesce_vary = SCM_EOL;
+	entry->etag = 0;
+	entry->compress = 1;
+	entry->timeout = 0;
+	if ((opts == SCM_UNDEFINED) || !scm_is_pair(opts)) {
+		entry->bulkhead = NULL;
+		return;
+		}
+	opt = scm_assq_ref(opts, makesym("coalesce"));
+	if (scm_is_integer(opt)) entry->coalesce = scm_to_int(opt);
+	else if (scm_is_true(opt)) entry->coalesce = DEFAULT_COALESCE_WAITERS;
+	opt = scm_assq_ref(opts, makesym("coalesce-timeout"));
+	if (scm_is_real(opt)) entry->coalesce_timeout = scm_to_double(opt);
+	opt = scm_assq_ref(opts, makesym("coalesce-vary"));
+	for (; scm_is_pair(opt); opt = SCM_CDR(opt)) {
+		vary = SCM_CAR(opt);
+		if (scm_is_string(vary))
+			vary = scm_string_to_symbol(scm_string_downcase(vary));
+		if (scm_is_symbol(vary))
+			entry->coalesce_vary = scm_cons(vary, entry->coalesce_vary);
+		}
+	if (entry->coalesce_vary != SCM_EOL)
+		scm_gc_protect_object(entry->coalesce_vary);
+	entry->etag = scm_is_true(scm_assq_ref(opts, makesym("etag")));
+	if (scm_assq(makesym("compress"), opts) != SCM_BOOL_F) {
+		opt = scm_assq_ref(opts, makesym("compress"));
+		if (opt == makesym("shared")) entry->compress = COMPRESS_SHARED;
+		else entry->compress = scm_is_true(opt);
+		}
+	opt = scm_assq_ref(opts, makesym("timeout"));
+	if (scm_is_real(opt)) entry->timeout = scm_to_double(opt);
+	opt = scm_assq_ref(opts, makesym("max-concurrent"));
+	if (scm_is_integer(opt)) max_active = scm_to_int(opt);
+	opt = scm_assq_ref(opts, makesym("max-queue"));
+	if (scm_is_integer(opt)) max_queue = scm_to_int(opt);
+	opt = scm_assq_ref(opts, makesym("pool"));
+	if (scm_is_integer(opt)) pool = scm_to_int(opt);
+	if ((max_active > 0) || (pool > 0))
+		entry->bulkhead = bulkhead_get(entry->bulkhead, entry->path,
+				(max_active > 0 ? max_active : pool), max_queue,
+				pool, dispatch);
+	else entry->bulkhead = NULL;
+	scm_remember_upto_here_2(opts, opt);
+	scm_remember_upto_here_1(vary);
+	return;
+	}
+
+static SCM set_handler(SCM path, SCM lambda, SCM opts) {
 	struct handler_entry *entry, *pt;
 	struct handler_entry **list;
+	char *spath;
 	int count, i;
 	if (scm_handlers != SCM_EOL) scm_gc_unprotect_object(scm_handlers);
 	scm_handlers = scm_acons(path, lambda, scm_handlers);
 	scm_gc_protect_object(scm_handlers);
+	spath = scm_to_bytes_dup(path);
+	for (pt = handlers; pt != NULL; pt = pt->link) {
+		if (strcmp(pt->path, spath) == 0) break;
+		}
+	if (pt != NULL) { // re-register: replace in place
+		free(spath);
+		log_msg("reset responder for %s\n", pt->path);
+		pt->handler = lambda;
+		route_options(pt, opts);
+		return SCM_UNSPECIFIED;
+		}
 	entry = (struct handler_entry *)malloc(
 				sizeof(struct handler_entry));
-	entry->path = scm_to_locale_string(path);
+	entry->path = spath;
 	log_msg("set responder for %s\n", entry->path);
 	entry->handler = lambda;
+	entry->bulkhead = NULL;
+	entry->coalesce_vary = SCM_EOL;
+	entry->stats = stats_route(spath);
+	route_options(entry, opts);
 	entry->link = handlers;
 	handlers = entry;
 	count = 0;
@@ -218,27 +353,38 @@ static SCM default_not_found(SCM request) {
 	return resp;
 	}
 
-static SCM find_handler(SCM request) {
-	char *spath;
+static struct handler_entry *find_handler(SCM request, SCM *path_info) {
+	char buf[SCRATCH_SIZE], *spath;
 	int n;
-	SCM path, pair;
+	SCM path;
 	struct handler_entry *pt;
-	path = scm_assq_ref(request, makesym("url-path"));
-	if (path == SCM_BOOL_F) return SCM_BOOL_F;
-	spath = scm_to_locale_string(path);
+	path = scm_assq_ref(request, url_path_sym);
+	if (path == SCM_BOOL_F) return NULL;
+	spath = scm_to_scratch(path, buf, sizeof(buf));
 	scm_remember_upto_here_1(path);
-	pair = SCM_EOL;
 	for (pt = handlers; pt != NULL; pt = pt->link) {
 		n = strlen(pt->path);
 		if (strncmp(pt->path, spath, n) == 0) {
-			pair = scm_cons(pt->handler, scm_from_locale_string(&spath[n]));
-			free(spath);
-			return pair;
+			if (path_info != NULL)
+				*path_info = bytes_to_scm(&spath[n]);
+			return pt;
 			}
 		}
-	free(spath);
-	scm_remember_upto_here_2(pair, request);
-	return SCM_BOOL_F;
+	scm_remember_upto_here_1(request);
+	return NULL;
+	}
+
+/*
+** Length of the longest Scheme route prefix of path, -1 if none.
+*/
+static int route_prefix(const char *path) {
+	struct handler_entry *pt;
+	size_t n;
+	for (pt = handlers; pt != NULL; pt = pt->link) { // longest first
+		n = strlen(pt->path);
+		if (strncmp(pt->path, path, n) == 0) return (int)n;
+		}
+	return -1;
 	}
 
 static void send_all(int sock, const char *msg) {
@@ -255,6 +401,28 @@ static void send_all(int sock, const char *msg) {
 		}
 	}
 
+static void send_iov(int sock, struct iovec *iov, int count) {
+	ssize_t n;
+	while (count > 0) {
+		n = writev(sock, iov, count);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			perror("writev!");
+			break;
+			}
+		while ((count > 0) && (n >= iov->iov_len)) {
+			n -= iov->iov_len;
+			iov++;
+			count--;
+			}
+		if (count > 0) {
+			iov->iov_base = (char *)iov->iov_base + n;
+			iov->iov_len -= n;
+			}
+		}
+	return;
+	}
+
 static SCM simple_http_response(SCM mime_type, SCM content) {
 	SCM headers, resp;
 	headers = SCM_EOL;
@@ -289,21 +457,18 @@ static SCM json_http_response(SCM enc_content) {
 
 static char *session_cookie(SCM request) {
 	SCM dough;
-	char *buf, *key;
+	char scratch[SCRATCH_SIZE], *buf, *key;
 	size_t len;
 	regmatch_t match[3];
-	dough = scm_assq_ref(request, makesym("cookie"));
+	dough = scm_assq_ref(request, cookie_sym);
 	if (dough == SCM_BOOL_F) return NULL;
 	key = NULL;
-	buf = scm_to_locale_string(dough);
+	buf = scm_to_scratch(dough, scratch, sizeof(scratch));
 	scm_remember_upto_here_1(dough);
 	if (regexec(&cookie_pat, buf, 2, match, 0) == 0) {
 		len = match[1].rm_eo - match[1].rm_so;
-		key = (char *)malloc(len + 1);
-		strncpy(key, &buf[match[1].rm_so], len);
-		key[len] = '\0';
+		key = arena_strndup(&buf[match[1].rm_so], len);
 		}
-	free(buf);
 	scm_remember_upto_here_1(request);
 	return key;
 	}
@@ -349,6 +514,22 @@ static void release_frame(RFRAME *frame) {
 	return;
 	}
 
+/*
+** Head bytes already taken off the socket (see read_head), served to
+** mygetline ahead of the socket itself.
+*/
+static __thread const char *unread = NULL;
+static __thread size_t unread_len = 0;
+
+static ssize_t read_byte(int fd, char *c) {
+	if (unread_len > 0) {
+		*c = *unread++;
+		unread_len--;
+		return 1;
+		}
+	return read(fd, c, 1);
+	}
+
 static int mygetline(int fd, char *buf, size_t len) {
 	int n;
 	int i;
@@ -359,7 +540,7 @@ static int mygetline(int fd, char *buf, size_t len) {
 			log_msg("incoming line too long: '%s'\n", buf);
 			return GETLINE_TOO_LONG;
 			}
-		n = read(fd, &buf[i], 1);
+		n = read_byte(fd, &buf[i]);
 		if (n == 0) {
 			log_msg("peer closed connection\n");
 			return GETLINE_PEER_CLOSED;
@@ -377,6 +558,27 @@ static int mygetline(int fd, char *buf, size_t len) {
 		}
 	}
 
+/*
+** Read the request head, up to the blank line or
+** RATELIMIT_HEAD_MAX bytes, into the arena; the caller hands it back
+** to mygetline through unread.
+*/
+static char *read_head(int sock, size_t *len) {
+	char *head;
+	size_t n;
+	head = (char *)arena_alloc(RATELIMIT_HEAD_MAX + 1);
+	for (n = 0; n < RATELIMIT_HEAD_MAX; n++) {
+		if (read(sock, &head[n], 1) != 1) break;
+		if ((n >= 3) && (memcmp(&head[n - 3], "\r\n\r\n", 4) == 0)) {
+			n++;
+			break;
+			}
+		}
+	head[n] = '\0';
+	*len = n;
+	return head;
+	}
+
 static SCM start_request(char *line) {
 	SCM request;
 	SCM qstring;
@@ -384,20 +586,20 @@ static SCM start_request(char *line) {
 	char *mark, *pt;
 	request = SCM_EOL;
 	if (line[0] == 'P') method = post_sym;
-	else method = makesym("get");
-	request = scm_acons(makesym("method"), method, request);
+	else method = get_sym;
+	request = scm_acons(method_sym, method, request);
 	mark = index(line, ' ') + 1;
 	*(index(mark, ' ')) = '\0';
-	request = scm_acons(makesym("url"), scm_from_locale_string(mark),
+	request = scm_acons(url_sym, bytes_to_scm(mark),
 							request);
 	if ((pt = index(mark, '?')) != NULL) {
 		*pt++ = '\0';
-		qstring = scm_from_locale_string(pt);
+		qstring = bytes_to_scm(pt);
 		}
 	else {
-		qstring = scm_from_locale_string("");
+		qstring = bytes_to_scm("");
 		}
-	request = scm_acons(makesym("url-path"), scm_from_locale_string(mark),
+	request = scm_acons(url_path_sym, bytes_to_scm(mark),
 							request);
 	request = scm_acons(qstring_sym, qstring, request);
 	scm_remember_upto_here_2(request, qstring);
@@ -443,86 +645,397 @@ static SCM dump_request(SCM request) {
 	return reply;
 	}
 
-static void send_headers(int sock, SCM headers) {
-	SCM node, pair, val;
+static void put_header(RBUF *buf, SCM pair, REPLY *reply) {
+	SCM val;
+	char nbuf[64], vbuf[SCRATCH_SIZE];
 	char *hname, *hvalue;
-	node = headers;
-	pair = val = SCM_EOL;
-	while (node != SCM_EOL) {
-		pair = SCM_CAR(node);
-		hname = scm_to_latin1_string(SCM_CAR(pair));
-		send_all(sock, hname);
-		free(hname);
-		send_all(sock, ": ");
-		val = SCM_CDR(pair);
-		if (scm_is_string(val))
-			hvalue = scm_to_latin1_string(val);
-		else if (scm_is_number(val))
-			hvalue = scm_to_latin1_string(
-						scm_number_to_string(val, radix10));
-		else if (scm_is_symbol(val))
-			hvalue = scm_to_latin1_string(scm_symbol_to_string(val));
-		else hvalue = NULL;
-		if (hvalue != NULL) {
-			send_all(sock, hvalue);
-			free(hvalue);
+	hname = scm_to_scratch(SCM_CAR(pair), nbuf, sizeof(nbuf));
+	rbuf_puts(buf, hname);
+	rbuf_put(buf, ": ", 2);
+	val = SCM_CDR(pair);
+	if (scm_is_string(val))
+		hvalue = scm_to_scratch(val, vbuf, sizeof(vbuf));
+	else if (scm_is_number(val))
+		hvalue = scm_to_scratch(scm_number_to_string(val, radix10),
+					vbuf, sizeof(vbuf));
+	else if (scm_is_symbol(val))
+		hvalue = scm_to_scratch(scm_symbol_to_string(val),
+					vbuf, sizeof(vbuf));
+	else hvalue = NULL;
+	if (hvalue != NULL) {
+		rbuf_puts(buf, hvalue);
+		if (reply == NULL);
+		else if (strcasecmp(hname, "etag") == 0) {
+			free(reply->etag);
+			reply->etag = strdup(hvalue);
 			}
-		send_all(sock, "\r\n");
-		node = SCM_CDR(node);
+		else if (strcasecmp(hname, "last-modified") == 0)
+			reply->modified = curl_getdate(hvalue, NULL);
+		else if (strcasecmp(hname, "content-type") == 0) {
+			strncpy(reply->ctype, hvalue, sizeof(reply->ctype) - 1);
+			reply->ctype[sizeof(reply->ctype) - 1] = '\0';
+			}
+		else if (strcasecmp(hname, "content-encoding") == 0)
+			reply->encoded = 1;
 		}
-	send_all(sock, "\r\n");
-	scm_remember_upto_here_2(node, pair);
-	scm_remember_upto_here_1(headers);
+	rbuf_put(buf, "\r\n", 2);
+	scm_remember_upto_here_2(pair, val);
 	return;
 	}
 
-static SCM run_responder(SCM request) {
-	SCM cookie_header = SCM_BOOL_F;
-	SCM handler;
-	char *cookie;
-	if ((handler = find_handler(request)) != SCM_BOOL_F) {
-		if ((cookie = session_cookie(request)) == NULL) {
-			char buf[128];
-			cookie = (char *)malloc(33);
-			put_uuid(cookie);
-			snprintf(buf, sizeof(buf) - 1, "%s=%s; Path=/",
-							COOKIE_KEY, cookie);
-			buf[sizeof(buf) - 1] = '\0';
-			cookie_header = scm_cons(scm_from_latin1_string("set-cookie"),
-				scm_from_latin1_string(buf));
+/*
+** Serialize (status headers body) for the wire. With make_etag set,
+** a 200 reply that carries no validator of its own gets a strong
+** ETag from a hash of the body.
+*/
+static void serialize_reply(SCM reply, REPLY *out, int make_etag,
+			int may_compress) {
+	SCM node;
+	char status[64], *body;
+	size_t blen;
+	RBUF *buf;
+	buf = &out->wire;
+	rbuf_init(buf, 4096);
+	rbuf_puts(buf, "HTTP/1.1 ");
+	scm_to_bytes(SCM_CAR(reply), status, sizeof(status));
+	out->status = atoi(status);
+	rbuf_puts(buf, status);
+	rbuf_put(buf, "\r\n", 2);
+	out->split = buf->len;
+	reply = SCM_CDR(reply);
+	for (node = SCM_CAR(reply); node != SCM_EOL; node = SCM_CDR(node))
+		put_header(buf, SCM_CAR(node), out);
+	out->head = buf->len;
+	if ((out->status == 304) || (out->status == 204)) return;
+	reply = SCM_CDR(reply);
+	body = scm_to_utf8_stringn(SCM_CAR(reply), &blen);
+	rbuf_put(buf, body, blen);
+	free(body);
+	body = buf->data + out->head;
+	if (out->status == 200) {
+		out->compress = (may_compress && !out->encoded &&
+					compress_wanted(blen, out->ctype));
+		if ((make_etag && (out->etag == NULL)) || out->compress)
+			out->hash = hash64(body, blen);
+		if (make_etag && (out->etag == NULL)) {
+			out->etag = (char *)malloc(24);
+			snprintf(out->etag, 24, "\"%016llx\"",
+					(unsigned long long)out->hash);
+			out->etag_made = 1;
 			}
-		request = scm_acons(session_sym,
-						scm_take_locale_string(cookie), request);
-		request = scm_acons(makesym("path-info"),
-						SCM_CDR(handler), request);
+		}
+	scm_remember_upto_here_2(reply, node);
+	return;
+	}
+
+/*
+** Compare the reply's entity-tag with each whole tag in an
+** If-None-Match list. The comparison is weak, so W/ is ignored on
+** both sides, and ours may carry an encoding suffix: "hash-gzip".
+*/
+static int etag_match(const char *cond, const REPLY *reply) {
+	const char *own, *tag, *pt;
+	size_t olen, len;
+	own = reply->etag;
+	if (strncmp(own, "W/", 2) == 0) own += 2;
+	olen = strlen(own);
+	pt = cond;
+	while (1) {
+		pt += strspn(pt, " \t,");
+		if (*pt == '\0') break;
+		if (*pt == '*') return 1;
+		if (strncmp(pt, "W/", 2) == 0) pt += 2;
+		tag = pt;
+		if ((*pt == '"') && ((pt = strchr(pt + 1, '"')) != NULL)) pt++;
+		else pt = tag + strcspn(tag, " \t,");
+		len = pt - tag;
+		if ((len == olen) && (strncmp(tag, own, len) == 0)) return 1;
+		if (reply->etag_made && (len > olen) &&
+				(strncmp(tag, own, olen - 1) == 0) &&
+				(tag[olen - 1] == '-') && (tag[len - 1] == '"'))
+			return 1;
+		}
+	return 0;
+	}
+
+/*
+** Does the request's If-None-Match or If-Modified-Since let us
+** answer this reply with a bodiless 304?
+*/
+static int not_modified(SCM request, const REPLY *reply) {
+	SCM cond;
+	char scratch[SCRATCH_SIZE], *buf;
+	int match;
+	time_t since;
+	if (reply->status != 200) return 0;
+	if (scm_assq_ref(request, method_sym) == post_sym) return 0;
+	cond = scm_assq_ref(request, inm_sym);
+	if (scm_is_string(cond)) {
+		if (reply->etag == NULL) return 0;
+		buf = scm_to_scratch(cond, scratch, sizeof(scratch));
+		match = etag_match(buf, reply);
+		scm_remember_upto_here_1(cond);
+		return match;
+		}
+	if (reply->modified <= 0) return 0;
+	cond = scm_assq_ref(request, ims_sym);
+	if (!scm_is_string(cond)) return 0;
+	scm_to_bytes(cond, scratch, sizeof(scratch));
+	since = curl_getdate(scratch, NULL);
+	scm_remember_upto_here_2(cond, request);
+	return ((since > 0) && (reply->modified <= since));
+	}
+
+static int accepted_encoding(SCM request) {
+	SCM accept;
+	char scratch[SCRATCH_SIZE], *buf;
+	int encoding;
+	accept = scm_assq_ref(request, accept_enc_sym);
+	if (!scm_is_string(accept)) return ENC_IDENTITY;
+	buf = scm_to_scratch(accept, scratch, sizeof(scratch));
+	encoding = compress_negotiate(buf);
+	scm_remember_upto_here_2(accept, request);
+	return encoding;
+	}
+
+/*
+** Send a serialized reply to one client, adding that client's
+** headers: its set-cookie, the encoding it negotiated, and a 304
+** cut from the reply if its validators still match.
+*/
+static void send_reply(int sock, const REPLY *reply, SCM cookie_header,
+			SCM request) {
+	static const char *unmodified = "HTTP/1.1 304 Not Modified\r\n";
+	struct iovec iov[5];
+	RBUF cookie;
+	VARIANT *var;
+	char tail[256];
+	const char *body;
+	size_t blen, n;
+	int unmod, encoding;
+	metrics_sending();
+	trace_handler_end();
+	if (!watch_sending()) return; // the watchdog already answered
+	cookie.data = NULL;
+	cookie.len = 0;
+	if (cookie_header != SCM_BOOL_F) {
+		rbuf_init(&cookie, 128);
+		put_header(&cookie, cookie_header, NULL);
+		}
+	unmod = not_modified(request, reply);
+	var = NULL;
+	body = reply->wire.data + reply->head;
+	blen = reply->wire.len - reply->head;
+	encoding = (reply->compress ? accepted_encoding(request) : ENC_IDENTITY);
+	if ((encoding != ENC_IDENTITY) && !unmod) {
+		var = compress_variant(encoding, body, blen, reply->hash,
+					reply->shared);
+		if (var != NULL) {
+			body = var->data;
+			blen = var->len;
+			}
+		else encoding = ENC_IDENTITY;
+		}
+	n = 0;
+	if (reply->etag_made) {
+		if (encoding == ENC_IDENTITY)
+			n += snprintf(tail + n, sizeof(tail) - n,
+				"etag: %s\r\n", reply->etag);
+		else
+			n += snprintf(tail + n, sizeof(tail) - n,
+				"etag: %.*s-%s\"\r\n", (int)strlen(reply->etag) - 1,
+				reply->etag, compress_name(encoding));
+		}
+	if (reply->compress)
+		n += snprintf(tail + n, sizeof(tail) - n,
+				"vary: accept-encoding\r\n");
+	if (trace_id() != NULL)
+		n += snprintf(tail + n, sizeof(tail) - n,
+				"x-request-id: %s\r\n", trace_id());
+	if (var != NULL)
+		n += snprintf(tail + n, sizeof(tail) - n,
+				"content-encoding: %s\r\n", compress_name(encoding));
+	if (!unmod && (reply->status != 304) && (reply->status != 204))
+		n += snprintf(tail + n, sizeof(tail) - n,
+				"content-length: %lu\r\n", (unsigned long)blen);
+	n += snprintf(tail + n, sizeof(tail) - n, "\r\n");
+	if (unmod) {
+		iov[0].iov_base = (void *)unmodified;
+		iov[0].iov_len = strlen(unmodified);
+		blen = 0;
+		}
+	else {
+		iov[0].iov_base = reply->wire.data;
+		iov[0].iov_len = reply->split;
+		}
+	iov[1].iov_base = cookie.data;
+	iov[1].iov_len = cookie.len;
+	iov[2].iov_base = reply->wire.data + reply->split;
+	iov[2].iov_len = reply->head - reply->split;
+	iov[3].iov_base = tail;
+	iov[3].iov_len = n;
+	iov[4].iov_base = (void *)body;
+	iov[4].iov_len = blen;
+	send_iov(sock, iov, 5);
+	metrics_sent(unmod ? 304 : reply->status, iov[0].iov_len +
+		cookie.len + iov[2].iov_len + n + blen);
+	trace_sent(unmod ? 304 : reply->status);
+	if (var != NULL) variant_release(var);
+	if (cookie.data != NULL) rbuf_free(&cookie);
+	scm_remember_upto_here_2(cookie_header, request);
+	return;
+	}
+
+static SCM bind_session(SCM request, SCM *cookie_header) {
+	char *cookie, uuid[33];
+	*cookie_header = SCM_BOOL_F;
+	if ((cookie = session_cookie(request)) == NULL) {
+		char buf[128];
+		cookie = uuid;
+		put_uuid(cookie);
+		snprintf(buf, sizeof(buf) - 1, "%s=%s; Path=/",
+						COOKIE_KEY, cookie);
+		buf[sizeof(buf) - 1] = '\0';
+		*cookie_header = scm_cons(scm_from_latin1_string("set-cookie"),
+			scm_from_latin1_string(buf));
+		}
+	request = scm_acons(session_sym,
+					bytes_to_scm(cookie), request);
+	scm_remember_upto_here_1(request);
+	return request;
+	}
+
+static SCM run_responder(SCM request, struct handler_entry *entry,
+				SCM path_info) {
+	SCM cookie_header = SCM_BOOL_F;
+	if (entry != NULL) {
+		request = bind_session(request, &cookie_header);
+		request = scm_acons(path_info_sym, path_info, request);
 		}
 	SCM reply;
-	//if (handler == SCM_BOOL_F) reply = dump_request(request);
-	if (handler == SCM_BOOL_F) reply = default_not_found(request);
-	else reply = scm_call_1(SCM_CAR(handler), request);
+	//if (entry == NULL) reply = dump_request(request);
+	if (entry == NULL) reply = default_not_found(request);
+	else reply = scm_call_1(entry->handler, request);
 	reply = scm_cons(cookie_header, reply);
 	scm_remember_upto_here_1(cookie_header);
-	scm_remember_upto_here_2(reply, handler);
+	scm_remember_upto_here_2(reply, path_info);
 	scm_remember_upto_here_1(request);
 	return reply;
 	}
 
+static void respond(int sock, SCM request, struct handler_entry *entry,
+			SCM path_info) {
+	REPLY out;
+	SCM reply = run_responder(request, entry, path_info);
+	reply_init(&out);
+	out.shared = ((entry != NULL) && (entry->compress == COMPRESS_SHARED));
+	serialize_reply(SCM_CDR(reply), &out,
+		(entry != NULL) && entry->etag,
+		(entry == NULL) || entry->compress);
+	send_reply(sock, &out, SCM_CAR(reply), request);
+	reply_free(&out);
+	scm_remember_upto_here_2(request, reply);
+	return;
+	}
+
+struct flight_crew {
+	FLIGHT *flight;
+	REPLY out;
+	};
+
+static void abort_flight(void *data) {
+	struct flight_crew *crew = (struct flight_crew *)data;
+	flight_crash(crew->flight);
+	reply_free(&crew->out);
+	return;
+	}
+
+/*
+** The flight key: the URL, then the value of each request header
+** named in the route's coalesce-vary option.
+*/
+static void flight_key(RBUF *key, SCM request, struct handler_entry *entry) {
+	char scratch[SCRATCH_SIZE];
+	SCM node, value;
+	value = scm_assq_ref(request, url_sym);
+	rbuf_puts(key, scm_to_scratch(value, scratch, sizeof(scratch)));
+	for (node = entry->coalesce_vary; node != SCM_EOL;
+			node = SCM_CDR(node)) {
+		rbuf_put(key, "\n", 1);
+		value = scm_assq_ref(request, SCM_CAR(node));
+		if (scm_is_string(value))
+			rbuf_puts(key, scm_to_scratch(value, scratch,
+					sizeof(scratch)));
+		}
+	rbuf_put(key, "", 1);
+	scm_remember_upto_here_2(node, value);
+	}
+
+/*
+** Single-flight GET: the first request for a key runs the responder,
+** concurrent ones for the same key wait for its serialized reply.
+** Waiters past the route's cap, or that time out, run their own.
+** Every waiter gets the leader's body, with only its own set-cookie,
+** so the route's output may vary by client only in the headers
+** listed in coalesce-vary (cookie, say, for per-session pages).
+*/
+static void respond_coalesced(int sock, SCM request,
+			struct handler_entry *entry, SCM path_info) {
+	struct flight_crew crew;
+	RBUF key;
+	int leader;
+	SCM reply, cookie_header;
+	rbuf_init(&key, 256);
+	flight_key(&key, request, entry);
+	crew.flight = flight_board(key.data, entry->coalesce, &leader);
+	rbuf_free(&key);
+	if (crew.flight == NULL) {
+		respond(sock, request, entry, path_info);
+		return;
+		}
+	if (!leader) {
+		if (flight_wait(crew.flight, entry->coalesce_timeout)) {
+			bind_session(request, &cookie_header);
+			send_reply(sock, flight_payload(crew.flight),
+						cookie_header, request);
+			flight_release(crew.flight);
+			scm_remember_upto_here_1(cookie_header);
+			return;
+			}
+		flight_release(crew.flight);
+		respond(sock, request, entry, path_info);
+		return;
+		}
+	reply_init(&crew.out);
+	crew.out.shared = 1;
+	scm_dynwind_begin(0);
+	scm_dynwind_unwind_handler(abort_flight, &crew, 0);
+	reply = run_responder(request, entry, path_info);
+	serialize_reply(SCM_CDR(reply), &crew.out, entry->etag,
+				entry->compress);
+	scm_dynwind_end();
+	flight_land(crew.flight, &crew.out);
+	send_reply(sock, &crew.out, SCM_CAR(reply), request);
+	reply_free(&crew.out);
+	scm_remember_upto_here_2(request, reply);
+	return;
+	}
+
 static SCM get_in(SCM request) {
 	SCM qstring = scm_assq_ref(request, qstring_sym);
 	if (qstring == SCM_BOOL_F) return SCM_BOOL_F;
-	char *string = scm_to_locale_string(qstring);
+	char scratch[SCRATCH_SIZE];
+	char *string = scm_to_scratch(qstring, scratch, sizeof(scratch));
 	SCM query = parse_query(string);
-	free(string);
 	return query;
 	}
 
 static int request_length(SCM request) {
 	SCM clength = scm_assq_ref(request, clength_sym);
 	if (clength == SCM_BOOL_F) return 0;
-	char *len = scm_to_locale_string(clength);
-	int length = atoi(len);
-	free(len);
-	return length;
+	char len[32];
+	scm_to_bytes(clength, len, sizeof(len));
+	return atoi(len);
 	}
 
 static SCM form_urlencoded(SCM request, int sock) {
@@ -534,11 +1047,7 @@ static SCM form_urlencoded(SCM request, int sock) {
 		log_msg("truncated POST malloc: %d -> %d\n", length, POST_MEM_MAX);
 		length = POST_MEM_MAX;
 		}
-	char *buf = (char *)malloc(length + 1);
-	if (buf == NULL) {
-		log_msg("failed POST malloc\n");
-		return SCM_EOL;
-		}
+	char *buf = (char *)arena_alloc(length + 1);
 	char *pt = buf;
 	int n;
 	while (length > 0) {
@@ -547,11 +1056,8 @@ static SCM form_urlencoded(SCM request, int sock) {
 		pt += n;
 		}
 	*pt = '\0';
-FILE *tmp = fopen("/tmp/urlencode", "w");
-fputs(buf, tmp);
-fclose(tmp);
+	capture_body(buf, pt - buf);
 	SCM query = parse_query(buf);
-	free(buf);
 	return query;
 	}
 
@@ -649,10 +1155,7 @@ static char *memscan(char *haystack, size_t field, const char *needle) {
 
 static SCM form_multipart(SCM request, int sock, char *ctype) {
 	char *boundary = strstr(ctype, "boundary=");
-	if (boundary == NULL) {
-		free(ctype);
-		return SCM_BOOL_F;
-		}
+	if (boundary == NULL) return SCM_BOOL_F;
 	char tmppath[64], rboundary[256];
 	char buf[4096], *cursor, *stop, *old_cursor;
 	int b_len, fd;
@@ -675,6 +1178,7 @@ static SCM form_multipart(SCM request, int sock, char *ctype) {
 			continue;
 			}
 		write(fcache, buf, n);
+		capture_body(buf, n);
 		maplen += n;
 		clength -= n;
 		if (clength <= 0) break;
@@ -689,7 +1193,6 @@ static SCM form_multipart(SCM request, int sock, char *ctype) {
 		unlink(tmppath);
 		log_msg("multipart: mmap failed, abort: [%d] %s\n",
 			errno, strerror(errno));
-		free(ctype);
 		return SCM_BOOL_F;
 		}
 	cursor = (char *)map;
@@ -705,7 +1208,6 @@ static SCM form_multipart(SCM request, int sock, char *ctype) {
 	munmap(map, maplen);
 	close(fd);
 	unlink(tmppath);
-	free(ctype);
 	return query;
 	}
 
@@ -720,90 +1222,351 @@ static void show_content_type(SCM request) {
 	return;
 	}
 */
-static SCM post_in(SCM request, int sock) {
-	SCM method = scm_assq_ref(request, method_sym);
+/*
+** application/json: read exactly content-length bytes into one
+** buffer and decode from it in place. The result goes on the request
+** as json; an object also stands in for the query. Problems are
+** reported as json-error rather than thrown, so the responder can
+** choose its own 400 or 413. An empty body adds neither.
+*/
+static SCM form_json(SCM *request, int sock) {
+	char errmsg[200];
+	char *buf;
+	int declared;
+	size_t length, got;
+	ssize_t n;
+	SCM json, query;
+	declared = request_length(*request);
+	if ((scm_assq_ref(*request, clength_sym) == SCM_BOOL_F) ||
+			(declared < 0) || (declared > json_body_max)) {
+		log_msg("JSON body length %d refused\n", declared);
+		*request = scm_acons(makesym("json-error"),
+			scm_from_latin1_string(declared > json_body_max ?
+				"body too large" : "length required"), *request);
+		return SCM_EOL;
+		}
+	if (declared == 0) return SCM_EOL; // empty body, nothing to decode
+	length = (size_t)declared;
+	buf = (char *)arena_alloc(length);
+	for (got = 0; got < length; ) {
+		n = read(sock, buf + got, length - got);
+		if (n > 0) got += n;
+		else if ((n < 0) && (errno == EINTR)) continue;
+		else break;
+		}
+	capture_body(buf, got);
+	if (got < length) {
+		*request = scm_acons(makesym("json-error"),
+			scm_from_latin1_string("short body"), *request);
+		return SCM_EOL;
+		}
+	json = json_decode_buffer(buf, length, errmsg, sizeof(errmsg));
+	if (json == SCM_BOOL_F) {
+		*request = scm_acons(makesym("json-error"),
+			scm_from_utf8_string(errmsg), *request);
+		return SCM_EOL;
+		}
+	*request = scm_acons(makesym("json"), json, *request);
+	query = ((scm_is_pair(json) && scm_is_pair(SCM_CAR(json)) &&
+			scm_is_symbol(SCM_CAR(SCM_CAR(json)))) ? json : SCM_EOL);
+	scm_remember_upto_here_2(json, query);
+	return query;
+	}
+
+static SCM json_body_limit(SCM bytes) {
+	json_body_max = scm_to_int(bytes);
+	scm_remember_upto_here_1(bytes);
+	return SCM_UNSPECIFIED;
+	}
+
+static SCM post_in(SCM *request, int sock) {
+	SCM method = scm_assq_ref(*request, method_sym);
 	if (method != post_sym) return SCM_BOOL_F;
-	SCM ctype = scm_assq_ref(request, ctype_sym);
+	SCM ctype = scm_assq_ref(*request, ctype_sym);
 	if (ctype == SCM_BOOL_F) return SCM_BOOL_F;
-	char *type = scm_to_locale_string(ctype);
+	char scratch[SCRATCH_SIZE];
+	char *type = scm_to_scratch(ctype, scratch, sizeof(scratch));
 	//show_content_type(request);
-	if (strstr(type, "application/x-www-form-urlencoded") != NULL) {
-		free(type);
-		return form_urlencoded(request, sock);
+	if (strstr(type, "application/x-www-form-urlencoded") != NULL)
+		return form_urlencoded(*request, sock);
+	if (strstr(type, "application/json") != NULL)
+		return form_json(request, sock);
+	if (strstr(type, "multipart/form-data;") == type)
+		return form_multipart(*request, sock, type);
+	return SCM_BOOL_F;
+	}
+
+/*
+** Answer a parsed request and close the connection; called on the
+** dispatcher thread or, for bulkheaded routes, wherever the route's
+** work runs. The route's deadline counts from accepted, so a request
+** that outwaited it in a bulkhead queue gets its 504 without the
+** responder running.
+*/
+static void unwatch(void *data) {
+	watch_end();
+	}
+
+static void dispatch(int sock, SCM request, void *route, SCM path_info,
+		unsigned long accepted) {
+	struct handler_entry *entry = (struct handler_entry *)route;
+	HEAP_SAMPLE heap;
+	SCM url, rid, tp;
+	char surl[256], srid[TRACE_ID_MAX + 1], stp[64];
+	int late;
+	url = scm_assq_ref(request, url_sym);
+	if (scm_is_string(url)) scm_to_bytes(url, surl, sizeof(surl));
+	else strcpy(surl, "?");
+	rid = scm_assq_ref(request, request_id_sym);
+	if (scm_is_string(rid)) scm_to_bytes(rid, srid, sizeof(srid));
+	tp = scm_assq_ref(request, traceparent_sym);
+	if (scm_is_string(tp)) scm_to_bytes(tp, stp, sizeof(stp));
+	trace_adopt(scm_is_string(rid) ? srid : NULL,
+			scm_is_string(tp) ? stp : NULL);
+	heap_begin(&heap);
+	usage_begin();
+	metrics_dispatch();
+	scm_dynwind_begin(0);
+	late = !watch_begin(sock, (entry != NULL ? entry->path : "-"), surl,
+			(entry != NULL ? entry->timeout : 0), accepted);
+	scm_dynwind_unwind_handler(unwatch, NULL, SCM_F_WIND_EXPLICITLY);
+	deferred_begin();
+	if (!late) {
+		if ((entry != NULL) && (entry->coalesce > 0) &&
+				(scm_assq_ref(request, method_sym) != post_sym))
+			respond_coalesced(sock, request, entry, path_info);
+		else respond(sock, request, entry, path_info);
 		}
-	if (strstr(type, "multipart/form-data;") == type) {
-		return form_multipart(request, sock, type);
+	scm_dynwind_end();
+	close(sock);
+	usage_end(entry != NULL ? entry->stats : NULL);
+	heap_end((entry != NULL ? entry->stats : NULL), &heap);
+	metrics_end(entry != NULL ? entry->stats : NULL);
+	trace_end((entry != NULL ? entry->path : "-"), surl);
+	deferred_flush();
+	arena_reset();
+	scm_remember_upto_here_2(request, path_info);
+	scm_remember_upto_here_2(url, rid);
+	scm_remember_upto_here_1(tp);
+	}
+
+/*
+** Worker-side constant path: request line already read, so
+** drain the headers and answer before any Scheme object is made.
+*/
+static int send_constant(int sock, const char *line) {
+	CONSTANT *entry;
+	char hbuf[4096];
+	int res;
+	if ((entry = constant_match(line)) == NULL) return 0;
+	while ((res = mygetline(sock, hbuf, sizeof(hbuf))) == GETLINE_OK) {
+		if (hbuf[0] == '\0') break;
 		}
-	free(type);
-	return SCM_BOOL_F;
+	if ((res == GETLINE_OK) && watch_sending())
+		constant_send(sock, entry, line);
+	return 1;
+	}
+
+static const char *too_large_msg = "HTTP/1.1 413 Payload Too Large\r\n"
+	"content-type: text/plain\r\ncontent-length: 18\r\n"
+	"connection: close\r\n\r\nPayload Too Large\n";
+
+/*
+** Native handlers take the whole request in C: headers into a flat
+** buffer, body by content-length, then one write of the reply. A body
+** over NATIVE_MAX_BODY is refused with 413; one cut short means the
+** client has gone, so that is only logged.
+*/
+static int send_native(int sock, const char *line, RFRAME *frame) {
+	struct native_entry *entry;
+	GUSHER_HEADER headers[NATIVE_MAX_HEADERS];
+	GUSHER_REQ req;
+	char rline[4096], hbuf[8192];
+	char *url, *pt, *colon, *body;
+	size_t used, clen, got;
+	const char *clength;
+	struct iovec iov;
+	ssize_t n;
+	RBUF wire;
+	strncpy(rline, line, sizeof(rline) - 1);
+	rline[sizeof(rline) - 1] = '\0';
+	if ((url = index(rline, ' ')) == NULL) return 0;
+	*url++ = '\0';
+	if ((pt = index(url, ' ')) != NULL) *pt = '\0';
+	req.query = "";
+	if ((pt = index(url, '?')) != NULL) {
+		*pt++ = '\0';
+		req.query = pt;
+		}
+	if ((entry = native_match(url, &req.path_info)) == NULL) return 0;
+	// a Scheme route at least as specific wins
+	if (route_prefix(url) >= (int)(req.path_info - url)) return 0;
+	req.method = rline;
+	req.path = url;
+	req.remote_host = frame->ipaddr;
+	req.remote_port = frame->rport;
+	req.nheaders = 0;
+	req.headers = headers;
+	clength = NULL;
+	used = 0;
+	while (1) {
+		if (mygetline(sock, &hbuf[used], sizeof(hbuf) - used)
+				!= GETLINE_OK) return 1;
+		pt = &hbuf[used];
+		if (*pt == '\0') break;
+		used += strlen(pt) + 1;
+		if ((req.nheaders == NATIVE_MAX_HEADERS) ||
+				((colon = index(pt, ':')) == NULL)) continue;
+		*colon++ = '\0';
+		while (*colon && isspace(*colon)) colon++;
+		headers[req.nheaders].name = downcase(pt);
+		headers[req.nheaders].value = colon;
+		if (strcmp(pt, "content-length") == 0) clength = colon;
+		req.nheaders++;
+		}
+	clen = (clength == NULL ? 0 : strtoul(clength, NULL, 10));
+	if (clen > NATIVE_MAX_BODY) {
+		log_msg("native request body too large: %lu\n",
+				(unsigned long)clen);
+		if (watch_sending()) send_all(sock, too_large_msg);
+		return 1;
+		}
+	body = (char *)malloc(clen + 1);
+	for (got = 0; got < clen; got += n) {
+		n = read(sock, body + got, clen - got);
+		if ((n < 0) && (errno == EINTR)) n = 0;
+		else if (n <= 0) {
+			log_msg("native request short body: %lu of %lu\n",
+					(unsigned long)got, (unsigned long)clen);
+			free(body);
+			return 1;
+			}
+		}
+	body[clen] = '\0';
+	req.body = body;
+	req.body_len = clen;
+	native_run(entry, &req, &wire);
+	free(body);
+	iov.iov_base = wire.data;
+	iov.iov_len = wire.len;
+	if (watch_sending()) send_iov(sock, &iov, 1);
+	rbuf_free(&wire);
+	return 1;
 	}
 
 static void process_request(RFRAME *frame) {
 	char buf[4096];
 	size_t avail;
-	char *pt, *colon, *status, *body;
+	char *pt, *colon;
 	int sock, res;
+	unsigned long accepted;
 	SCM request;
 	sock = frame->sock;
+	accepted = frame->queued;
+	if (frame->constant != NULL) {
+		constant_write(sock, frame->constant, frame->head_only,
+				frame->sent, 0);
+		release_frame(frame);
+		close(sock);
+		return;
+		}
 	avail = sizeof(buf);
 	request = SCM_EOL;
+	arena_reset();
+	metrics_begin(frame->queued);
+	trace_begin(frame->queued);
+	capture_begin(frame->queued);
+	// the deadline covers the reads and native or constant replies
+	// too; dispatch renames the slot once the route is known, and
+	// every return before that ends the watch before closing sock
+	watch_begin(sock, "-", "-", 0, accepted);
+	unread_len = 0;
+	if (!frame->vetted && ratelimit_keyed()) {
+		// the rule may key on a header, so check on the whole head
+		size_t hlen;
+		char *head = read_head(sock, &hlen);
+		if (!ratelimit_check(head, frame->ipaddr, &res)) {
+			if (watch_sending()) ratelimit_reject(sock, res);
+			watch_end();
+			release_frame(frame);
+			close(sock);
+			return;
+			}
+		frame->vetted = 1;
+		unread = head;
+		unread_len = hlen;
+		}
 	while (1) { // build request
 		res = mygetline(sock, buf, avail);
-		if (res == GETLINE_PEER_CLOSED) return;
-		if (res == GETLINE_READ_ERR) return;
+		if ((res == GETLINE_PEER_CLOSED) || (res == GETLINE_READ_ERR)) {
+			watch_end();
+			release_frame(frame);
+			close(sock);
+			return;
+			}
 		if (res == GETLINE_TOO_LONG) break;
 		pt = buf;
+		metrics_bytes_in(strlen(pt) + 2);
+		capture_line(pt);
 //log_msg("LINE |%s|\n", pt);
 		if (buf[0] == '\0') break;
-		if (request == SCM_EOL) // first line of req
+		if (request == SCM_EOL) { // first line of req
+			if (!frame->vetted &&
+					!ratelimit_check(pt, frame->ipaddr, &res)) {
+				while ((mygetline(sock, buf, avail) == GETLINE_OK)
+						&& buf[0]) ;
+				if (watch_sending()) ratelimit_reject(sock, res);
+				watch_end();
+				release_frame(frame);
+				close(sock);
+				return;
+				}
+			if (send_constant(sock, pt) ||
+					send_native(sock, pt, frame)) {
+				watch_end();
+				release_frame(frame);
+				close(sock);
+				return;
+				}
 			request = start_request(pt);
+			}
 		else if ((colon = index(pt, ':')) != NULL) {
 			*colon++ = '\0';
 			while (*colon && isspace(*colon)) colon++;
-			request = scm_acons(makesym(downcase(pt)),
-					scm_from_locale_string(colon), request);
+			request = scm_acons(bytes_to_sym(downcase(pt)),
+					bytes_to_scm(colon), request);
 			}
 		}
-	request = scm_acons(makesym("remote-host"),
-					scm_from_locale_string(frame->ipaddr), request);
-	request = scm_acons(makesym("remote-port"),
+	request = scm_acons(remote_host_sym,
+					bytes_to_scm(frame->ipaddr), request);
+	request = scm_acons(remote_port_sym,
 					scm_from_signed_integer(frame->rport), request);
 	SCM query;
-	query = post_in(request, sock);
+	query = post_in(&request, sock);
 	if (query == SCM_BOOL_F) {
 		query = get_in(request);
 		if (query == SCM_BOOL_F) query = SCM_EOL;
 		}
 	request = scm_acons(query_sym, query, request);
 	scm_remember_upto_here_1(query);
+	metrics_bytes_in(request_length(request));
+	capture_end();
 	release_frame(frame);
 	//SCM reply = dump_request(request);
 	//SCM cookie_header = SCM_BOOL_F;
 	//-----------------------
-	SCM reply = run_responder(request);
-	SCM cookie_header = SCM_CAR(reply);
-	reply = SCM_CDR(reply);
+	SCM path_info = SCM_BOOL_F;
+	struct handler_entry *entry = find_handler(request, &path_info);
+	if ((entry != NULL) && (entry->bulkhead != NULL)) {
+		metrics_idle(); // the pool thread times its own part
+		trace_idle();
+		watch_end(); // and watches it, from the same accept time
+		if (bulkhead_submit(entry->bulkhead, sock, request, entry,
+				path_info, accepted) < 0) bulkhead_reject(sock);
+		}
+	else dispatch(sock, request, entry, path_info, accepted);
 	//-----------------------
-	send_all(sock, "HTTP/1.1 ");
-	status = scm_to_latin1_string(SCM_CAR(reply));
-	send_all(sock, status);
-	free(status);
-	send_all(sock, "\r\n");
-	reply = SCM_CDR(reply);
-	SCM headers = SCM_CAR(reply);
-	if (cookie_header != SCM_BOOL_F)
-		headers = scm_cons(cookie_header, headers);
-	reply = SCM_CDR(reply);
-	body = scm_to_utf8_string(SCM_CAR(reply));
-	headers = scm_acons(scm_from_latin1_string("content-length"),
-						scm_from_int(strlen(body)),
-						headers);
-	send_headers(sock, headers); // headers
-	send_all(sock, body);
-	free(body);
-	close(sock);
-	scm_remember_upto_here_2(request, reply);
-	scm_remember_upto_here_2(headers, cookie_header);
+	scm_remember_upto_here_2(request, path_info);
 	return;
 	}
 
@@ -902,12 +1665,16 @@ static SCM dispatcher(void *data) {
 			}
 		frame = req_queue;
 		req_queue = req_queue->next;
+		queue_depth--;
 		busy_threads++;
 		scm_unlock_mutex(qmutex);
 		scm_c_catch(SCM_BOOL_T,
 			body_req, (void *)frame,
 			catch_req, (void *)frame,
 			grab_stack, &captured_stack);
+		watch_end();
+		metrics_idle();
+		trace_idle();
 		//scm_lock_mutex(qmutex);
 		busy_threads--;
 		//scm_unlock_mutex(qmutex);
@@ -957,9 +1724,28 @@ static SCM query_value_boolean(SCM request, SCM key) {
 	return (state ? SCM_BOOL_T : SCM_BOOL_F);
 	}
 
+/*
+** The request parser's query decoding, for scripts that carry
+** urlencoded strings of their own (and for bench/micro.scm). The
+** string goes in as Latin-1 octets, as a request line does, so the
+** values come back exactly as the request path would give them.
+*/
+static SCM parse_query_string(SCM string) {
+	ARENA_MARK mark;
+	char scratch[SCRATCH_SIZE];
+	SCM list;
+	mark = arena_mark();
+	list = parse_query(scm_to_scratch(string, scratch, sizeof(scratch)));
+	arena_release(mark);
+	scm_remember_upto_here_2(string, list);
+	return list;
+	}
+
 static void add_thread() {
 	SCM thread;
-	if (nthreads >= max_threads) return;
+	// threads parked in blocking I/O don't count against max_threads
+	if (nthreads - parked_threads() >= max_threads) return;
+	if (nthreads >= max_threads + max_parked) return;
 	nthreads++;
 	thread = scm_spawn_thread(dispatcher, NULL, NULL, NULL);
 	if (threads != SCM_EOL) scm_gc_unprotect_object(threads);
@@ -975,12 +1761,25 @@ static SCM exit_gusher() {
 	return SCM_UNSPECIFIED;
 	}
 
+static long probe_queue(void) {
+	return queue_depth;
+	}
+
+static long probe_busy(void) {
+	return busy_threads;
+	}
+
+static long probe_idle(void) {
+	return (threading ? nthreads - busy_threads : 0);
+	}
+
 static void init_env(void) {
 	char *here, pats[64], *ver;
 	struct stat bstat;
 	scm_permanent_object(radix10 = scm_from_int(10));
-	scm_c_define_gsubr("http", 2, 0, 0, set_handler);
-	scm_c_define_gsubr("responder", 2, 0, 0, set_handler);
+	scm_c_define_gsubr("http", 2, 1, 0, set_handler);
+	scm_c_define_gsubr("responder", 2, 1, 0, set_handler);
+	scm_c_define_gsubr("json-body-limit", 1, 0, 0, json_body_limit);
 	scm_c_define_gsubr("not-found", 1, 0, 0, dump_request);
 	scm_c_define_gsubr("uuid-generate", 0, 0, 0, uuid_gen);
 	scm_c_define_gsubr("simple-response", 2, 0, 0, simple_http_response);
@@ -988,10 +1787,23 @@ static void init_env(void) {
 	scm_c_define_gsubr("query-value", 2, 0, 0, query_value);
 	scm_c_define_gsubr("query-value-number", 2, 0, 0, query_value_number);
 	scm_c_define_gsubr("query-value-boolean", 2, 0, 0, query_value_boolean);
+	scm_c_define_gsubr("parse-query", 1, 0, 0, parse_query_string);
 	scm_c_define_gsubr("exit", 0, 0, 0, exit_gusher);
 	scm_c_define("http-port", scm_from_int(http_port));
 	scm_c_define("gusher-root", scm_from_locale_string(gusher_root));
 	scm_permanent_object(query_sym = makesym("query"));
+	scm_permanent_object(get_sym = makesym("get"));
+	scm_permanent_object(url_sym = makesym("url"));
+	scm_permanent_object(url_path_sym = makesym("url-path"));
+	scm_permanent_object(path_info_sym = makesym("path-info"));
+	scm_permanent_object(cookie_sym = makesym("cookie"));
+	scm_permanent_object(remote_host_sym = makesym("remote-host"));
+	scm_permanent_object(remote_port_sym = makesym("remote-port"));
+	scm_permanent_object(inm_sym = makesym("if-none-match"));
+	scm_permanent_object(ims_sym = makesym("if-modified-since"));
+	scm_permanent_object(accept_enc_sym = makesym("accept-encoding"));
+	scm_permanent_object(request_id_sym = makesym("x-request-id"));
+	scm_permanent_object(traceparent_sym = makesym("traceparent"));
 	scm_permanent_object(method_sym = makesym("method"));
 	scm_permanent_object(ctype_sym = makesym("content-type"));
 	scm_permanent_object(clength_sym = makesym("content-length"));
@@ -1018,11 +1830,36 @@ static void init_env(void) {
 	init_http();
 	init_butter();
 	init_smtp();
+	init_flight();
+	init_constant();
+	init_native();
+	init_park();
+	init_deferred();
+	init_par();
+	init_ratelimit();
+	init_bulkhead();
+	init_watchdog();
+	init_arena();
+	init_aot(aot);
+	init_stats();
+	init_heap();
+	init_metrics();
+	init_trace();
+	init_usage();
+	init_profile();
+	init_capture();
+	metrics_gauge("queue_depth", "Requests waiting for a worker.",
+			probe_queue);
+	metrics_gauge("workers_busy", "Workers running a request.",
+			probe_busy);
+	metrics_gauge("workers_idle", "Workers waiting for a request.",
+			probe_idle);
+	init_compress();
 	here = getcwd(NULL, 0);
 	if (chdir(gusher_root) == 0) {
 		if (stat(BOOT_FILE, &bstat) == 0) {
 			log_msg("load %s/%s\n", gusher_root, BOOT_FILE);
-			scm_c_primitive_load(BOOT_FILE);
+			load_file(BOOT_FILE);
 			}
 		chdir(here);
 		}
@@ -1049,6 +1886,7 @@ static void shutdown_env(void) {
 	clear_queues();
 	shutdown_cache();
 	shutdown_http();
+	shutdown_compress();
 	shutdown_smtp();
 	shutdown_time();
 	shutdown_log();
@@ -1124,6 +1962,7 @@ static void enqueue_frame(RFRAME *frame) {
 	if ((need_sig = (req_queue == NULL))) req_queue = frame;
 	else req_tail->next = frame;
 	req_tail = frame;
+	queue_depth++;
 	if (need_sig) {
 		SCM node;
 		node = qcondvars;
@@ -1136,28 +1975,105 @@ static void enqueue_frame(RFRAME *frame) {
 	return;
 	}
 
+/*
+** Look at what the client has sent so far without consuming it.
+** Returns the length of the request head if all of it is in buf.
+*/
+static size_t peek_head(int sock, char *buf, size_t size) {
+	ssize_t n;
+	char *end;
+	n = recv(sock, buf, size - 1, MSG_PEEK | MSG_DONTWAIT);
+	if (n <= 0) return 0;
+	buf[n] = '\0';
+	if ((end = strstr(buf, "\r\n\r\n")) == NULL) return 0;
+	return end - buf + 4;
+	}
+
+static int drain_head(int sock, size_t want) {
+	char buf[4096];
+	ssize_t n;
+	size_t got;
+	for (got = 0; got < want; got += n) {
+		n = recv(sock, buf, want - got, 0);
+		if (n <= 0) return 0;
+		}
+	return 1;
+	}
+
+/*
+** I/O-thread constant path: if the whole request head has already
+** arrived and names a constant, consume it and write as much of the
+** reply as the socket takes without blocking, never waking a worker
+** unless some is left. Returns 1 if the connection was dealt with
+** here, 0 if not; a partly sent reply is left in *rest and *sent
+** for a worker to finish, so a client that stops reading can't
+** stall accept.
+*/
+static int serve_constant(int sock, const char *head, size_t len,
+		CONSTANT **rest, size_t *sent) {
+	CONSTANT *entry;
+	ssize_t n;
+	int head_only;
+	if ((entry = constant_match(head)) == NULL) return 0;
+	head_only = (head[0] == 'H');
+	if (drain_head(sock, len)) {
+		n = constant_write(sock, entry, head_only, 0, MSG_DONTWAIT);
+		if ((n >= 0) && ((size_t)n < constant_length(entry, head_only))) {
+			*rest = entry;
+			*sent = n;
+			return 0;
+			}
+		}
+	close(sock);
+	return 1;
+	}
+
 static void process_http(int sock) {
 	socklen_t size;
 	RFRAME *frame;
-	int fsock;
+	int fsock, retry;
 	struct sockaddr_in client;
+	char head[4096], ipaddr[32];
+	CONSTANT *rest;
+	size_t hlen, sent;
+	rest = NULL;
+	sent = 0;
 	size = sizeof(struct sockaddr_in);
 	fsock = accept(sock, (struct sockaddr *)&client, &size);
 	if (fsock < 0) {
 		log_msg("accept: %s [%d]\n", strerror(errno), errno);
 		return;
 		}
+	strcpy(ipaddr, inet_ntoa(client.sin_addr));
+	if ((hlen = peek_head(fsock, head, sizeof(head))) > 0) {
+		if (!ratelimit_check(head, ipaddr, &retry)) {
+			if (drain_head(fsock, hlen)) ratelimit_reject(fsock, retry);
+			close(fsock);
+			tcount++;
+			return;
+			}
+		if (serve_constant(fsock, head, hlen, &rest, &sent)) {
+			tcount++;
+			return;
+			}
+		}
 	frame = get_frame();
 	frame->sock = fsock;
-	strcpy(frame->ipaddr, inet_ntoa(client.sin_addr));
+	frame->vetted = (hlen > 0);
+	frame->constant = rest;
+	frame->head_only = (rest != NULL) && (head[0] == 'H');
+	frame->sent = sent;
+	strcpy(frame->ipaddr, ipaddr);
 	frame->rport = ntohs(client.sin_port);
 	frame->count = tcount;
+	frame->queued = now_ns();
 	if (threading) {
 		if (busy_threads >= nthreads) add_thread();
 		enqueue_frame(frame);
 		}
 	else {
 		process_request(frame);
+		watch_end();
 		}
 	tcount++;
 	return;
@@ -1169,6 +2085,10 @@ static int http_socket(int port) {
 	sock = socket(AF_INET, SOCK_STREAM, 0);
 	optval = 1;
 	setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
+	// hold connections in the kernel until the request arrives, so
+	// constant responses can usually be answered at accept time
+	optval = 1;
+	setsockopt(sock, IPPROTO_TCP, TCP_DEFER_ACCEPT, &optval, sizeof(optval));
 	memset(&server_addr, 0, sizeof(struct sockaddr_in));
         server_addr.sin_family = AF_INET;         
         server_addr.sin_port = htons(port);
@@ -1192,7 +2112,7 @@ static void police() {
 
 static SCM load_file_body(void *data) {
 	char *path = (char *)data;
-	scm_c_primitive_load(path);
+	aot_load(path);
 	return SCM_BOOL_T;
 	}
 
@@ -1241,7 +2161,7 @@ int main(int argc, char **argv) {
 	threading = 1;
 	background = 0;
 	gusher_root[0] = '\0';
-	while ((opt = getopt(argc, argv, "sdh:p:t:")) != -1) {
+	while ((opt = getopt(argc, argv, "sdih:p:t:P:G:")) != -1) {
 		switch (opt) {
 			case 'p':
 				http_port = atoi(optarg);
@@ -1250,6 +2170,10 @@ int main(int argc, char **argv) {
 				max_threads = atoi(optarg);
 				if (max_threads < 1) max_threads = 1;
 				break;
+			case 'P': // extra threads allowed while others are parked
+				max_parked = atoi(optarg);
+				if (max_parked < 0) max_parked = 0;
+				break;
 			case 'd': // daemon
 				background = 1;
 				break;
@@ -1259,6 +2183,12 @@ int main(int argc, char **argv) {
 			case 's': // single-threaded
 				threading = 0;
 				break;
+			case 'i': // interpret, skip the .go cache
+				aot = 0;
+				break;
+			case 'G': // collector settings, see heap.c
+				if (!heap_option(optarg)) exit(1);
+				break;
 			default:
 				log_msg("invalid option: %c", opt);
 				exit(1);
@@ -1268,6 +2198,7 @@ int main(int argc, char **argv) {
 		signal(SIGCHLD, SIG_IGN);
 		if (fork() > 0) _exit(0);
 		}
+	signal(SIGPIPE, SIG_IGN);
 	signal(SIGINT, signal_handler);
 	signal(SIGTERM, signal_handler);
 	signal(SIGABRT, signal_handler);
@@ -1276,6 +2207,7 @@ int main(int argc, char **argv) {
 		}
 	http_sock = http_socket(http_port);
 	if (http_sock < 0) exit(1);
+	aot_sources(argc - optind, &argv[optind]);
 	scm_init_guile();
 	init_env();
 	running = 1;
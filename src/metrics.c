@@ -0,0 +1,430 @@
+/*
+** Copyright (c) 2013 Peter Yadlowsky <pmy@virginia.edu>
+**
+** This program is free software ; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation ; either version 3 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY ; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program ; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+/*
+** Request metrics registry. Each route owns METRICS_SHARDS copies of
+** its counters and histograms; a thread always writes to the same
+** shard, so the hot path is a few uncontended atomic adds and no
+** lock. A scrape sums the shards as it reads them.
+**
+** Histograms are log-linear over microseconds (HDR style): values
+** below 8 get their own bucket, above that each power of two is cut
+** into 8 sub-buckets, which keeps quantiles within 12.5%.
+**
+** Stages, timed on the worker's monotonic clock:
+**	queue	accepted -> picked up by a worker
+**	parse	picked up -> handed to the responder (headers, body)
+**	handler	responder and serialization
+**	send	writing the reply
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+#include <libguile.h>
+
+#include "reply.h"
+#include "gtime.h"
+#include "stats.h"
+#include "metrics.h"
+
+#define SUB_BITS 3
+#define SUB_COUNT (1 << SUB_BITS)
+#define HIST_BUCKETS ((36 - SUB_BITS + 1) * SUB_COUNT)
+#define STAGES 4
+#define STATUS_CLASSES 6
+
+enum { STAGE_QUEUE, STAGE_PARSE, STAGE_HANDLER, STAGE_SEND };
+
+static const char *stage_names[STAGES] = {
+	"queue", "parse", "handler", "send"
+	};
+
+typedef struct hist {
+	volatile unsigned long count;
+	volatile unsigned long sum;
+	volatile unsigned long max;
+	volatile unsigned long bucket[HIST_BUCKETS];
+	} HIST;
+
+typedef struct shard {
+	HIST stage[STAGES];
+	volatile unsigned long status[STATUS_CLASSES];
+	volatile unsigned long bytes_in;
+	volatile unsigned long bytes_out;
+	} SHARD;
+
+struct metrics_route {
+	SHARD shard[METRICS_SHARDS];
+	};
+
+struct gauge {
+	const char *name;
+	const char *help;
+	metrics_probe probe;
+	};
+
+/*
+** What the current thread knows about the request it is running.
+*/
+struct timing {
+	int active;
+	int status;
+	unsigned long queued, started, parsed, handled, sent;
+	size_t bytes_in, bytes_out;
+	};
+
+static struct gauge gauges[METRICS_GAUGES];
+static int ngauges = 0;
+static volatile long in_flight = 0;
+static volatile int next_shard = 0;
+static __thread int shard_id = -1;
+static __thread struct timing timing;
+
+static const double le_bounds[] = {
+	0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1,
+	0.25, 0.5, 1, 2.5, 5, 10
+	};
+#define LE_COUNT (sizeof(le_bounds) / sizeof(le_bounds[0]))
+
+static int bucket_of(unsigned long us) {
+	int e, idx;
+	if (us < SUB_COUNT) return (int)us;
+	e = 63 - __builtin_clzl(us);
+	idx = (e - SUB_BITS + 1) * SUB_COUNT +
+			(int)((us >> (e - SUB_BITS)) & (SUB_COUNT - 1));
+	return (idx < HIST_BUCKETS ? idx : HIST_BUCKETS - 1);
+	}
+
+/*
+** Exclusive upper bound of a bucket, in microseconds.
+*/
+static unsigned long bucket_top(int idx) {
+	int e, sub;
+	if (idx < SUB_COUNT) return idx + 1;
+	e = idx / SUB_COUNT + SUB_BITS - 1;
+	sub = idx % SUB_COUNT;
+	return (unsigned long)(SUB_COUNT + sub + 1) << (e - SUB_BITS);
+	}
+
+static SHARD *my_shard(METRICS_ROUTE *route) {
+	if (shard_id < 0)
+		shard_id = __sync_fetch_and_add(&next_shard, 1) % METRICS_SHARDS;
+	return &route->shard[shard_id];
+	}
+
+static void record(HIST *hist, unsigned long from, unsigned long to) {
+	unsigned long us, max;
+	if ((from == 0) || (to < from)) return;
+	us = (to - from) / 1000;
+	__sync_fetch_and_add(&hist->count, 1);
+	__sync_fetch_and_add(&hist->sum, us);
+	__sync_fetch_and_add(&hist->bucket[bucket_of(us)], 1);
+	while ((max = hist->max) < us)
+		__sync_bool_compare_and_swap(&hist->max, max, us);
+	}
+
+METRICS_ROUTE *metrics_counters(void) {
+	return (METRICS_ROUTE *)calloc(1, sizeof(METRICS_ROUTE));
+	}
+
+void metrics_gauge(const char *name, const char *help, metrics_probe probe) {
+	if (ngauges >= METRICS_GAUGES) return;
+	gauges[ngauges].name = name;
+	gauges[ngauges].help = help;
+	gauges[ngauges].probe = probe;
+	ngauges++;
+	}
+
+void metrics_idle(void) {
+	if (!timing.active) return;
+	timing.active = 0;
+	__sync_fetch_and_sub(&in_flight, 1);
+	}
+
+/*
+** Worker picked up a request accepted at queued (0 if unknown).
+*/
+void metrics_begin(unsigned long queued) {
+	metrics_idle();
+	memset(&timing, 0, sizeof(timing));
+	timing.active = 1;
+	timing.queued = queued;
+	timing.started = now_ns();
+	__sync_fetch_and_add(&in_flight, 1);
+	}
+
+void metrics_bytes_in(size_t n) {
+	timing.bytes_in += n;
+	}
+
+/*
+** Parsing done. A bulkhead pool thread starts its timing here.
+*/
+void metrics_dispatch(void) {
+	if (!timing.active) metrics_begin(0);
+	timing.parsed = now_ns();
+	}
+
+void metrics_sending(void) {
+	if (timing.handled == 0) timing.handled = now_ns();
+	}
+
+void metrics_sent(int status, size_t bytes) {
+	timing.sent = now_ns();
+	timing.status = status;
+	timing.bytes_out += bytes;
+	}
+
+void metrics_end(ROUTE_STATS *route) {
+	SHARD *shard;
+	int cls;
+	if (!timing.active) return;
+	if (route == NULL) route = stats_route(NULL);
+	shard = my_shard(route->metrics);
+	record(&shard->stage[STAGE_QUEUE], timing.queued, timing.started);
+	if (timing.queued != 0) // pool threads have no parse stage
+		record(&shard->stage[STAGE_PARSE], timing.started, timing.parsed);
+	record(&shard->stage[STAGE_HANDLER], timing.parsed,
+			(timing.handled ? timing.handled : now_ns()));
+	if (timing.sent != 0)
+		record(&shard->stage[STAGE_SEND], timing.handled, timing.sent);
+	cls = timing.status / 100;
+	if ((cls < 1) || (cls >= STATUS_CLASSES)) cls = 0;
+	__sync_fetch_and_add(&shard->status[cls], 1);
+	__sync_fetch_and_add(&shard->bytes_in, timing.bytes_in);
+	__sync_fetch_and_add(&shard->bytes_out, timing.bytes_out);
+	metrics_idle();
+	}
+
+static void merge_hist(HIST *out, const METRICS_ROUTE *route, int stage) {
+	const HIST *hist;
+	int i, b;
+	memset(out, 0, sizeof(HIST));
+	for (i = 0; i < METRICS_SHARDS; i++) {
+		hist = &route->shard[i].stage[stage];
+		out->count += hist->count;
+		out->sum += hist->sum;
+		if (hist->max > out->max) out->max = hist->max;
+		for (b = 0; b < HIST_BUCKETS; b++) out->bucket[b] += hist->bucket[b];
+		}
+	}
+
+static unsigned long route_total(const METRICS_ROUTE *route, int what) {
+	unsigned long total;
+	int i;
+	total = 0;
+	for (i = 0; i < METRICS_SHARDS; i++) {
+		if (what < STATUS_CLASSES) total += route->shard[i].status[what];
+		else if (what == STATUS_CLASSES) total += route->shard[i].bytes_in;
+		else total += route->shard[i].bytes_out;
+		}
+	return total;
+	}
+
+static double quantile_ms(const HIST *hist, double q) {
+	unsigned long want, seen, top;
+	int b;
+	if (hist->count == 0) return 0;
+	want = (unsigned long)(q * hist->count + 0.5);
+	if (want == 0) want = 1;
+	seen = 0;
+	for (b = 0; b < HIST_BUCKETS; b++) {
+		seen += hist->bucket[b];
+		if (seen >= want) break;
+		}
+	top = bucket_top(b);
+	return (top < hist->max ? top : hist->max) / 1000.0;
+	}
+
+static void put_fmt(RBUF *out, const char *fmt, ...) {
+	char buf[512];
+	va_list args;
+	int n;
+	va_start(args, fmt);
+	n = vsnprintf(buf, sizeof(buf), fmt, args);
+	va_end(args);
+	if (n >= (int)sizeof(buf)) n = sizeof(buf) - 1;
+	if (n > 0) rbuf_put(out, buf, n);
+	}
+
+static void put_label(RBUF *out, const char *path) {
+	const char *pt;
+	for (pt = path; *pt; pt++) {
+		if ((*pt == '"') || (*pt == '\\')) rbuf_put(out, "\\", 1);
+		rbuf_put(out, pt, 1);
+		}
+	}
+
+static void put_hist(RBUF *out, const ROUTE_STATS *route, int stage) {
+	HIST hist;
+	unsigned long cum;
+	unsigned int i;
+	int b;
+	merge_hist(&hist, route->metrics, stage);
+	cum = 0;
+	b = 0;
+	for (i = 0; i < LE_COUNT; i++) {
+		for (; (b < HIST_BUCKETS) &&
+				(bucket_top(b) <= le_bounds[i] * 1e6); b++)
+			cum += hist.bucket[b];
+		rbuf_puts(out, "gusher_request_seconds_bucket{route=\"");
+		put_label(out, route->path);
+		put_fmt(out, "\",stage=\"%s\",le=\"%g\"} %lu\n",
+				stage_names[stage], le_bounds[i], cum);
+		}
+	rbuf_puts(out, "gusher_request_seconds_bucket{route=\"");
+	put_label(out, route->path);
+	put_fmt(out, "\",stage=\"%s\",le=\"+Inf\"} %lu\n",
+			stage_names[stage], hist.count);
+	rbuf_puts(out, "gusher_request_seconds_sum{route=\"");
+	put_label(out, route->path);
+	put_fmt(out, "\",stage=\"%s\"} %.6f\n", stage_names[stage],
+			hist.sum / 1e6);
+	rbuf_puts(out, "gusher_request_seconds_count{route=\"");
+	put_label(out, route->path);
+	put_fmt(out, "\",stage=\"%s\"} %lu\n", stage_names[stage], hist.count);
+	}
+
+/*
+** Prometheus text exposition format 0.0.4.
+*/
+static SCM metrics_text(void) {
+	static const char *classes[STATUS_CLASSES] = {
+		"none", "1xx", "2xx", "3xx", "4xx", "5xx"
+		};
+	ROUTE_STATS *route;
+	RBUF out;
+	SCM text;
+	int i;
+	rbuf_init(&out, 16384);
+	rbuf_puts(&out, "# HELP gusher_request_seconds Request time by stage.\n"
+			"# TYPE gusher_request_seconds histogram\n");
+	for (route = stats_routes(); route != NULL; route = route->link) {
+		for (i = 0; i < STAGES; i++) put_hist(&out, route, i);
+		}
+	rbuf_puts(&out, "# HELP gusher_responses_total Responses by status class.\n"
+			"# TYPE gusher_responses_total counter\n");
+	for (route = stats_routes(); route != NULL; route = route->link) {
+		for (i = 0; i < STATUS_CLASSES; i++) {
+			rbuf_puts(&out, "gusher_responses_total{route=\"");
+			put_label(&out, route->path);
+			put_fmt(&out, "\",code=\"%s\"} %lu\n", classes[i],
+					route_total(route->metrics, i));
+			}
+		}
+	rbuf_puts(&out, "# HELP gusher_request_bytes_total Request bytes read.\n"
+			"# TYPE gusher_request_bytes_total counter\n");
+	for (route = stats_routes(); route != NULL; route = route->link) {
+		rbuf_puts(&out, "gusher_request_bytes_total{route=\"");
+		put_label(&out, route->path);
+		put_fmt(&out, "\"} %lu\n",
+				route_total(route->metrics, STATUS_CLASSES));
+		}
+	rbuf_puts(&out, "# HELP gusher_response_bytes_total Response bytes sent.\n"
+			"# TYPE gusher_response_bytes_total counter\n");
+	for (route = stats_routes(); route != NULL; route = route->link) {
+		rbuf_puts(&out, "gusher_response_bytes_total{route=\"");
+		put_label(&out, route->path);
+		put_fmt(&out, "\"} %lu\n",
+				route_total(route->metrics, STATUS_CLASSES + 1));
+		}
+	put_fmt(&out, "# HELP gusher_in_flight Requests being worked.\n"
+			"# TYPE gusher_in_flight gauge\ngusher_in_flight %ld\n",
+			in_flight);
+	for (i = 0; i < ngauges; i++) {
+		put_fmt(&out, "# HELP gusher_%s %s\n# TYPE gusher_%s gauge\n"
+				"gusher_%s %ld\n", gauges[i].name, gauges[i].help,
+				gauges[i].name, gauges[i].name, gauges[i].probe());
+		}
+	text = scm_from_utf8_stringn(out.data, out.len);
+	rbuf_free(&out);
+	scm_remember_upto_here_1(text);
+	return text;
+	}
+
+static SCM hist_stats(const METRICS_ROUTE *route, int stage) {
+	HIST hist;
+	SCM stats;
+	merge_hist(&hist, route, stage);
+	stats = SCM_EOL;
+	stats = scm_acons(scm_from_latin1_symbol("max-ms"),
+			scm_from_double(hist.max / 1000.0), stats);
+	stats = scm_acons(scm_from_latin1_symbol("p99-ms"),
+			scm_from_double(quantile_ms(&hist, 0.99)), stats);
+	stats = scm_acons(scm_from_latin1_symbol("p90-ms"),
+			scm_from_double(quantile_ms(&hist, 0.90)), stats);
+	stats = scm_acons(scm_from_latin1_symbol("p50-ms"),
+			scm_from_double(quantile_ms(&hist, 0.50)), stats);
+	stats = scm_acons(scm_from_latin1_symbol("mean-ms"),
+			scm_from_double(hist.count ?
+				hist.sum / 1000.0 / hist.count : 0), stats);
+	stats = scm_acons(scm_from_latin1_symbol("count"),
+			scm_from_ulong(hist.count), stats);
+	scm_remember_upto_here_1(stats);
+	return stats;
+	}
+
+/*
+** Same registry as an alist, for (json-encode (metrics-stats)).
+*/
+static SCM metrics_stats(void) {
+	static const char *classes[STATUS_CLASSES] = {
+		"none", "1xx", "2xx", "3xx", "4xx", "5xx"
+		};
+	ROUTE_STATS *route;
+	SCM stats, list, entry, codes;
+	int i;
+	list = SCM_EOL;
+	entry = SCM_EOL;
+	codes = SCM_EOL;
+	for (route = stats_routes(); route != NULL; route = route->link) {
+		codes = SCM_EOL;
+		for (i = STATUS_CLASSES - 1; i >= 0; i--)
+			codes = scm_acons(scm_from_latin1_symbol(classes[i]),
+				scm_from_ulong(route_total(route->metrics, i)), codes);
+		entry = SCM_EOL;
+		entry = scm_acons(scm_from_latin1_symbol("bytes-out"),
+			scm_from_ulong(route_total(route->metrics, STATUS_CLASSES + 1)),
+			entry);
+		entry = scm_acons(scm_from_latin1_symbol("bytes-in"),
+			scm_from_ulong(route_total(route->metrics, STATUS_CLASSES)),
+			entry);
+		entry = scm_acons(scm_from_latin1_symbol("status"), codes, entry);
+		for (i = STAGES - 1; i >= 0; i--)
+			entry = scm_acons(scm_from_latin1_symbol(stage_names[i]),
+				hist_stats(route->metrics, i), entry);
+		list = scm_acons(scm_from_locale_symbol(route->path), entry, list);
+		}
+	stats = SCM_EOL;
+	for (i = ngauges - 1; i >= 0; i--)
+		stats = scm_acons(scm_from_latin1_symbol(gauges[i].name),
+			scm_from_long(gauges[i].probe()), stats);
+	stats = scm_acons(scm_from_latin1_symbol("in-flight"),
+			scm_from_long(in_flight), stats);
+	stats = scm_acons(scm_from_latin1_symbol("routes"), list, stats);
+	scm_remember_upto_here_2(stats, list);
+	scm_remember_upto_here_2(entry, codes);
+	return stats;
+	}
+
+void init_metrics(void) {
+	scm_c_define_gsubr("metrics-text", 0, 0, 0, metrics_text);
+	scm_c_define_gsubr("metrics-stats", 0, 0, 0, metrics_stats);
+	}
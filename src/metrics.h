@@ -0,0 +1,37 @@
+/*
+** Copyright (c) 2013 Peter Yadlowsky <pmy@virginia.edu>
+**
+** This program is free software ; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation ; either version 3 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY ; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program ; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+#include <stddef.h>
+
+#define METRICS_SHARDS 8
+#define METRICS_GAUGES 16
+
+typedef struct metrics_route METRICS_ROUTE;
+struct route_stats;
+typedef long (*metrics_probe)(void);
+
+METRICS_ROUTE *metrics_counters(void);
+void metrics_gauge(const char *, const char *, metrics_probe);
+void metrics_begin(unsigned long);
+void metrics_bytes_in(size_t);
+void metrics_dispatch(void);
+void metrics_sending(void);
+void metrics_sent(int, size_t);
+void metrics_end(struct route_stats *);
+void metrics_idle(void);
+void init_metrics(void);
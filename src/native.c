@@ -0,0 +1,487 @@
+/*
+** Copyright (c) 2013 Peter Yadlowsky <pmy@virginia.edu>
+**
+** This program is free software ; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation ; either version 3 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY ; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program ; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+/*
+** Native handlers: http-native binds a path prefix to a C function
+** in a shared object. The worker parses the request into a
+** GUSHER_REQ and calls straight through; no Scheme object is made
+** between accept and close.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <ctype.h>
+#include <dlfcn.h>
+#include <libguile.h>
+#include <libpq-fe.h>
+
+#include "log.h"
+#include "reply.h"
+#include "json.h"
+#include "arena.h"
+#include "bytes.h"
+#include "template.h"
+#include "gusher.h"
+#include "native.h"
+#include "park.h"
+#include "watchdog.h"
+#include "trace.h"
+#include "usage.h"
+
+struct native_entry {
+	char *path;
+	size_t plen;
+	gusher_handler handler;
+	void *dl;
+	unsigned long calls;
+	unsigned long errors;
+	struct native_entry *link;
+	};
+
+struct native_out {
+	RBUF body;
+	RBUF headers;
+	};
+
+struct pg_slot {
+	char *conninfo;
+	PGconn *conn;
+	struct pg_slot *link;
+	};
+
+static struct native_entry *natives = NULL;
+static __thread struct pg_slot *pg_slots = NULL;
+
+static void api_write(GUSHER_RESP *resp, const void *data, size_t len) {
+	rbuf_put(&((struct native_out *)resp->priv)->body,
+			(const char *)data, len);
+	}
+
+static void api_puts(GUSHER_RESP *resp, const char *str) {
+	rbuf_puts(&((struct native_out *)resp->priv)->body, str);
+	}
+
+static void api_printf(GUSHER_RESP *resp, const char *format, ...) {
+	va_list args;
+	RBUF *out;
+	int n;
+	out = &((struct native_out *)resp->priv)->body;
+	va_start(args, format);
+	n = vsnprintf(NULL, 0, format, args);
+	va_end(args);
+	if (n <= 0) return;
+	if (out->len + n + 1 > out->size) {
+		out->size = out->len + n + 1;
+		out->data = (char *)realloc(out->data, out->size);
+		}
+	va_start(args, format);
+	vsnprintf(out->data + out->len, n + 1, format, args);
+	va_end(args);
+	out->len += n;
+	}
+
+static void api_header(GUSHER_RESP *resp, const char *name,
+		const char *value) {
+	RBUF *out;
+	out = &((struct native_out *)resp->priv)->headers;
+	rbuf_puts(out, name);
+	rbuf_put(out, ": ", 2);
+	rbuf_puts(out, value);
+	rbuf_put(out, "\r\n", 2);
+	}
+
+static const char *api_req_header(const GUSHER_REQ *req, const char *name) {
+	int i;
+	for (i = 0; i < req->nheaders; i++) {
+		if (strcasecmp(req->headers[i].name, name) == 0)
+			return req->headers[i].value;
+		}
+	return NULL;
+	}
+
+static int hexval(int c) {
+	if (isdigit(c)) return c - '0';
+	return toupper(c) - 'A' + 10;
+	}
+
+static int find_param(const char *src, size_t len, const char *name,
+		char *buf, size_t size) {
+	const char *pt, *end, *next, *eq;
+	size_t nlen, n;
+	nlen = strlen(name);
+	end = src + len;
+	for (pt = src; pt < end; pt = next + 1) {
+		if ((next = memchr(pt, '&', end - pt)) == NULL) next = end;
+		eq = memchr(pt, '=', next - pt);
+		if ((eq == NULL) || (eq - pt != nlen) ||
+				(strncmp(pt, name, nlen) != 0)) continue;
+		n = 0;
+		for (pt = eq + 1; (pt < next) && (n + 1 < size); pt++) {
+			if (*pt == '+') buf[n++] = ' ';
+			else if ((*pt == '%') && (pt + 2 < next) &&
+					isxdigit(pt[1]) && isxdigit(pt[2])) {
+				buf[n++] = (hexval(pt[1]) << 4) | hexval(pt[2]);
+				pt += 2;
+				}
+			else buf[n++] = *pt;
+			}
+		if (size > 0) buf[n] = '\0';
+		return n;
+		}
+	return -1;
+	}
+
+static int api_param(const GUSHER_REQ *req, const char *name, char *buf,
+		size_t size) {
+	const char *type;
+	int n;
+	n = find_param(req->query, strlen(req->query), name, buf, size);
+	if (n >= 0) return n;
+	type = api_req_header(req, "content-type");
+	if ((type == NULL) || (req->body == NULL) || (strncasecmp(type,
+			"application/x-www-form-urlencoded", 33) != 0))
+		return -1;
+	return find_param(req->body, req->body_len, name, buf, size);
+	}
+
+struct pg_call {
+	PGconn *conn;
+	const char *query;
+	int nparams;
+	const char *const *params;
+	};
+
+static void *connect_parked(void *data) {
+	return PQconnectdb((const char *)data);
+	}
+
+static void *reset_parked(void *data) {
+	PQreset((PGconn *)data);
+	return NULL;
+	}
+
+static void *exec_parked(void *data) {
+	struct pg_call *call = (struct pg_call *)data;
+	return PQexecParams(call->conn, call->query, call->nparams, NULL,
+			call->params, NULL, NULL, 0);
+	}
+
+static void *api_pg_conn(const char *conninfo) {
+	struct pg_slot *slot;
+	for (slot = pg_slots; slot != NULL; slot = slot->link) {
+		if (strcmp(slot->conninfo, conninfo) == 0) break;
+		}
+	if (slot == NULL) {
+		slot = (struct pg_slot *)malloc(sizeof(struct pg_slot));
+		slot->conninfo = strdup(conninfo);
+		slot->conn = (PGconn *)park(connect_parked, (void *)conninfo);
+		slot->link = pg_slots;
+		pg_slots = slot;
+		}
+	else if (PQstatus(slot->conn) != CONNECTION_OK)
+		park(reset_parked, slot->conn);
+	if (PQstatus(slot->conn) != CONNECTION_OK) {
+		log_msg("native PQ connection failed: %s\n",
+				PQerrorMessage(slot->conn));
+		return NULL;
+		}
+	return slot->conn;
+	}
+
+static void *api_pg_exec(const char *conninfo, const char *query,
+		int nparams, const char *const *params) {
+	struct pg_call call;
+	PGcancel *cancel;
+	PGresult *res;
+	int status, span;
+	unsigned long io;
+	if ((call.conn = (PGconn *)api_pg_conn(conninfo)) == NULL) return NULL;
+	span = trace_span_begin("pg", query);
+	io = usage_io_begin();
+	call.query = query;
+	call.nparams = nparams;
+	call.params = params;
+	cancel = PQgetCancel(call.conn);
+	watch_query(cancel);
+	res = (PGresult *)park(exec_parked, &call);
+	if (watch_query(NULL) && (cancel != NULL)) PQfreeCancel(cancel);
+	usage_io_end(USAGE_PG, io);
+	trace_span_end(span);
+	status = PQresultStatus(res);
+	if ((status == PGRES_TUPLES_OK) || (status == PGRES_COMMAND_OK))
+		return res;
+	log_msg("PQquery: %s\n", query);
+	log_msg("PQerr: %s", PQresultErrorMessage(res));
+	PQclear(res);
+	return NULL;
+	}
+
+static void api_pg_clear(void *res) {
+	if (res != NULL) PQclear((PGresult *)res);
+	}
+
+static void api_json_string(GUSHER_RESP *resp, const char *str) {
+	json_put_string(&((struct native_out *)resp->priv)->body, str);
+	}
+
+static void put_cell(RBUF *out, PGresult *res, int row, int col) {
+	const char *val;
+	if (PQgetisnull(res, row, col)) {
+		rbuf_put(out, "null", 4);
+		return;
+		}
+	val = PQgetvalue(res, row, col);
+	switch (PQftype(res, col)) {
+	case 16: // bool
+		rbuf_puts(out, val[0] == 't' ? "true" : "false");
+		break;
+	case 20: case 21: case 23: case 26: // int8 int2 int4 oid
+		rbuf_puts(out, val);
+		break;
+	case 700: case 701: case 1700: // float4 float8 numeric
+		if (isalpha(val[0]) || isalpha(val[1])) // NaN, Infinity
+			rbuf_put(out, "null", 4);
+		else rbuf_puts(out, val);
+		break;
+	case 114: case 3802: // json jsonb
+		rbuf_puts(out, val);
+		break;
+	default:
+		json_put_string(out, val);
+		}
+	}
+
+static void put_row(RBUF *out, PGresult *res, int row) {
+	int col, nfields;
+	nfields = PQnfields(res);
+	rbuf_put(out, "{", 1);
+	for (col = 0; col < nfields; col++) {
+		if (col > 0) rbuf_put(out, ",", 1);
+		json_put_string(out, PQfname(res, col));
+		rbuf_put(out, ":", 1);
+		put_cell(out, res, row, col);
+		}
+	rbuf_put(out, "}", 1);
+	}
+
+static void api_json_rows(GUSHER_RESP *resp, void *result, int single) {
+	PGresult *res;
+	RBUF *out;
+	int row, ntuples;
+	out = &((struct native_out *)resp->priv)->body;
+	res = (PGresult *)result;
+	ntuples = (res == NULL ? 0 : PQntuples(res));
+	if (single) {
+		if (ntuples > 0) put_row(out, res, 0);
+		else rbuf_put(out, "null", 4);
+		return;
+		}
+	rbuf_put(out, "[", 1);
+	for (row = 0; row < ntuples; row++) {
+		if (row > 0) rbuf_put(out, ",", 1);
+		put_row(out, res, row);
+		}
+	rbuf_put(out, "]", 1);
+	}
+
+// the table goes on the arena: nslots is the plug-in's to choose
+static void api_fill_template(GUSHER_RESP *resp, const char *tpl,
+		const char *const *slots, int nslots, int partial) {
+	struct template_slot *table;
+	ARENA_MARK mark;
+	int i;
+	if (nslots < 0) nslots = 0;
+	mark = arena_mark();
+	table = (struct template_slot *)arena_alloc(
+				sizeof(struct template_slot) * ((size_t)nslots + 1));
+	for (i = 0; i < nslots; i++) {
+		table[i].token = slots[i * 2];
+		table[i].payload = slots[i * 2 + 1];
+		}
+	template_fill(&((struct native_out *)resp->priv)->body, tpl,
+			table, nslots, partial);
+	arena_release(mark);
+	}
+
+static void api_log(const char *format, ...) {
+	va_list args;
+	char buf[1024];
+	va_start(args, format);
+	vsnprintf(buf, sizeof(buf), format, args);
+	va_end(args);
+	log_msg("%s", buf);
+	}
+
+static const GUSHER_API api = {
+	GUSHER_ABI,
+	sizeof(GUSHER_API),
+	api_write,
+	api_puts,
+	api_printf,
+	api_header,
+	api_req_header,
+	api_param,
+	api_pg_conn,
+	api_pg_exec,
+	api_pg_clear,
+	api_json_string,
+	api_json_rows,
+	api_fill_template,
+	api_log
+	};
+
+/*
+** The longest registered prefix of path, as for Scheme routes.
+*/
+struct native_entry *native_match(const char *path, const char **path_info) {
+	struct native_entry *entry, *best;
+	best = NULL;
+	for (entry = natives; entry != NULL; entry = entry->link) {
+		if ((strncmp(entry->path, path, entry->plen) == 0) &&
+				((best == NULL) || (entry->plen > best->plen)))
+			best = entry;
+		}
+	if (best != NULL) *path_info = path + best->plen;
+	return best;
+	}
+
+static const char *reason(int status) {
+	switch (status) {
+	case 200: return "OK";
+	case 201: return "Created";
+	case 204: return "No Content";
+	case 301: return "Moved Permanently";
+	case 302: return "Found";
+	case 304: return "Not Modified";
+	case 400: return "Bad Request";
+	case 401: return "Unauthorized";
+	case 403: return "Forbidden";
+	case 404: return "Not Found";
+	case 409: return "Conflict";
+	case 429: return "Too Many Requests";
+	case 502: return "Bad Gateway";
+	case 503: return "Service Unavailable";
+	case 504: return "Gateway Timeout";
+		}
+	return (status >= 500 ? "Internal Server Error" : "Unknown");
+	}
+
+/*
+** Run the handler and serialize its reply into wire. A nonzero
+** return from the handler discards whatever it wrote and sends 500.
+*/
+void native_run(struct native_entry *entry, GUSHER_REQ *req, RBUF *wire) {
+	GUSHER_RESP resp;
+	struct native_out out;
+	char line[128];
+	int res;
+	resp.status = 200;
+	strcpy(resp.content_type, "text/plain");
+	rbuf_init(&out.body, 4096);
+	rbuf_init(&out.headers, 256);
+	resp.priv = &out;
+	__sync_fetch_and_add(&entry->calls, 1);
+	res = entry->handler(req, &resp, &api);
+	if (res != 0) {
+		__sync_fetch_and_add(&entry->errors, 1);
+		log_msg("native handler for %s failed (%d)\n", entry->path, res);
+		out.body.len = 0;
+		out.headers.len = 0;
+		resp.status = 500;
+		strcpy(resp.content_type, "text/plain");
+		rbuf_puts(&out.body, "Internal Server Error");
+		}
+	resp.content_type[sizeof(resp.content_type) - 1] = '\0';
+	rbuf_init(wire, out.headers.len + out.body.len + 256);
+	snprintf(line, sizeof(line), "HTTP/1.1 %d %s\r\n", resp.status,
+			reason(resp.status));
+	rbuf_puts(wire, line);
+	rbuf_puts(wire, "content-type: ");
+	rbuf_puts(wire, resp.content_type);
+	rbuf_put(wire, "\r\n", 2);
+	rbuf_put(wire, out.headers.data, out.headers.len);
+	snprintf(line, sizeof(line), "content-length: %lu\r\n\r\n",
+			(unsigned long)out.body.len);
+	rbuf_puts(wire, line);
+	if (strcmp(req->method, "HEAD") != 0)
+		rbuf_put(wire, out.body.data, out.body.len);
+	rbuf_free(&out.body);
+	rbuf_free(&out.headers);
+	}
+
+static SCM http_native(SCM path, SCM object, SCM symbol) {
+	struct native_entry *entry;
+	char *so, *sym;
+	const int *abi;
+	void *dl, *fn;
+	so = scm_to_locale_string(object);
+	sym = scm_to_locale_string(symbol);
+	scm_remember_upto_here_2(object, symbol);
+	if ((dl = dlopen(so, RTLD_NOW | RTLD_LOCAL)) == NULL) {
+		log_msg("http-native: %s\n", dlerror());
+		free(so);
+		free(sym);
+		return SCM_BOOL_F;
+		}
+	abi = (const int *)dlsym(dl, "gusher_abi");
+	fn = dlsym(dl, sym);
+	if ((fn == NULL) || ((abi != NULL) && (*abi > GUSHER_ABI))) {
+		if (fn == NULL) log_msg("http-native: no %s in %s\n", sym, so);
+		else log_msg("http-native: %s wants ABI %d, have %d\n",
+				so, *abi, GUSHER_ABI);
+		dlclose(dl);
+		free(so);
+		free(sym);
+		return SCM_BOOL_F;
+		}
+	entry = (struct native_entry *)malloc(sizeof(struct native_entry));
+	entry->path = scm_to_bytes_dup(path);
+	entry->plen = strlen(entry->path);
+	*(void **)(&entry->handler) = fn;
+	entry->dl = dl;
+	entry->calls = 0;
+	entry->errors = 0;
+	entry->link = natives;
+	log_msg("native handler %s:%s on %s\n", so, sym, entry->path);
+	free(so);
+	free(sym);
+	natives = entry; // newest shadows any older entry for the path
+	scm_remember_upto_here_1(path);
+	return SCM_BOOL_T;
+	}
+
+static SCM native_stats(void) {
+	struct native_entry *entry;
+	SCM stats;
+	stats = SCM_EOL;
+	for (entry = natives; entry != NULL; entry = entry->link) {
+		stats = scm_acons(scm_from_locale_string(entry->path),
+				scm_cons(scm_from_ulong(entry->calls),
+					scm_from_ulong(entry->errors)), stats);
+		}
+	scm_remember_upto_here_1(stats);
+	return stats;
+	}
+
+void init_native(void) {
+	scm_c_define_gsubr("http-native", 3, 0, 0, http_native);
+	scm_c_define_gsubr("native-stats", 0, 0, 0, native_stats);
+	}
@@ -0,0 +1,28 @@
+/*
+** Copyright (c) 2013 Peter Yadlowsky <pmy@virginia.edu>
+**
+** This program is free software ; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation ; either version 3 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY ; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program ; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+#define NATIVE_MAX_HEADERS 64
+#define NATIVE_MAX_BODY (16 * 1024 * 1024)
+
+struct gusher_req;
+struct rbuf;
+struct native_entry;
+
+void init_native(void);
+struct native_entry *native_match(const char *, const char **);
+void native_run(struct native_entry *, struct gusher_req *, struct rbuf *);
@@ -0,0 +1,370 @@
+/*
+** Copyright (c) 2013 Peter Yadlowsky <pmy@virginia.edu>
+**
+** This program is free software ; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation ; either version 3 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY ; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program ; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+/*
+** Fan-out: parallel and par-map hand their calls to a shared pool of
+** Guile threads and wait for all of them, up to the timeout or the
+** request's own deadline if that comes first. The first error
+** cancels whatever hasn't started and is rethrown in the caller; so
+** is a missed deadline.
+**
+** Pool threads run each task in a copy of the caller's dynamic state
+** (fluids, parameters) and carry its trace ID and watchdog scope, so
+** http-get timeouts there end with the fan-out's deadline and pg
+** queries are cancelled when it passes or the request overruns.
+** Their CPU and I/O time is charged to the request, and thunks they
+** hand to after-response join the request's own; those from a task
+** still running when the fan-out gives up are dropped and logged.
+** A fan-out made from inside a pool task works through its own
+** unclaimed tasks while it waits, so nesting can't deadlock the pool;
+** it starts none past the deadline, but the timeout can't cut short a
+** task it is already running.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <libguile.h>
+
+#include "log.h"
+#include "deferred.h"
+#include "trace.h"
+#include "usage.h"
+#include "watchdog.h"
+#include "par.h"
+
+#define DEFAULT_PAR_THREADS 8
+#define DEFAULT_PAR_TIMEOUT 30.0
+
+struct batch;
+
+typedef struct task {
+	struct batch *batch;
+	size_t index;
+	int claimed;
+	SCM proc;
+	SCM arg; // SCM_UNDEFINED for a thunk
+	SCM state; // caller's dynamic state, copied
+	SCM result;
+	SCM thunks; // its after-response thunks
+	struct task *next;
+	} TASK;
+
+typedef struct batch {
+	size_t remaining;
+	int cancelled;
+	SCM results;
+	SCM err_key;
+	SCM err_args;
+	SCM thunks; // tasks' after-response thunks, for the caller
+	TASK **tasks;
+	TRACE_CONTEXT trace;
+	WATCH_SCOPE *watch;
+	USAGE_WORK work; // done on pool threads
+	} BATCH;
+
+static TASK *queue_head = NULL;
+static TASK *queue_tail = NULL;
+static int nthreads = 0;
+static int max_threads = DEFAULT_PAR_THREADS;
+static double default_timeout = DEFAULT_PAR_TIMEOUT;
+static SCM par_mutex;
+static SCM work_condvar;
+static SCM done_condvar;
+static SCM timeout_sym;
+static unsigned long calls = 0, tasks_run = 0, inline_run = 0;
+static unsigned long errors = 0, timeouts = 0;
+static __thread int in_pool = 0;
+
+static SCM task_body(void *data) {
+	TASK *task = (TASK *)data;
+	if (task->arg == SCM_UNDEFINED) return scm_call_0(task->proc);
+	return scm_call_1(task->proc, task->arg);
+	}
+
+static SCM task_error(void *data, SCM key, SCM args) {
+	TASK *task = (TASK *)data;
+	scm_lock_mutex(par_mutex);
+	if (task->batch->err_key == SCM_BOOL_F) {
+		task->batch->err_key = key;
+		task->batch->err_args = args;
+		}
+	task->batch->cancelled = 1;
+	scm_unlock_mutex(par_mutex);
+	return SCM_UNSPECIFIED;
+	}
+
+static void *catch_task(void *data) {
+	TASK *task = (TASK *)data;
+	task->result = scm_c_catch(SCM_BOOL_T, task_body, (void *)task,
+				task_error, (void *)task, NULL, NULL);
+	return NULL;
+	}
+
+static void *pooled_task(void *data) {
+	TASK *task = (TASK *)data;
+	deferred_task_begin();
+	catch_task(data);
+	task->thunks = deferred_task_end();
+	return NULL;
+	}
+
+static void run_task(TASK *task, int pooled) {
+	USAGE_WORK work;
+	WATCH_SCOPE *watch;
+	SCM thunks;
+	int i;
+	watch = watch_carry(task->batch->watch);
+	if (pooled) {
+		memset(&work, 0, sizeof(work));
+		usage_begin();
+		trace_carry(&task->batch->trace);
+		scm_c_with_dynamic_state(task->state, pooled_task, (void *)task);
+		trace_carry(NULL);
+		usage_take(&work);
+		}
+	else catch_task((void *)task);
+	watch_carry(watch);
+	thunks = SCM_BOOL_F;
+	scm_lock_mutex(par_mutex);
+	if (pooled) {
+		task->batch->work.cpu_ns += work.cpu_ns;
+		for (i = 0; i < USAGE_KINDS; i++) {
+			task->batch->work.io_count[i] += work.io_count[i];
+			task->batch->work.io_ns[i] += work.io_ns[i];
+			}
+		}
+	if (!task->batch->cancelled) {
+		scm_c_vector_set_x(task->batch->results, task->index,
+				task->result);
+		if (scm_is_pair(task->thunks))
+			task->batch->thunks = scm_append(scm_list_2(task->thunks,
+					task->batch->thunks));
+		}
+	else thunks = task->thunks;
+	task->batch->remaining--;
+	tasks_run++;
+	scm_broadcast_condition_variable(done_condvar);
+	scm_unlock_mutex(par_mutex);
+	deferred_drop(thunks);
+	scm_remember_upto_here_1(thunks);
+	}
+
+// caller holds par_mutex
+static TASK *next_task(void) {
+	TASK *task;
+	while ((task = queue_head) != NULL) {
+		queue_head = task->next;
+		if (queue_head == NULL) queue_tail = NULL;
+		if (task->claimed) continue;
+		if (task->batch->cancelled) {
+			task->claimed = 1;
+			task->batch->remaining--;
+			scm_broadcast_condition_variable(done_condvar);
+			continue;
+			}
+		task->claimed = 1;
+		return task;
+		}
+	return NULL;
+	}
+
+static SCM par_worker(void *data) {
+	TASK *task;
+	in_pool = 1;
+	while (1) {
+		scm_lock_mutex(par_mutex);
+		while ((task = next_task()) == NULL)
+			scm_wait_condition_variable(work_condvar, par_mutex);
+		scm_unlock_mutex(par_mutex);
+		run_task(task, 1);
+		}
+	return SCM_BOOL_T;
+	}
+
+static int expired_at(SCM deadline) {
+	struct timeval now;
+	long sec;
+	gettimeofday(&now, NULL);
+	sec = scm_to_long(SCM_CAR(deadline));
+	return ((now.tv_sec > sec) || ((now.tv_sec == sec) &&
+			(now.tv_usec >= scm_to_long(SCM_CDR(deadline)))));
+	}
+
+static SCM make_deadline(double timeout) {
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	now.tv_sec += (time_t)timeout;
+	now.tv_usec += (long)((timeout - (time_t)timeout) * 1000000);
+	if (now.tv_usec >= 1000000) {
+		now.tv_sec++;
+		now.tv_usec -= 1000000;
+		}
+	return scm_cons(scm_from_long(now.tv_sec), scm_from_long(now.tv_usec));
+	}
+
+static SCM fan_out(SCM procs, SCM args, SCM timeout) {
+	BATCH *batch;
+	TASK *task;
+	SCM deadline, node, anode;
+	size_t n, i;
+	int expired;
+	double secs, left;
+	n = scm_to_size_t(scm_length(procs));
+	if (n == 0) return SCM_EOL;
+	secs = (timeout == SCM_UNDEFINED ? default_timeout :
+				scm_to_double(timeout));
+	if (((left = watch_remaining()) > 0) && (left < secs)) secs = left;
+	batch = (BATCH *)scm_gc_malloc(sizeof(BATCH), "par-batch");
+	batch->remaining = n;
+	batch->cancelled = 0;
+	batch->results = scm_c_make_vector(n, SCM_BOOL_F);
+	batch->err_key = SCM_BOOL_F;
+	batch->err_args = SCM_EOL;
+	batch->thunks = SCM_EOL;
+	batch->tasks = (TASK **)scm_gc_malloc(sizeof(TASK *) * n, "par-tasks");
+	trace_save(&batch->trace);
+	batch->watch = watch_scope(secs);
+	memset(&batch->work, 0, sizeof(batch->work));
+	node = procs;
+	anode = args;
+	for (i = 0; i < n; i++) {
+		task = (TASK *)scm_gc_malloc(sizeof(TASK), "par-task");
+		batch->tasks[i] = task;
+		task->batch = batch;
+		task->index = i;
+		task->claimed = 0;
+		task->proc = SCM_CAR(node);
+		node = SCM_CDR(node);
+		if (anode == SCM_UNDEFINED) task->arg = SCM_UNDEFINED;
+		else {
+			task->arg = SCM_CAR(anode);
+			anode = SCM_CDR(anode);
+			}
+		task->state = scm_make_dynamic_state(SCM_UNDEFINED);
+		task->result = SCM_BOOL_F;
+		task->thunks = SCM_BOOL_F;
+		task->next = NULL;
+		}
+	deadline = make_deadline(secs);
+	scm_lock_mutex(par_mutex);
+	calls++;
+	while (nthreads < max_threads) {
+		nthreads++;
+		scm_spawn_thread(par_worker, NULL, NULL, NULL);
+		}
+	for (i = 0; i < n; i++) {
+		task = batch->tasks[i];
+		if (queue_tail == NULL) queue_head = task;
+		else queue_tail->next = task;
+		queue_tail = task;
+		}
+	scm_broadcast_condition_variable(work_condvar);
+	expired = 0;
+	// nested: the pool may be full of our own callers
+	for (i = 0; in_pool && (i < n) && !batch->cancelled; i++) {
+		task = batch->tasks[i];
+		if (task->claimed) continue;
+		if (expired_at(deadline)) break;
+		task->claimed = 1;
+		inline_run++;
+		scm_unlock_mutex(par_mutex);
+		run_task(task, 0);
+		scm_lock_mutex(par_mutex);
+		}
+	while ((batch->remaining > 0) && !batch->cancelled) {
+		if (scm_timed_wait_condition_variable(done_condvar, par_mutex,
+				deadline) == SCM_BOOL_F) {
+			expired = (batch->remaining > 0);
+			break;
+			}
+		}
+	batch->cancelled = 1;
+	if (expired) timeouts++;
+	else if (batch->err_key != SCM_BOOL_F) errors++;
+	usage_charge(&batch->work);
+	scm_unlock_mutex(par_mutex);
+	if (expired || (batch->err_key != SCM_BOOL_F))
+		watch_expire(batch->watch);
+	deferred_adopt(batch->thunks);
+	scm_remember_upto_here_2(procs, args);
+	scm_remember_upto_here_2(deadline, timeout);
+	if (batch->err_key != SCM_BOOL_F)
+		scm_throw(batch->err_key, batch->err_args);
+	if (expired)
+		scm_throw(timeout_sym, scm_list_1(scm_from_double(secs)));
+	return scm_vector_to_list(batch->results);
+	}
+
+static SCM par_map(SCM proc, SCM list, SCM timeout) {
+	SCM procs;
+	procs = scm_make_list(scm_length(list), proc);
+	return fan_out(procs, list, timeout);
+	}
+
+static SCM parallel(SCM thunks) {
+	return fan_out(thunks, SCM_UNDEFINED, SCM_UNDEFINED);
+	}
+
+static SCM parallel_timeout(SCM timeout, SCM thunks) {
+	return fan_out(thunks, SCM_UNDEFINED, timeout);
+	}
+
+static SCM par_pool(SCM threads, SCM timeout) {
+	scm_lock_mutex(par_mutex);
+	max_threads = scm_to_int(threads);
+	if (timeout != SCM_UNDEFINED) default_timeout = scm_to_double(timeout);
+	scm_unlock_mutex(par_mutex);
+	scm_remember_upto_here_2(threads, timeout);
+	return SCM_UNSPECIFIED;
+	}
+
+static SCM par_stats(void) {
+	SCM stats;
+	scm_lock_mutex(par_mutex);
+	stats = SCM_EOL;
+	stats = scm_acons(scm_from_locale_symbol("threads"),
+			scm_from_int(nthreads), stats);
+	stats = scm_acons(scm_from_locale_symbol("timeouts"),
+			scm_from_ulong(timeouts), stats);
+	stats = scm_acons(scm_from_locale_symbol("errors"),
+			scm_from_ulong(errors), stats);
+	stats = scm_acons(scm_from_locale_symbol("inline"),
+			scm_from_ulong(inline_run), stats);
+	stats = scm_acons(scm_from_locale_symbol("tasks"),
+			scm_from_ulong(tasks_run), stats);
+	stats = scm_acons(scm_from_locale_symbol("calls"),
+			scm_from_ulong(calls), stats);
+	scm_unlock_mutex(par_mutex);
+	scm_remember_upto_here_1(stats);
+	return stats;
+	}
+
+void init_par(void) {
+	scm_permanent_object(par_mutex = scm_make_mutex());
+	scm_permanent_object(work_condvar = scm_make_condition_variable());
+	scm_permanent_object(done_condvar = scm_make_condition_variable());
+	scm_permanent_object(timeout_sym =
+			scm_from_locale_symbol("par-timeout"));
+	scm_c_define_gsubr("parallel", 0, 0, 1, parallel);
+	scm_c_define_gsubr("parallel-timeout", 1, 0, 1, parallel_timeout);
+	scm_c_define_gsubr("par-map", 2, 1, 0, par_map);
+	scm_c_define_gsubr("par-pool", 1, 1, 0, par_pool);
+	scm_c_define_gsubr("par-stats", 0, 0, 0, par_stats);
+	}
@@ -0,0 +1,63 @@
+/*
+** Copyright (c) 2013 Peter Yadlowsky <pmy@virginia.edu>
+**
+** This program is free software ; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation ; either version 3 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY ; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program ; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+/*
+** Parking: blocking calls (pg queries, curl transfers, snooze) drop
+** out of Guile mode for their duration, so a thread waiting on the
+** network neither holds up the collector nor counts against the
+** worker limit. The dispatcher spawns more threads while others
+** are parked, up to max-threads runnable plus max-parked waiting.
+*/
+
+#include <libguile.h>
+
+static volatile int parked = 0;
+static volatile int parked_peak = 0;
+static volatile unsigned long parks = 0;
+
+void *park(void *(*func)(void *), void *data) {
+	void *res;
+	int now;
+	now = __sync_add_and_fetch(&parked, 1);
+	if (now > parked_peak) parked_peak = now;
+	__sync_fetch_and_add(&parks, 1);
+	res = scm_without_guile(func, data);
+	__sync_fetch_and_sub(&parked, 1);
+	return res;
+	}
+
+int parked_threads(void) {
+	return parked;
+	}
+
+static SCM park_stats(void) {
+	SCM stats;
+	stats = SCM_EOL;
+	stats = scm_acons(scm_from_locale_symbol("parks"),
+			scm_from_ulong(parks), stats);
+	stats = scm_acons(scm_from_locale_symbol("peak"),
+			scm_from_int(parked_peak), stats);
+	stats = scm_acons(scm_from_locale_symbol("parked"),
+			scm_from_int(parked), stats);
+	scm_remember_upto_here_1(stats);
+	return stats;
+	}
+
+void init_park(void) {
+	scm_c_define_gsubr("park-stats", 0, 0, 0, park_stats);
+	}
@@ -24,8 +24,13 @@
 #include "gtime.h"
 #include "log.h"
 #include "butter.h"
+#include "park.h"
+#include "watchdog.h"
+#include "trace.h"
+#include "usage.h"
+#include "bytes.h"
 
-#define c2s(a) (scm_from_locale_string(a))
+#define c2s(a) (scm_from_utf8_string(a))
 
 struct pg_conn {
 	PGconn *conn;
@@ -46,6 +51,20 @@ struct pg_res {
 static scm_t_bits pg_conn_tag;
 static scm_t_bits pg_res_tag;
 
+struct pg_call {
+	PGconn *conn;
+	const char *query;
+	};
+
+static void *connect_parked(void *data) {
+	return PQconnectdb((const char *)data);
+	}
+
+static void *exec_parked(void *data) {
+	struct pg_call *call = (struct pg_call *)data;
+	return PQexec(call->conn, call->query);
+	}
+
 static SCM pg_open_primitive(SCM conninfo) {
 	SCM smob;
 	struct pg_conn *pgc;
@@ -53,7 +72,7 @@ static SCM pg_open_primitive(SCM conninfo) {
 	conninfo_s = scm_to_locale_string(conninfo);
 	pgc = (struct pg_conn *)scm_gc_malloc(sizeof(struct pg_conn),
 					"pg_conn");
-	pgc->conn = PQconnectdb(conninfo_s);
+	pgc->conn = (PGconn *)park(connect_parked, conninfo_s);
 	free(conninfo_s);
 	if (PQstatus(pgc->conn) != CONNECTION_OK) {
 		log_msg("PQ connection failed: %s\n",
@@ -77,43 +96,66 @@ static SCM pg_close(SCM conn) {
 	return SCM_UNSPECIFIED;
 	}
 
-static SCM pg_exec(SCM conn, SCM query) {
-	struct pg_conn *pgc;
+/*
+** Wrap a PGresult for Scheme; the smob owns it from here on. Not
+** static so bench/gusherbench.c can wrap results it builds itself.
+*/
+SCM pg_result_smob(PGresult *res) {
 	struct pg_res *pgr;
-	char *query_s;
-	int i;
 	SCM res_smob;
-	scm_assert_smob_type(pg_conn_tag, conn);
-	pgc = (struct pg_conn *)SCM_SMOB_DATA(conn);
+	int i;
 	pgr = (struct pg_res *)scm_gc_malloc(sizeof(struct pg_res),
 					"pg_res");
-	query_s = scm_to_utf8_string(query);
-	scm_lock_mutex(pgc->mutex);
-	pgr->res = PQexec(pgc->conn, query_s);
-	scm_unlock_mutex(pgc->mutex);
+	pgr->res = res;
 	pgr->cursor = 0;
 	pgr->fields = SCM_EOL;
 	pgr->types = SCM_EOL;
-	pgr->nfields = PQnfields(pgr->res);
-	pgr->tuples = PQntuples(pgr->res);
-	pgr->cmd_tuples = atoi(PQcmdTuples(pgr->res));
-	pgr->status = PQresultStatus(pgr->res);
-	if ((pgr->status == PGRES_FATAL_ERROR) ||
-			(pgr->status == PGRES_NONFATAL_ERROR)) {
-		log_msg("PQquery: %s\n", query_s);
-		log_msg("PQerr: %s", PQresultErrorMessage(pgr->res));
-		}
-	free(query_s);
+	pgr->nfields = PQnfields(res);
+	pgr->tuples = PQntuples(res);
+	pgr->cmd_tuples = atoi(PQcmdTuples(res));
+	pgr->status = PQresultStatus(res);
 	for (i = pgr->nfields - 1; i >= 0; i--) {
 		pgr->fields = scm_cons(scm_from_utf8_symbol(
-			PQfname(pgr->res, i)), pgr->fields);
-		pgr->types = scm_cons(scm_from_unsigned_integer(PQftype(pgr->res, i)),
+			PQfname(res, i)), pgr->fields);
+		pgr->types = scm_cons(scm_from_unsigned_integer(PQftype(res, i)),
 				pgr->types);
 		}
 	SCM_NEWSMOB(res_smob, pg_res_tag, pgr);
 	return res_smob;
 	}
 
+static SCM pg_exec(SCM conn, SCM query) {
+	struct pg_conn *pgc;
+	struct pg_call call;
+	PGcancel *cancel;
+	PGresult *res;
+	char *query_s;
+	int span;
+	unsigned long io;
+	scm_assert_smob_type(pg_conn_tag, conn);
+	pgc = (struct pg_conn *)SCM_SMOB_DATA(conn);
+	query_s = scm_to_utf8_string(query);
+	span = trace_span_begin("pg", query_s);
+	io = usage_io_begin();
+	scm_lock_mutex(pgc->mutex);
+	call.conn = pgc->conn;
+	call.query = query_s;
+	cancel = (call.conn != NULL ? PQgetCancel(call.conn) : NULL);
+	watch_query(cancel);
+	res = (PGresult *)park(exec_parked, &call);
+	if (watch_query(NULL) && (cancel != NULL)) PQfreeCancel(cancel);
+	scm_unlock_mutex(pgc->mutex);
+	usage_io_end(USAGE_PG, io);
+	trace_span_end(span);
+	if ((PQresultStatus(res) == PGRES_FATAL_ERROR) ||
+			(PQresultStatus(res) == PGRES_NONFATAL_ERROR)) {
+		log_msg("PQquery: %s\n", query_s);
+		log_msg("PQerr: %s", PQresultErrorMessage(res));
+		}
+	free(query_s);
+	return pg_result_smob(res);
+	}
+
 static SCM pg_error_msg(SCM res) {
 	struct pg_res *pgr;
 	scm_assert_smob_type(pg_res_tag, res);
@@ -151,7 +193,10 @@ static SCM decode_timestamp(const char *string) {
 	}
 
 static SCM decode_ts(SCM ts) {
-	return decode_timestamp(scm_to_locale_string(ts));
+	char buf[64];
+	scm_to_bytes(ts, buf, sizeof(buf));
+	scm_remember_upto_here_1(ts);
+	return decode_timestamp(buf);
 	}
 
 static SCM pg_decode(char *string, int dtype) {
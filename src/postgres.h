@@ -16,4 +16,8 @@
 ** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
 */
 
+#include <libguile.h>
+#include <libpq-fe.h>
+
+SCM pg_result_smob(PGresult *);
 void init_postgres(void);
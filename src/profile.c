@@ -0,0 +1,309 @@
+/*
+** Copyright (c) 2013 Peter Yadlowsky <pmy@virginia.edu>
+**
+** This program is free software ; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation ; either version 3 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY ; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program ; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+/*
+** Sampling profiler. For a set number of seconds a sampler thread
+** asks every thread that is running a request for its stack, through
+** a system async. The async runs at the thread's next safe point,
+** walks the Scheme stack and counts it as one folded line
+** (outermost;...;innermost), the form flamegraph.pl reads.
+**
+** Only Scheme code reaches safe points, so this sees no native
+** frames: a thread inside a C primitive (json-encode, fill-template,
+** pg decoding) or a blocking call (parked) takes the sample when the
+** primitive returns. Samples that arrive more than two intervals
+** late are counted as off-CPU: dropped in cpu mode, kept in wall mode
+** with a [blocked] leaf. Shorter stalls are charged to the caller.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <libguile.h>
+
+#include "log.h"
+#include "reply.h"
+#include "bytes.h"
+#include "gtime.h"
+#include "watchdog.h"
+#include "profile.h"
+
+enum { MODE_CPU, MODE_WALL };
+
+struct target {
+	SCM thread;
+	unsigned long asked;
+	int pending;
+	};
+
+typedef struct folded {
+	char *stack;
+	unsigned long count;
+	struct folded *next;
+	} FOLDED;
+
+static struct target targets[PROFILE_THREADS];
+static int ntargets = 0;
+static FOLDED *buckets[PROFILE_BUCKETS];
+static SCM pmutex;
+static SCM sample_thunk;
+static SCM wall_sym;
+static volatile int running = 0;
+static int mode = MODE_CPU;
+static unsigned long interval_ns;
+static unsigned long until_ns;
+static unsigned long samples = 0, offcpu = 0, dropped = 0, stacks = 0;
+
+static unsigned int hash_str(const char *src) {
+	unsigned int hash;
+	for (hash = 5381; *src; src++) hash = hash * 33 + (unsigned char)*src;
+	return hash;
+	}
+
+static void count_stack(const char *stack) {
+	FOLDED *node;
+	unsigned int slot;
+	slot = hash_str(stack) % PROFILE_BUCKETS;
+	for (node = buckets[slot]; node != NULL; node = node->next) {
+		if (strcmp(node->stack, stack) == 0) break;
+		}
+	if (node == NULL) {
+		node = (FOLDED *)malloc(sizeof(FOLDED));
+		node->stack = strdup(stack);
+		node->count = 0;
+		node->next = buckets[slot];
+		buckets[slot] = node;
+		stacks++;
+		}
+	node->count++;
+	}
+
+static void clear_stacks(void) {
+	FOLDED *node, *next;
+	int i;
+	for (i = 0; i < PROFILE_BUCKETS; i++) {
+		for (node = buckets[i]; node != NULL; node = next) {
+			next = node->next;
+			free(node->stack);
+			free(node);
+			}
+		buckets[i] = NULL;
+		}
+	stacks = 0;
+	}
+
+static void frame_name(SCM frame, char *buf, size_t size) {
+	SCM proc, name;
+	proc = scm_frame_procedure(frame);
+	name = (scm_is_true(scm_procedure_p(proc)) ?
+			scm_procedure_name(proc) : SCM_BOOL_F);
+	if (scm_is_symbol(name))
+		scm_to_bytes(scm_symbol_to_string(name), buf, size);
+	else strcpy(buf, "?");
+	scm_remember_upto_here_2(proc, name);
+	}
+
+/*
+** Runs in the sampled thread.
+*/
+static SCM take_sample(void) {
+	SCM self, stack;
+	char line[4096], name[128];
+	size_t used, n;
+	unsigned long late;
+	int i, depth, first;
+	self = scm_current_thread();
+	late = 0;
+	scm_lock_mutex(pmutex);
+	for (i = 0; i < ntargets; i++) {
+		if (scm_is_eq(targets[i].thread, self)) {
+			late = now_ns() - targets[i].asked;
+			targets[i].pending = 0;
+			break;
+			}
+		}
+	scm_unlock_mutex(pmutex);
+	if (!running) return SCM_UNSPECIFIED;
+	if ((late > 2 * interval_ns) && (mode == MODE_CPU)) {
+		__sync_fetch_and_add(&dropped, 1);
+		return SCM_UNSPECIFIED;
+		}
+	stack = scm_make_stack(SCM_BOOL_T, scm_list_1(sample_thunk));
+	if (scm_is_false(stack)) return SCM_UNSPECIFIED;
+	depth = scm_to_int(scm_stack_length(stack));
+	used = 0;
+	first = 1;
+	line[0] = '\0';
+	// the innermost PROFILE_DEPTH frames, outermost first
+	for (i = (depth > PROFILE_DEPTH ? PROFILE_DEPTH : depth) - 1;
+			i >= 0; i--) {
+		frame_name(scm_stack_ref(stack, scm_from_int(i)), name,
+				sizeof(name));
+		n = strlen(name);
+		if (used + n + 2 >= sizeof(line)) break;
+		if (!first) line[used++] = ';';
+		memcpy(line + used, name, n);
+		used += n;
+		first = 0;
+		}
+	line[used] = '\0';
+	if (late > 2 * interval_ns) {
+		if (used + 11 < sizeof(line))
+			strcpy(line + used, (first ? "[blocked]" : ";[blocked]"));
+		__sync_fetch_and_add(&offcpu, 1);
+		}
+	else if (first) strcpy(line, "[no scheme frames]");
+	scm_lock_mutex(pmutex);
+	if (running) count_stack(line);
+	samples++;
+	scm_unlock_mutex(pmutex);
+	scm_remember_upto_here_2(self, stack);
+	return SCM_UNSPECIFIED;
+	}
+
+static void tick(void) {
+	SCM threads[PROFILE_THREADS];
+	unsigned long now;
+	int n, i, j;
+	n = watch_threads(threads, PROFILE_THREADS);
+	now = now_ns();
+	scm_lock_mutex(pmutex);
+	for (i = 0; i < n; i++) {
+		for (j = 0; j < ntargets; j++)
+			if (scm_is_eq(targets[j].thread, threads[i])) break;
+		if (j == ntargets) {
+			if (ntargets >= PROFILE_THREADS) continue;
+			targets[ntargets].thread = threads[i];
+			targets[ntargets].pending = 0;
+			ntargets++;
+			}
+		if (targets[j].pending) continue;
+		targets[j].pending = 1;
+		targets[j].asked = now;
+		scm_system_async_mark_for_thread(sample_thunk, threads[i]);
+		}
+	scm_unlock_mutex(pmutex);
+	}
+
+static SCM sampler(void *data) {
+	while (running && (now_ns() < until_ns)) {
+		usleep(interval_ns / 1000);
+		tick();
+		}
+	running = 0;
+	log_msg("profile done: %lu samples\n", samples);
+	return SCM_BOOL_T;
+	}
+
+/*
+** (profile-start secs [interval-ms] ['cpu|'wall])
+*/
+static SCM profile_start(SCM secs, SCM intvl, SCM smode) {
+	double ms, dsecs;
+	int wall;
+	// nothing may throw once pmutex is held
+	SCM_ASSERT(scm_is_real(secs), secs, SCM_ARG1, "profile-start");
+	dsecs = scm_to_double(secs);
+	if (dsecs < 0) dsecs = 0;
+	ms = (scm_is_real(intvl) ? scm_to_double(intvl) :
+			DEFAULT_PROFILE_INTVL_MS);
+	if (ms < 1) ms = 1;
+	wall = scm_is_eq(smode, wall_sym);
+	scm_lock_mutex(pmutex);
+	if (running) {
+		scm_unlock_mutex(pmutex);
+		return SCM_BOOL_F;
+		}
+	clear_stacks();
+	memset(targets, 0, sizeof(targets));
+	ntargets = 0;
+	samples = offcpu = dropped = 0;
+	interval_ns = (unsigned long)(ms * 1e6);
+	until_ns = now_ns() + (unsigned long)(dsecs * 1e9);
+	mode = (wall ? MODE_WALL : MODE_CPU);
+	running = 1;
+	scm_unlock_mutex(pmutex);
+	scm_spawn_thread(sampler, NULL, NULL, NULL);
+	scm_remember_upto_here_2(secs, intvl);
+	scm_remember_upto_here_1(smode);
+	return SCM_BOOL_T;
+	}
+
+static SCM profile_stop(void) {
+	running = 0;
+	return SCM_UNSPECIFIED;
+	}
+
+/*
+** Folded stacks, one "frame;frame;... count" line each.
+*/
+static SCM profile_report(void) {
+	FOLDED *node;
+	RBUF out;
+	char num[32];
+	SCM report;
+	int i;
+	rbuf_init(&out, 4096);
+	scm_lock_mutex(pmutex);
+	for (i = 0; i < PROFILE_BUCKETS; i++) {
+		for (node = buckets[i]; node != NULL; node = node->next) {
+			rbuf_puts(&out, node->stack);
+			snprintf(num, sizeof(num), " %lu\n", node->count);
+			rbuf_puts(&out, num);
+			}
+		}
+	scm_unlock_mutex(pmutex);
+	report = scm_from_utf8_stringn(out.data, out.len);
+	rbuf_free(&out);
+	scm_remember_upto_here_1(report);
+	return report;
+	}
+
+static SCM profile_stats(void) {
+	SCM stats;
+	stats = SCM_EOL;
+	stats = scm_acons(scm_from_latin1_symbol("threads"),
+			scm_from_int(ntargets), stats);
+	stats = scm_acons(scm_from_latin1_symbol("stacks"),
+			scm_from_ulong(stacks), stats);
+	stats = scm_acons(scm_from_latin1_symbol("dropped"),
+			scm_from_ulong(dropped), stats);
+	stats = scm_acons(scm_from_latin1_symbol("off-cpu"),
+			scm_from_ulong(offcpu), stats);
+	stats = scm_acons(scm_from_latin1_symbol("samples"),
+			scm_from_ulong(samples), stats);
+	stats = scm_acons(scm_from_latin1_symbol("mode"),
+			(mode == MODE_WALL ? wall_sym :
+				scm_from_latin1_symbol("cpu")), stats);
+	stats = scm_acons(scm_from_latin1_symbol("running"),
+			scm_from_bool(running), stats);
+	scm_remember_upto_here_1(stats);
+	return stats;
+	}
+
+void init_profile(void) {
+	scm_permanent_object(pmutex = scm_make_mutex());
+	scm_permanent_object(sample_thunk = scm_c_make_gsubr("profile-sample",
+			0, 0, 0, take_sample));
+	scm_permanent_object(wall_sym = scm_from_latin1_symbol("wall"));
+	scm_c_define_gsubr("profile-start", 1, 2, 0, profile_start);
+	scm_c_define_gsubr("profile-stop", 0, 0, 0, profile_stop);
+	scm_c_define_gsubr("profile-report", 0, 0, 0, profile_report);
+	scm_c_define_gsubr("profile-stats", 0, 0, 0, profile_stats);
+	}
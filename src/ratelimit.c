@@ -0,0 +1,279 @@
+/*
+** Copyright (c) 2013 Peter Yadlowsky <pmy@virginia.edu>
+**
+** This program is free software ; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation ; either version 3 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY ; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program ; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+/*
+** Token-bucket rate limiting, checked before a request is queued.
+** Each rule covers a path prefix and keys clients by address,
+** X-Forwarded-For or session cookie. Buckets live in a fixed
+** open-addressed table per rule; a slot's token count and refill
+** time share one 64-bit word updated by compare-and-swap, so the
+** I/O thread and workers can check concurrently without a lock.
+** Slots whose bucket has refilled completely are free for reuse,
+** which is all the expiry there is.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <libguile.h>
+
+#include "log.h"
+#include "butter.h"
+#include "gtime.h"
+#include "ratelimit.h"
+
+#define RL_SLOTS 65536 // per rule, power of two
+#define RL_PROBE 8
+#define RL_SCALE 256 // tokens are counted in 1/256ths
+#define RL_TOKEN_BITS 24
+#define RL_TOKEN_MASK ((1ULL << RL_TOKEN_BITS) - 1)
+#define COOKIE_KEY "GUSHERID"
+
+enum { KEY_IP, KEY_FORWARDED, KEY_SESSION };
+
+typedef struct slot {
+	volatile uint64_t key;
+	volatile uint64_t state; // ms << 24 | tokens * RL_SCALE
+	} SLOT;
+
+typedef struct rule {
+	char *prefix;
+	size_t plen;
+	double rate; // tokens per second
+	uint64_t burst; // scaled
+	int keyed;
+	SLOT *slots;
+	unsigned long allowed;
+	unsigned long rejected;
+	unsigned long evicted;
+	struct rule *link;
+	} RULE;
+
+static RULE *rules = NULL;
+static int header_keyed = 0;
+
+static RULE *match_rule(const char *line) {
+	RULE *rule, *best;
+	const char *path;
+	size_t n;
+	if ((line == NULL) || ((path = strchr(line, ' ')) == NULL))
+		return NULL;
+	path++;
+	n = strcspn(path, " ?\r\n");
+	best = NULL;
+	for (rule = rules; rule != NULL; rule = rule->link) {
+		if ((rule->plen <= n) &&
+				(strncmp(rule->prefix, path, rule->plen) == 0) &&
+				((best == NULL) || (rule->plen > best->plen)))
+			best = rule;
+		}
+	return best;
+	}
+
+/*
+** Find a header value in a raw request head, returning its length.
+*/
+static const char *find_header(const char *head, const char *name,
+		size_t *len) {
+	const char *line, *val;
+	size_t nlen;
+	nlen = strlen(name);
+	for (line = strstr(head, "\r\n"); line != NULL;
+			line = strstr(line, "\r\n")) {
+		line += 2;
+		if ((strncasecmp(line, name, nlen) != 0) || (line[nlen] != ':'))
+			continue;
+		val = line + nlen + 1;
+		while ((*val == ' ') || (*val == '\t')) val++;
+		*len = strcspn(val, "\r\n");
+		return val;
+		}
+	return NULL;
+	}
+
+static uint64_t client_key(RULE *rule, const char *head, const char *ipaddr) {
+	const char *val, *pt;
+	size_t len, klen;
+	if ((rule->keyed == KEY_FORWARDED) &&
+			((val = find_header(head, "x-forwarded-for", &len)) != NULL)) {
+		len = strcspn(val, ", \r\n");
+		if (len > 0) return hash64(val, len);
+		}
+	if ((rule->keyed == KEY_SESSION) &&
+			((val = find_header(head, "cookie", &len)) != NULL)) {
+		klen = strlen(COOKIE_KEY);
+		for (pt = val; pt < val + len; pt++) {
+			if ((strncmp(pt, COOKIE_KEY, klen) == 0) &&
+					(pt[klen] == '=')) {
+				pt += klen + 1;
+				len = strcspn(pt, "; \r\n");
+				if (len > 0) return hash64(pt, len);
+				break;
+				}
+			}
+		}
+	return hash64(ipaddr, strlen(ipaddr));
+	}
+
+static uint64_t refill(RULE *rule, uint64_t state, uint64_t now) {
+	uint64_t tokens, then, gained;
+	tokens = state & RL_TOKEN_MASK;
+	then = state >> RL_TOKEN_BITS;
+	if (now > then) {
+		gained = (uint64_t)((now - then) * rule->rate * RL_SCALE / 1000);
+		tokens = (tokens + gained > rule->burst ? rule->burst :
+				tokens + gained);
+		}
+	return tokens;
+	}
+
+static SLOT *find_slot(RULE *rule, uint64_t key, uint64_t now) {
+	SLOT *slot;
+	uint64_t old;
+	int i;
+	if (key == 0) key = 1; // 0 marks an empty slot
+	for (i = 0; i < RL_PROBE; i++) {
+		slot = &rule->slots[(key + i) & (RL_SLOTS - 1)];
+		if (slot->key == key) return slot;
+		if ((slot->key == 0) &&
+				__sync_bool_compare_and_swap(&slot->key, 0, key)) {
+			slot->state = (now << RL_TOKEN_BITS) | rule->burst;
+			return slot;
+			}
+		}
+	for (i = 0; i < RL_PROBE; i++) { // reclaim a full, idle bucket
+		slot = &rule->slots[(key + i) & (RL_SLOTS - 1)];
+		old = slot->key;
+		if ((refill(rule, slot->state, now) >= rule->burst) &&
+				__sync_bool_compare_and_swap(&slot->key, old, key)) {
+			__sync_fetch_and_add(&rule->evicted, 1);
+			return slot;
+			}
+		}
+	return NULL; // table crowded; let the request through
+	}
+
+/*
+** Returns nonzero if the request may proceed; otherwise *retry is
+** the number of seconds until a token is available. head is the
+** request line, optionally followed by the rest of the header block.
+*/
+int ratelimit_check(const char *head, const char *ipaddr, int *retry) {
+	RULE *rule;
+	SLOT *slot;
+	uint64_t now, old, tokens, want;
+	if ((rule = match_rule(head)) == NULL) return 1;
+	now = now_ns() / 1000000;
+	if ((slot = find_slot(rule, client_key(rule, head, ipaddr), now))
+			== NULL) return 1;
+	while (1) {
+		old = slot->state;
+		tokens = refill(rule, old, now);
+		if (tokens < RL_SCALE) {
+			want = RL_SCALE - tokens;
+			*retry = (int)(want / (rule->rate * RL_SCALE)) + 1;
+			__sync_fetch_and_add(&rule->rejected, 1);
+			return 0;
+			}
+		if (__sync_bool_compare_and_swap(&slot->state, old,
+				(now << RL_TOKEN_BITS) | (tokens - RL_SCALE)))
+			break;
+		}
+	__sync_fetch_and_add(&rule->allowed, 1);
+	return 1;
+	}
+
+/*
+** Nonzero if some rule keys clients by a header, so a check made on
+** the request line alone would fall back to the peer address.
+*/
+int ratelimit_keyed(void) {
+	return header_keyed;
+	}
+
+void ratelimit_reject(int sock, int retry) {
+	static const char *body = "Too Many Requests\n";
+	char buf[256];
+	int n;
+	n = snprintf(buf, sizeof(buf), "HTTP/1.1 429 Too Many Requests\r\n"
+		"retry-after: %d\r\ncontent-type: text/plain\r\n"
+		"content-length: %lu\r\n\r\n%s", retry,
+		(unsigned long)strlen(body), body);
+	send(sock, buf, n, MSG_NOSIGNAL | MSG_DONTWAIT);
+	}
+
+static SCM rate_limit(SCM prefix, SCM rate, SCM burst, SCM keyed) {
+	RULE *rule;
+	char *key;
+	double dburst;
+	rule = (RULE *)malloc(sizeof(RULE));
+	rule->prefix = scm_to_locale_string(prefix);
+	rule->plen = strlen(rule->prefix);
+	rule->rate = scm_to_double(rate);
+	if (rule->rate <= 0) rule->rate = 0.001;
+	dburst = scm_to_double(burst);
+	if (dburst < 1) dburst = 1;
+	if (dburst * RL_SCALE > RL_TOKEN_MASK)
+		dburst = RL_TOKEN_MASK / RL_SCALE;
+	rule->burst = (uint64_t)(dburst * RL_SCALE);
+	rule->keyed = KEY_IP;
+	if (keyed != SCM_UNDEFINED) {
+		key = scm_to_locale_string(scm_symbol_to_string(keyed));
+		if (strcmp(key, "forwarded") == 0) rule->keyed = KEY_FORWARDED;
+		else if (strcmp(key, "session") == 0) rule->keyed = KEY_SESSION;
+		free(key);
+		}
+	if (rule->keyed != KEY_IP) header_keyed = 1;
+	rule->slots = (SLOT *)calloc(RL_SLOTS, sizeof(SLOT));
+	rule->allowed = rule->rejected = rule->evicted = 0;
+	rule->link = rules;
+	log_msg("rate limit %s: %g/s, burst %g\n", rule->prefix,
+			rule->rate, dburst);
+	rules = rule; // newest shadows any older rule for the prefix
+	scm_remember_upto_here_2(prefix, rate);
+	scm_remember_upto_here_2(burst, keyed);
+	return SCM_UNSPECIFIED;
+	}
+
+static SCM rate_limit_stats(void) {
+	RULE *rule;
+	SCM stats, entry;
+	stats = SCM_EOL;
+	for (rule = rules; rule != NULL; rule = rule->link) {
+		entry = SCM_EOL;
+		entry = scm_acons(scm_from_locale_symbol("evicted"),
+				scm_from_ulong(rule->evicted), entry);
+		entry = scm_acons(scm_from_locale_symbol("rejected"),
+				scm_from_ulong(rule->rejected), entry);
+		entry = scm_acons(scm_from_locale_symbol("allowed"),
+				scm_from_ulong(rule->allowed), entry);
+		stats = scm_acons(scm_from_locale_string(rule->prefix),
+				entry, stats);
+		}
+	scm_remember_upto_here_2(stats, entry);
+	return stats;
+	}
+
+void init_ratelimit(void) {
+	scm_c_define_gsubr("rate-limit", 3, 1, 0, rate_limit);
+	scm_c_define_gsubr("rate-limit-stats", 0, 0, 0, rate_limit_stats);
+	}
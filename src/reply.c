@@ -0,0 +1,82 @@
+/*
+** Copyright (c) 2013 Peter Yadlowsky <pmy@virginia.edu>
+**
+** This program is free software ; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation ; either version 3 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY ; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program ; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "reply.h"
+
+void rbuf_init(RBUF *buf, size_t size) {
+	buf->data = (char *)malloc(size);
+	buf->size = size;
+	buf->len = 0;
+	return;
+	}
+
+void rbuf_put(RBUF *buf, const char *src, size_t len) {
+	if (buf->len + len > buf->size) {
+		while (buf->len + len > buf->size) buf->size *= 2;
+		buf->data = (char *)realloc(buf->data, buf->size);
+		}
+	memcpy(buf->data + buf->len, src, len);
+	buf->len += len;
+	return;
+	}
+
+void rbuf_puts(RBUF *buf, const char *src) {
+	rbuf_put(buf, src, strlen(src));
+	return;
+	}
+
+void rbuf_free(RBUF *buf) {
+	free(buf->data);
+	buf->data = NULL;
+	buf->len = buf->size = 0;
+	return;
+	}
+
+void reply_init(REPLY *reply) {
+	reply->wire.data = NULL;
+	reply->wire.len = reply->wire.size = 0;
+	reply->status = 0;
+	reply->split = reply->head = 0;
+	reply->ctype[0] = '\0';
+	reply->encoded = reply->compress = 0;
+	reply->shared = 0;
+	reply->hash = 0;
+	reply->etag = NULL;
+	reply->etag_made = 0;
+	reply->modified = 0;
+	return;
+	}
+
+void reply_copy(REPLY *dest, const REPLY *src) {
+	*dest = *src;
+	dest->wire.data = (char *)malloc(src->wire.len);
+	memcpy(dest->wire.data, src->wire.data, src->wire.len);
+	dest->wire.size = src->wire.len;
+	if (src->etag != NULL) dest->etag = strdup(src->etag);
+	return;
+	}
+
+void reply_free(REPLY *reply) {
+	if (reply->wire.data != NULL) rbuf_free(&reply->wire);
+	free(reply->etag);
+	reply->etag = NULL;
+	return;
+	}
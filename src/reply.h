@@ -0,0 +1,54 @@
+/*
+** Copyright (c) 2013 Peter Yadlowsky <pmy@virginia.edu>
+**
+** This program is free software ; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation ; either version 3 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY ; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program ; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+#include <time.h>
+#include <stdint.h>
+
+typedef struct rbuf {
+	char *data;
+	size_t len;
+	size_t size;
+	} RBUF;
+
+/*
+** A reply serialized for the wire: status line, responder headers,
+** body. The sender adds per-client headers (set-cookie, encoding,
+** validators, content-length) between the headers and the body.
+*/
+typedef struct reply {
+	RBUF wire;
+	int status;
+	size_t split; // end of status line
+	size_t head; // end of responder headers, start of body
+	char ctype[64];
+	int encoded; // responder set its own content-encoding
+	int compress; // body may go out compressed
+	int shared; // same body for many clients: cache compressed forms
+	uint64_t hash; // body hash, if computed
+	char *etag; // whole header value, or NULL
+	int etag_made; // etag generated from hash, not by responder
+	time_t modified;
+	} REPLY;
+
+void rbuf_init(RBUF *, size_t);
+void rbuf_put(RBUF *, const char *, size_t);
+void rbuf_puts(RBUF *, const char *);
+void rbuf_free(RBUF *);
+void reply_init(REPLY *);
+void reply_copy(REPLY *, const REPLY *);
+void reply_free(REPLY *);
@@ -2,26 +2,82 @@
 
 (define-module (gusher responders)
 	#:use-module (guile-user)
-	#:export (http-html http-xml http-text http-json))
+	#:export (http-html http-xml http-text http-json http-doc http-metrics
+		http-profile))
 
-(define (http-html path responder)
+(define (http-html path responder . opts)
 	; HTML response
-	(http path
+	(apply http path
 		(lambda (req)
-			(simple-response "text/html; charset=UTF-8" (responder req)))))
-(define (http-xml path responder)
+			(simple-response "text/html; charset=UTF-8" (responder req)))
+		opts))
+(define (http-xml path responder . opts)
 	; XML responsee
-	(http path
+	(apply http path
 		(lambda (req)
-			(simple-response "text/xml; charset=UTF-8" (responder req)))))
-(define (http-text path responder)
+			(simple-response "text/xml; charset=UTF-8" (responder req)))
+		opts))
+(define (http-text path responder . opts)
 	; plain text response
-	(http path
+	(apply http path
 		(lambda (req)
-			(simple-response "text/plain; charset=UTF-8" (responder req)))))
-(define (http-json path responder)
+			(simple-response "text/plain; charset=UTF-8" (responder req)))
+		opts))
+(define (http-json path responder . opts)
 	; JSON response
-	(http path
+	(apply http path
 		(lambda (req)
 			(let ([body (json-encode (responder req))])
-				(json-response body)))))
+				(json-response body)))
+		opts))
+(define (http-doc path doc mime-type . opts)
+	; serve a make-doc payload with a Last-Modified validator;
+	; conditional GETs get a 304 without regenerating the doc
+	(apply http path
+		(lambda (req)
+			(let ([headers
+					(list (cons "content-type" mime-type)
+						(cons "last-modified" (doc-last-modified doc)))])
+				(if (doc-not-modified? req doc)
+					(list "304 Not Modified" headers "")
+					(list "200 OK" headers (fetch-doc doc)))))
+		opts))
+(define (http-metrics path . opts)
+	; metrics registry: Prometheus text, or JSON with ?format=json
+	(apply http path
+		(lambda (req)
+			(if (equal? (query-value req 'format) "json")
+				(json-response (json-encode
+					(append (metrics-stats)
+						(list (cons 'usage (usage-stats))))))
+				(simple-response "text/plain; version=0.0.4"
+					(metrics-text))))
+		opts))
+(define profile-max-seconds 300)
+(define (http-profile path . opts)
+	; sample running responders for ?seconds=N (default 10) and return
+	; folded stacks for flamegraph.pl; ?mode=wall keeps samples taken
+	; as threads come back from blocking calls. The route gets a
+	; timeout past the longest run, unless opts set one, and seconds
+	; are capped to fit it, so the watchdog doesn't answer first.
+	(define options (if (pair? opts) (car opts) '()))
+	(define timeout
+		(or (assq-ref options 'timeout) (+ profile-max-seconds 5)))
+	(define limit (min profile-max-seconds (max 1 (- timeout 5))))
+	(http path
+		(lambda (req)
+			(let ([secs (let ([n (query-value-number req 'seconds)])
+						(min (if (> n 0) n 10) limit))]
+					[mode (if (equal? (query-value req 'mode) "wall")
+						'wall 'cpu)])
+				(if (profile-start secs 10 mode)
+					(begin
+						(snooze secs)
+						(profile-stop)
+						(simple-response "text/plain" (profile-report)))
+					(list "409 Conflict"
+						(list (cons "content-type" "text/plain"))
+						"profile already running\n"))))
+		(if (assq 'timeout options)
+			options
+			(cons (cons 'timeout timeout) options))))
@@ -4,6 +4,7 @@
 
 #include "smtp.h"
 #include "log.h"
+#include "park.h"
 
 struct tracked_string {
 	char *pt;
@@ -23,6 +24,10 @@ static size_t reader(void *ptr, size_t size, size_t nmemb,
 	return len;
 	}
 
+static void *perform(void *curl) {
+	return (void *)(long)curl_easy_perform((CURL *)curl);
+	}
+
 static SCM smtp_send(SCM url, SCM from, SCM recipients,
 		SCM username, SCM password, SCM payload) {
 	CURL *curl;
@@ -60,7 +65,7 @@ static SCM smtp_send(SCM url, SCM from, SCM recipients,
 	curl_easy_setopt(curl, CURLOPT_READDATA, (void *)&s_payload);
 	curl_easy_setopt(curl, CURLOPT_UPLOAD, 1);
 	//curl_easy_setopt(curl, CURLOPT_VERBOSE, 1);
-	res = curl_easy_perform(curl);
+	res = (CURLcode)(long)park(perform, curl);
 	if (res != CURLE_OK) {
 		log_msg("smtp_send: %s\n", curl_easy_strerror(res));
 		out = SCM_BOOL_F;
@@ -0,0 +1,70 @@
+/*
+** Copyright (c) 2013 Peter Yadlowsky <pmy@virginia.edu>
+**
+** This program is free software ; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation ; either version 3 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY ; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program ; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+/*
+** Per-route statistics records. Each responder path, plus "-" for
+** requests no route matched, gets one record for the life of the
+** process. The accounting modules (metrics, usage, heap) keep their
+** counters in it and walk the same list when they report.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <libguile.h>
+
+#include "stats.h"
+#include "heap.h"
+#include "metrics.h"
+#include "usage.h"
+
+static ROUTE_STATS *routes = NULL;
+static ROUTE_STATS *unmatched = NULL;
+static SCM stats_mutex;
+
+/*
+** The record for path, made on first use; NULL gives the one for
+** unmatched requests.
+*/
+ROUTE_STATS *stats_route(const char *path) {
+	ROUTE_STATS *route;
+	if (path == NULL) return unmatched;
+	scm_lock_mutex(stats_mutex);
+	for (route = routes; route != NULL; route = route->link) {
+		if (strcmp(route->path, path) == 0) break;
+		}
+	if (route == NULL) {
+		route = (ROUTE_STATS *)malloc(sizeof(ROUTE_STATS));
+		route->path = strdup(path);
+		route->metrics = metrics_counters();
+		route->usage = usage_counters();
+		route->gc = heap_counters();
+		route->link = routes;
+		routes = route;
+		}
+	scm_unlock_mutex(stats_mutex);
+	return route;
+	}
+
+ROUTE_STATS *stats_routes(void) {
+	return routes;
+	}
+
+void init_stats(void) {
+	scm_permanent_object(stats_mutex = scm_make_mutex());
+	unmatched = stats_route("-");
+	}
@@ -0,0 +1,33 @@
+/*
+** Copyright (c) 2013 Peter Yadlowsky <pmy@virginia.edu>
+**
+** This program is free software ; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation ; either version 3 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY ; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program ; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+struct metrics_route;
+struct usage;
+struct gc_account;
+
+typedef struct route_stats {
+	char *path;
+	struct metrics_route *metrics;
+	struct usage *usage;
+	struct gc_account *gc;
+	struct route_stats *link;
+	} ROUTE_STATS;
+
+ROUTE_STATS *stats_route(const char *);
+ROUTE_STATS *stats_routes(void);
+void init_stats(void);
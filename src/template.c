@@ -22,43 +22,86 @@
 #include <stdio.h>
 #include <ctype.h>
 
+#include "reply.h"
+#include "template.h"
+#include "bytes.h"
+#include "arena.h"
+
 #define c2s(s) (scm_from_utf8_string(s))
 #define SLOT_MARK "[["
 #define SLOT_END "]]"
 
-struct template_slot {
-	char *token;
-	char *payload;
-	};
-
 static char *upcase(char *src) {
 	char *pt;
 	for (pt = src; *pt; pt++) *pt = toupper(*pt);
 	return src;
 	}
 
+/*
+** Scan a template once, emitting literal text and slot payloads into
+** out. Shared by fill-template and native handlers.
+*/
+void template_fill(RBUF *out, const char *master,
+		const struct template_slot *table, int tabsize, int partial) {
+	const char *pin, *sense;
+	int marklen, i;
+	size_t n;
+	marklen = strlen(SLOT_MARK);
+	pin = master;
+	while (1) {
+		if ((sense = strstr(pin, SLOT_MARK)) == NULL) {
+			rbuf_puts(out, pin);
+			break;
+			}
+		while (sense[2] && !isupper(sense[2])) sense++;
+		rbuf_put(out, pin, sense - pin);
+		pin = sense;
+		if ((sense = strstr(pin, SLOT_END)) == NULL) {
+			rbuf_puts(out, pin);
+			break;
+			}
+		pin += marklen;
+		n = sense - pin;
+		for (i = 0; i < tabsize; i++) {
+			if ((strncmp(pin, table[i].token, n) == 0) &&
+					(table[i].token[n] == '\0')) {
+				rbuf_puts(out, table[i].payload);
+				break;
+				}
+			}
+		if ((i == tabsize) && partial) {
+			rbuf_puts(out, SLOT_MARK);
+			rbuf_put(out, pin, n);
+			rbuf_puts(out, SLOT_END);
+			}
+		pin = sense + marklen;
+		}
+	return;
+	}
+
 static SCM fill_template(SCM template, SCM partial, SCM slots) {
-	SCM node, pair, parts, slot_mark, slot_end, payload;
+	SCM node, pair, payload, whole;
 	struct template_slot *table;
-	char *pin, *sense, hold, *master;
-	int marklen, tabsize, i;
-	master = scm_to_utf8_string(template);
+	ARENA_MARK mark;
+	char *master;
+	size_t mlen;
+	int tabsize, i;
+	RBUF out;
+	scm_dynwind_begin(0);
+	mark = arena_mark();
+	arena_dynwind_release(&mark);
+	master = scm_to_utf8_arena(template, &mlen);
 	scm_remember_upto_here_1(template);
-	pin = master;
-	parts = SCM_EOL;
-	slot_mark = SCM_EOL;
-	slot_end = SCM_EOL;
-	marklen = strlen(SLOT_MARK);
 	tabsize = scm_to_int(scm_length(slots));
-	table = (struct template_slot *)malloc(
+	table = (struct template_slot *)arena_alloc(
 				sizeof(struct template_slot) * tabsize);
 	i = 0;
 	pair = SCM_EOL;
 	payload = SCM_EOL;
 	for (node = slots; node != SCM_EOL; node = SCM_CDR(node)) {
 		pair = SCM_CAR(node);
-		table[i].token = upcase(scm_to_utf8_string(
-				scm_symbol_to_string(SCM_CAR(pair))));
+		table[i].token = upcase(scm_to_utf8_arena(
+				scm_symbol_to_string(SCM_CAR(pair)), NULL));
 		payload = SCM_CDR(pair);
 		if (scm_is_number(payload))
 			payload = scm_number_to_string(payload,
@@ -67,57 +110,18 @@ static SCM fill_template(SCM template, SCM partial, SCM slots) {
 			payload = scm_symbol_to_string(payload);
 		else if (!scm_is_string(payload))
 			payload = c2s("");
-		table[i].payload = scm_to_utf8_string(payload);
+		table[i].payload = scm_to_utf8_arena(payload, NULL);
 		i++;
 		}
 	scm_remember_upto_here_2(node, pair);
 	scm_remember_upto_here_2(slots, payload);
-	while (1) {
-		if ((sense = strstr(pin, SLOT_MARK)) == NULL) {
-			parts = scm_cons(c2s(pin), parts);
-			break;
-			}
-		while (sense[2] && !isupper(sense[2])) sense++;
-		hold = *sense;
-		*sense = '\0';
-		parts = scm_cons(c2s(pin), parts);
-		*sense = hold;
-		pin = sense;
-		if ((sense = strstr(pin, SLOT_END)) == NULL) {
-			parts = scm_cons(c2s(pin), parts);
-			break;
-			}
-		pin += marklen;
-		*sense = '\0';
-		for (i = 0; i < tabsize; i++) {
-			if (strcmp(pin, table[i].token) == 0) {
-				parts = scm_cons(c2s(table[i].payload),
-						parts);
-				break;
-				}
-			}
-		if ((i == tabsize) && (partial == SCM_BOOL_T)) {
-			if (slot_mark == SCM_EOL) {
-				slot_mark = c2s(SLOT_MARK);
-				slot_end = c2s(SLOT_END);
-				}
-			parts = scm_cons(slot_mark, parts);
-			parts = scm_cons(c2s(pin), parts);
-			parts = scm_cons(slot_end, parts);
-			}
-		scm_remember_upto_here_1(partial);
-		pin = sense + marklen;
-		}
-	free(master);
-	for (i = 0; i < tabsize; i++) {
-		free(table[i].token);
-		free(table[i].payload);
-		}
-	free(table);
-	SCM whole;
-	whole = scm_string_concatenate(scm_reverse(parts));
-	scm_remember_upto_here_2(parts, slot_mark);
-	scm_remember_upto_here_2(slot_end, whole);
+	rbuf_init(&out, mlen + 256);
+	template_fill(&out, master, table, tabsize, partial == SCM_BOOL_T);
+	scm_remember_upto_here_1(partial);
+	scm_dynwind_end();
+	whole = scm_from_utf8_stringn(out.data, out.len);
+	rbuf_free(&out);
+	scm_remember_upto_here_1(whole);
 	return whole;
 	}
 
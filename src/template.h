@@ -16,4 +16,13 @@
 ** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
 */
 
+struct rbuf;
+
+struct template_slot {
+	const char *token; // as written in the template, e.g. "NAME"
+	const char *payload;
+	};
+
 void init_template(void);
+void template_fill(struct rbuf *, const char *,
+		const struct template_slot *, int, int);
@@ -0,0 +1,353 @@
+/*
+** Copyright (c) 2013 Peter Yadlowsky <pmy@virginia.edu>
+**
+** This program is free software ; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation ; either version 3 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY ; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program ; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+/*
+** Per-request tracing. A request takes its trace ID from
+** traceparent or X-Request-Id when the client sends one, otherwise
+** it gets a fresh one. The ID prefixes log lines written while the
+** request runs, goes out on http-get calls and comes back in the
+** reply. Phase times (accept, dequeue, handler start and end, send)
+** and a span for each Postgres query and curl call are kept per
+** thread. Sampled requests are written as one JSON line each to the
+** file named by trace-to.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <uuid/uuid.h>
+#include <libguile.h>
+
+#include "log.h"
+#include "reply.h"
+#include "json.h"
+#include "gtime.h"
+#include "trace.h"
+
+struct span {
+	const char *kind;
+	char detail[TRACE_DETAIL];
+	unsigned long start, end;
+	};
+
+struct trace {
+	int active;
+	int sampled;
+	int status;
+	char id[TRACE_ID_MAX + 1];
+	char span_id[17];
+	char parent[17];
+	unsigned long accepted, dequeued, handler, handled, sent;
+	int nspans;
+	int dropped;
+	struct span spans[TRACE_SPANS];
+	};
+
+static __thread struct trace current;
+static FILE *sink = NULL;
+static double sample_rate = 0;
+static SCM sink_mutex;
+static volatile unsigned long traced = 0, written = 0;
+static volatile unsigned long adopted = 0, spans_dropped = 0;
+static const char *hex = "0123456789abcdef";
+
+static void random_hex(char *out, int bytes) {
+	uuid_t raw;
+	int i;
+	uuid_generate_random(raw);
+	for (i = 0; i < bytes; i++) {
+		*out++ = hex[(raw[i] >> 4) & 0xf];
+		*out++ = hex[raw[i] & 0xf];
+		}
+	*out = '\0';
+	}
+
+static int is_hex(const char *src, int n) {
+	int i;
+	for (i = 0; i < n; i++) if (!isxdigit((unsigned char)src[i])) return 0;
+	return 1;
+	}
+
+/*
+** traceparent: 00-<32 hex trace>-<16 hex parent>-<2 hex flags>
+*/
+static int parse_traceparent(const char *tp) {
+	if ((strlen(tp) < 55) || (tp[2] != '-') || (tp[35] != '-') ||
+			(tp[52] != '-')) return 0;
+	if (!is_hex(tp + 3, 32) || !is_hex(tp + 36, 16) || !is_hex(tp + 53, 2))
+		return 0;
+	memcpy(current.id, tp + 3, 32);
+	current.id[32] = '\0';
+	memcpy(current.parent, tp + 36, 16);
+	current.parent[16] = '\0';
+	if (strtol(tp + 53, NULL, 16) & 1) current.sampled = 1;
+	return 1;
+	}
+
+static int copy_request_id(const char *rid) {
+	int i;
+	for (i = 0; rid[i] && (i < TRACE_ID_MAX); i++) {
+		if (!isalnum((unsigned char)rid[i]) &&
+				(strchr("-_.:", rid[i]) == NULL)) break;
+		current.id[i] = rid[i];
+		}
+	current.id[i] = '\0';
+	return (i > 0);
+	}
+
+void trace_idle(void) {
+	current.active = 0;
+	}
+
+/*
+** Carry the request's trace onto a helper thread (par), so the calls
+** it makes go out with the request's ID; NULL ends it. The helper
+** records no spans of its own and writes nothing.
+*/
+void trace_save(TRACE_CONTEXT *ctx) {
+	ctx->id[0] = '\0';
+	if (trace_id() == NULL) return;
+	strcpy(ctx->id, current.id);
+	strcpy(ctx->span_id, current.span_id);
+	ctx->sampled = current.sampled;
+	}
+
+void trace_carry(const TRACE_CONTEXT *ctx) {
+	if ((ctx == NULL) || (ctx->id[0] == '\0')) {
+		current.active = 0;
+		return;
+		}
+	trace_begin(0);
+	strcpy(current.id, ctx->id);
+	strcpy(current.span_id, ctx->span_id);
+	current.sampled = ctx->sampled;
+	current.nspans = TRACE_SPANS; // nowhere to write them
+	}
+
+/*
+** A worker dequeued a request accepted at the given time.
+*/
+void trace_begin(unsigned long accepted) {
+	current.active = 1;
+	current.id[0] = '\0';
+	current.parent[0] = '\0';
+	current.sampled = 0;
+	current.status = 0;
+	current.nspans = 0;
+	current.dropped = 0;
+	current.accepted = accepted;
+	current.dequeued = now_ns();
+	current.handler = current.handled = current.sent = 0;
+	}
+
+/*
+** Headers are in: settle the trace ID and start the handler phase.
+*/
+void trace_adopt(const char *rid, const char *traceparent) {
+	if (!current.active) trace_begin(0);
+	if (((traceparent != NULL) && parse_traceparent(traceparent)) ||
+			((rid != NULL) && copy_request_id(rid)))
+		__sync_fetch_and_add(&adopted, 1);
+	else random_hex(current.id, 16);
+	random_hex(current.span_id, 8);
+	if ((sink != NULL) && !current.sampled && (sample_rate > 0))
+		current.sampled = (random() < sample_rate * RAND_MAX);
+	current.handler = now_ns();
+	__sync_fetch_and_add(&traced, 1);
+	}
+
+const char *trace_id(void) {
+	if (!current.active || (current.id[0] == '\0')) return NULL;
+	return current.id;
+	}
+
+/*
+** Header values for an outbound call; traceparent only when the ID
+** is a W3C trace ID. Returns 0 when no request is being traced.
+*/
+int trace_outbound(char *rid, size_t rsize, char *tp, size_t tsize) {
+	if (trace_id() == NULL) return 0;
+	snprintf(rid, rsize, "X-Request-Id: %s", current.id);
+	tp[0] = '\0';
+	if ((strlen(current.id) == 32) && is_hex(current.id, 32))
+		snprintf(tp, tsize, "traceparent: 00-%s-%s-%02x", current.id,
+				current.span_id, current.sampled);
+	return 1;
+	}
+
+void trace_handler_end(void) {
+	if (current.active && (current.handled == 0))
+		current.handled = now_ns();
+	}
+
+void trace_sent(int status) {
+	if (!current.active) return;
+	current.sent = now_ns();
+	current.status = status;
+	}
+
+int trace_span_begin(const char *kind, const char *detail) {
+	struct span *span;
+	if (!current.active || (current.id[0] == '\0')) return -1;
+	if (current.nspans >= TRACE_SPANS) {
+		current.dropped++;
+		return -1;
+		}
+	span = &current.spans[current.nspans];
+	span->kind = kind;
+	strncpy(span->detail, (detail != NULL ? detail : ""),
+			sizeof(span->detail) - 1);
+	span->detail[sizeof(span->detail) - 1] = '\0';
+	span->start = now_ns();
+	span->end = 0;
+	return current.nspans++;
+	}
+
+void trace_span_end(int idx) {
+	if (!current.active || (idx < 0) || (idx >= current.nspans)) return;
+	current.spans[idx].end = now_ns();
+	}
+
+static void put_num(RBUF *out, const char *key, unsigned long at,
+		unsigned long base) {
+	char buf[64];
+	if ((at == 0) || (at < base)) return;
+	snprintf(buf, sizeof(buf), ",\"%s\":%lu", key, (at - base) / 1000);
+	rbuf_puts(out, buf);
+	}
+
+static void write_trace(const char *route, const char *url) {
+	struct span *span;
+	unsigned long base;
+	char buf[128];
+	RBUF out;
+	int i;
+	base = (current.accepted ? current.accepted : current.dequeued);
+	rbuf_init(&out, 1024);
+	rbuf_puts(&out, "{\"trace\":");
+	json_put_string(&out, current.id);
+	snprintf(buf, sizeof(buf), ",\"span\":\"%s\"", current.span_id);
+	rbuf_puts(&out, buf);
+	if (current.parent[0]) {
+		snprintf(buf, sizeof(buf), ",\"parent\":\"%s\"", current.parent);
+		rbuf_puts(&out, buf);
+		}
+	rbuf_puts(&out, ",\"route\":");
+	json_put_string(&out, route);
+	rbuf_puts(&out, ",\"url\":");
+	json_put_string(&out, url);
+	snprintf(buf, sizeof(buf), ",\"status\":%d,\"start\":%lu",
+			current.status, (unsigned long)time(NULL));
+	rbuf_puts(&out, buf);
+	rbuf_puts(&out, ",\"us\":{\"accept\":0");
+	put_num(&out, "dequeue", current.dequeued, base);
+	put_num(&out, "handler_start", current.handler, base);
+	put_num(&out, "handler_end", current.handled, base);
+	put_num(&out, "sent", current.sent, base);
+	put_num(&out, "done", now_ns(), base);
+	rbuf_puts(&out, "},\"spans\":[");
+	for (i = 0; i < current.nspans; i++) {
+		span = &current.spans[i];
+		snprintf(buf, sizeof(buf), "%s{\"kind\":\"%s\",\"detail\":",
+				(i > 0 ? "," : ""), span->kind);
+		rbuf_puts(&out, buf);
+		json_put_string(&out, span->detail);
+		put_num(&out, "at", span->start, base);
+		if (span->end) {
+			snprintf(buf, sizeof(buf), ",\"dur\":%lu",
+					(span->end - span->start) / 1000);
+			rbuf_puts(&out, buf);
+			}
+		rbuf_puts(&out, "}");
+		}
+	snprintf(buf, sizeof(buf), "],\"dropped\":%d}\n", current.dropped);
+	rbuf_puts(&out, buf);
+	scm_lock_mutex(sink_mutex);
+	if (sink != NULL) {
+		fwrite(out.data, 1, out.len, sink);
+		fflush(sink);
+		}
+	scm_unlock_mutex(sink_mutex);
+	rbuf_free(&out);
+	__sync_fetch_and_add(&written, 1);
+	}
+
+void trace_end(const char *route, const char *url) {
+	if (!current.active) return;
+	if (current.dropped)
+		__sync_fetch_and_add(&spans_dropped, current.dropped);
+	if (current.sampled && (sink != NULL) && (current.id[0] != '\0'))
+		write_trace(route, url);
+	current.active = 0;
+	}
+
+/*
+** (trace-to path [rate]): append sampled spans to path; rate is the
+** share of requests sampled (default 1). #f stops writing.
+*/
+static SCM trace_to(SCM path, SCM rate) {
+	char *spath;
+	FILE *fp;
+	fp = NULL;
+	if (scm_is_string(path)) {
+		spath = scm_to_locale_string(path);
+		fp = fopen(spath, "a");
+		if (fp == NULL) log_msg("trace-to: can't open %s\n", spath);
+		free(spath);
+		if (fp == NULL) return SCM_BOOL_F;
+		}
+	scm_lock_mutex(sink_mutex);
+	if (sink != NULL) fclose(sink);
+	sink = fp;
+	sample_rate = (scm_is_real(rate) ? scm_to_double(rate) : 1.0);
+	scm_unlock_mutex(sink_mutex);
+	scm_remember_upto_here_2(path, rate);
+	return SCM_BOOL_T;
+	}
+
+static SCM trace_id_primitive(void) {
+	const char *id;
+	if ((id = trace_id()) == NULL) return SCM_BOOL_F;
+	return scm_from_latin1_string(id);
+	}
+
+static SCM trace_stats(void) {
+	SCM stats;
+	stats = SCM_EOL;
+	stats = scm_acons(scm_from_latin1_symbol("spans-dropped"),
+			scm_from_ulong(spans_dropped), stats);
+	stats = scm_acons(scm_from_latin1_symbol("written"),
+			scm_from_ulong(written), stats);
+	stats = scm_acons(scm_from_latin1_symbol("adopted"),
+			scm_from_ulong(adopted), stats);
+	stats = scm_acons(scm_from_latin1_symbol("traced"),
+			scm_from_ulong(traced), stats);
+	stats = scm_acons(scm_from_latin1_symbol("sample-rate"),
+			scm_from_double(sample_rate), stats);
+	scm_remember_upto_here_1(stats);
+	return stats;
+	}
+
+void init_trace(void) {
+	scm_permanent_object(sink_mutex = scm_make_mutex());
+	scm_c_define_gsubr("trace-to", 1, 1, 0, trace_to);
+	scm_c_define_gsubr("trace-id", 0, 0, 0, trace_id_primitive);
+	scm_c_define_gsubr("trace-stats", 0, 0, 0, trace_stats);
+	}
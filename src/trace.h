@@ -0,0 +1,43 @@
+/*
+** Copyright (c) 2013 Peter Yadlowsky <pmy@virginia.edu>
+**
+** This program is free software ; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation ; either version 3 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY ; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program ; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+#include <stddef.h>
+
+#define TRACE_ID_MAX 64
+#define TRACE_SPANS 32
+#define TRACE_DETAIL 80
+
+typedef struct trace_context {
+	char id[TRACE_ID_MAX + 1]; // empty if not tracing
+	char span_id[17];
+	int sampled;
+	} TRACE_CONTEXT;
+
+void trace_begin(unsigned long);
+void trace_adopt(const char *, const char *);
+const char *trace_id(void);
+int trace_outbound(char *, size_t, char *, size_t);
+void trace_handler_end(void);
+void trace_sent(int);
+int trace_span_begin(const char *, const char *);
+void trace_span_end(int);
+void trace_end(const char *, const char *);
+void trace_idle(void);
+void trace_save(TRACE_CONTEXT *);
+void trace_carry(const TRACE_CONTEXT *);
+void init_trace(void);
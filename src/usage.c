@@ -0,0 +1,150 @@
+/*
+** Copyright (c) 2013 Peter Yadlowsky <pmy@virginia.edu>
+**
+** This program is free software ; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation ; either version 3 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY ; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program ; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+/*
+** Per-route resource accounting: thread CPU time and the
+** count and wall time of Postgres queries and curl transfers, for
+** the part of each request that runs under dispatch. The I/O sites
+** bracket their calls with usage_io_begin/usage_io_end; the running
+** totals are per thread and folded into the route at usage_end.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <libguile.h>
+
+#include "gtime.h"
+#include "stats.h"
+#include "usage.h"
+
+struct usage {
+	volatile unsigned long requests;
+	volatile unsigned long cpu_ns;
+	volatile unsigned long cpu_max;
+	volatile unsigned long io_count[USAGE_KINDS];
+	volatile unsigned long io_ns[USAGE_KINDS];
+	};
+
+struct tally {
+	unsigned long cpu_start;
+	unsigned long io_count[USAGE_KINDS];
+	unsigned long io_ns[USAGE_KINDS];
+	};
+
+static __thread struct tally tally;
+static const char *io_names[USAGE_KINDS] = { "pg", "http" };
+
+USAGE *usage_counters(void) {
+	return (USAGE *)calloc(1, sizeof(USAGE));
+	}
+
+void usage_begin(void) {
+	memset(&tally, 0, sizeof(tally));
+	tally.cpu_start = cpu_ns();
+	}
+
+void usage_end(ROUTE_STATS *route) {
+	USAGE *usage;
+	unsigned long cpu, max;
+	int i;
+	if (route == NULL) route = stats_route(NULL);
+	usage = route->usage;
+	cpu = cpu_ns() - tally.cpu_start;
+	__sync_fetch_and_add(&usage->requests, 1);
+	__sync_fetch_and_add(&usage->cpu_ns, cpu);
+	while ((max = usage->cpu_max) < cpu)
+		__sync_bool_compare_and_swap(&usage->cpu_max, max, cpu);
+	for (i = 0; i < USAGE_KINDS; i++) {
+		__sync_fetch_and_add(&usage->io_count[i], tally.io_count[i]);
+		__sync_fetch_and_add(&usage->io_ns[i], tally.io_ns[i]);
+		}
+	}
+
+unsigned long usage_io_begin(void) {
+	return now_ns();
+	}
+
+void usage_io_end(int kind, unsigned long started) {
+	tally.io_count[kind]++;
+	tally.io_ns[kind] += now_ns() - started;
+	}
+
+/*
+** Work done for a request on a helper thread: usage_begin there,
+** usage_take to add what it used to work, then usage_charge on the
+** request's own thread before usage_end.
+*/
+void usage_take(USAGE_WORK *work) {
+	int i;
+	work->cpu_ns += cpu_ns() - tally.cpu_start;
+	for (i = 0; i < USAGE_KINDS; i++) {
+		work->io_count[i] += tally.io_count[i];
+		work->io_ns[i] += tally.io_ns[i];
+		}
+	}
+
+void usage_charge(const USAGE_WORK *work) {
+	int i;
+	tally.cpu_start -= work->cpu_ns;
+	for (i = 0; i < USAGE_KINDS; i++) {
+		tally.io_count[i] += work->io_count[i];
+		tally.io_ns[i] += work->io_ns[i];
+		}
+	}
+
+static SCM usage_stats(void) {
+	ROUTE_STATS *route;
+	USAGE *usage;
+	SCM stats, entry;
+	char name[32];
+	unsigned long n;
+	int i;
+	stats = SCM_EOL;
+	entry = SCM_EOL;
+	for (route = stats_routes(); route != NULL; route = route->link) {
+		usage = route->usage;
+		n = usage->requests;
+		entry = SCM_EOL;
+		for (i = USAGE_KINDS - 1; i >= 0; i--) {
+			strcpy(name, io_names[i]);
+			strcat(name, "-ms");
+			entry = scm_acons(scm_from_latin1_symbol(name),
+				scm_from_double(usage->io_ns[i] / 1e6), entry);
+			strcpy(name, io_names[i]);
+			strcat(name, "-calls");
+			entry = scm_acons(scm_from_latin1_symbol(name),
+				scm_from_ulong(usage->io_count[i]), entry);
+			}
+		entry = scm_acons(scm_from_latin1_symbol("cpu-max-ms"),
+			scm_from_double(usage->cpu_max / 1e6), entry);
+		entry = scm_acons(scm_from_latin1_symbol("cpu-mean-ms"),
+			scm_from_double(n ? usage->cpu_ns / 1e6 / n : 0), entry);
+		entry = scm_acons(scm_from_latin1_symbol("cpu-ms"),
+			scm_from_double(usage->cpu_ns / 1e6), entry);
+		entry = scm_acons(scm_from_latin1_symbol("requests"),
+			scm_from_ulong(n), entry);
+		stats = scm_acons(scm_from_locale_symbol(route->path),
+			entry, stats);
+		}
+	scm_remember_upto_here_2(stats, entry);
+	return stats;
+	}
+
+void init_usage(void) {
+	scm_c_define_gsubr("usage-stats", 0, 0, 0, usage_stats);
+	}
@@ -0,0 +1,40 @@
+/*
+** Copyright (c) 2013 Peter Yadlowsky <pmy@virginia.edu>
+**
+** This program is free software ; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation ; either version 3 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY ; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program ; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+#include <stddef.h>
+
+enum { USAGE_PG, USAGE_HTTP, USAGE_KINDS };
+
+typedef struct usage USAGE;
+struct route_stats;
+
+// a request's share of work done on another thread, see par.c
+typedef struct usage_work {
+	unsigned long cpu_ns;
+	unsigned long io_count[USAGE_KINDS];
+	unsigned long io_ns[USAGE_KINDS];
+	} USAGE_WORK;
+
+USAGE *usage_counters(void);
+void usage_begin(void);
+void usage_end(struct route_stats *);
+unsigned long usage_io_begin(void);
+void usage_io_end(int, unsigned long);
+void usage_take(USAGE_WORK *);
+void usage_charge(const USAGE_WORK *);
+void init_usage(void);
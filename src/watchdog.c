@@ -0,0 +1,379 @@
+/*
+** Copyright (c) 2013 Peter Yadlowsky <pmy@virginia.edu>
+**
+** This program is free software ; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation ; either version 3 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY ; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program ; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+/*
+** Request deadlines. Each worker registers the request it is running
+** in a slot, timed from when the connection was accepted, so header
+** and body reads and any wait in a bulkhead queue count against it.
+** A watchdog thread sweeps the slots and, for any past its deadline,
+** logs it, hands its outstanding pg query to a canceller thread,
+** answers the client with 504 and asks the thread for a backtrace at
+** its next safe point. The worker carries on to the end of its
+** responder, but its own reply is dropped.
+**
+** Work a request hands to another thread (par tasks) runs under a
+** scope carried from the caller: its deadline bounds watch_remaining
+** there, and its queries are registered against the caller's slot,
+** so an overrun cancels them too, as does the scope expiring.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <libguile.h>
+#include <libpq-fe.h>
+
+#include "log.h"
+#include "gtime.h"
+#include "watchdog.h"
+
+enum { RUNNING, SENDING, ANSWERED };
+
+struct watch_scope;
+
+typedef struct query {
+	PGcancel *cancel;
+	int taken;
+	struct watch_scope *scope; // NULL: the slot's own thread
+	struct query **head;
+	struct query *prev;
+	struct query *next;
+	} QUERY;
+
+typedef struct slot {
+	SCM thread;
+	int sock;
+	int state;
+	char route[128];
+	char url[256];
+	double start;
+	double deadline;
+	QUERY *queries;
+	struct slot *prev;
+	struct slot *next;
+	} SLOT;
+
+struct watch_scope {
+	SLOT *slot; // NULL if the caller wasn't watched
+	double deadline;
+	};
+
+static __thread SLOT *current = NULL;
+static __thread WATCH_SCOPE *carried = NULL;
+static __thread QUERY running; // this thread's query, if registered
+static SLOT *slots = NULL;
+static QUERY *unwatched = NULL; // scoped queries with no slot
+static SCM wmutex;
+static SCM trace_thunk;
+static double default_timeout = DEFAULT_REQUEST_TIMEOUT;
+static int started = 0;
+static unsigned long overruns = 0, cancels = 0, answered = 0;
+
+static const char *late_msg = "HTTP/1.1 504 Gateway Timeout\r\n"
+	"content-type: text/plain\r\ncontent-length: 16\r\n\r\n"
+	"Gateway Timeout\n";
+
+static double now_secs(void) {
+	return now_ns() / 1000000000.0;
+	}
+
+static SCM log_trace(void) {
+	SCM port, string;
+	char *cstring;
+	port = scm_open_output_string();
+	scm_display_backtrace(scm_make_stack(SCM_BOOL_T, SCM_EOL), port,
+			SCM_BOOL_F, SCM_BOOL_F);
+	string = scm_get_output_string(port);
+	cstring = scm_to_locale_string(string);
+	log_msg("OVERRUN TRACE: %s\n", cstring);
+	scm_close_output_port(port);
+	free(cstring);
+	scm_remember_upto_here_2(port, string);
+	return SCM_UNSPECIFIED;
+	}
+
+/*
+** PQcancel connects to the server and waits for it, so it runs on a
+** thread of its own rather than holding up the sweep. The handle is
+** this thread's to free; see watch_query.
+*/
+static SCM cancel_query(void *data) {
+	PGcancel *query = (PGcancel *)data;
+	char errbuf[256];
+	if (PQcancel(query, errbuf, sizeof(errbuf))) {
+		scm_lock_mutex(wmutex);
+		cancels++;
+		scm_unlock_mutex(wmutex);
+		}
+	else log_msg("PQcancel: %s\n", errbuf);
+	PQfreeCancel(query);
+	return SCM_BOOL_T;
+	}
+
+// called with wmutex held
+static void cancel(QUERY *query) {
+	if (query->cancel == NULL) return;
+	scm_spawn_thread(cancel_query, query->cancel, NULL, NULL);
+	query->cancel = NULL;
+	query->taken = 1;
+	}
+
+/*
+** Answer an overdue slot; called with wmutex held.
+*/
+static void overrun(SLOT *slot, double now) {
+	QUERY *query;
+	slot->state = ANSWERED;
+	overruns++;
+	log_msg("OVERRUN %s (%s) after %.1fs\n", slot->url,
+			slot->route, now - slot->start);
+	for (query = slot->queries; query != NULL; query = query->next)
+		cancel(query);
+	if (send(slot->sock, late_msg, strlen(late_msg),
+			MSG_NOSIGNAL | MSG_DONTWAIT) > 0) answered++;
+	shutdown(slot->sock, SHUT_RDWR);
+	}
+
+static SCM watchdog(void *data) {
+	SLOT *slot;
+	double now;
+	while (1) {
+		usleep(WATCHDOG_INTVL_MS * 1000);
+		now = now_secs();
+		scm_lock_mutex(wmutex);
+		for (slot = slots; slot != NULL; slot = slot->next) {
+			if ((slot->deadline <= 0) || (now < slot->deadline) ||
+					(slot->state != RUNNING)) continue;
+			overrun(slot, now);
+			scm_system_async_mark_for_thread(trace_thunk, slot->thread);
+			}
+		scm_unlock_mutex(wmutex);
+		}
+	return SCM_BOOL_T;
+	}
+
+/*
+** Start watching the request on sock, accepted at the given
+** CLOCK_MONOTONIC time in ns. A thread already watching a request
+** (the read phase, before the route is known) has its slot renamed
+** and its deadline moved to the route's timeout, still counted from
+** accept. Returns 0 if that deadline has already passed, in which
+** case the client has been answered with 504 and the caller should
+** not run the responder.
+*/
+int watch_begin(int sock, const char *route, const char *url,
+		double timeout, unsigned long accepted) {
+	SLOT *slot;
+	double now;
+	int ok;
+	if (timeout <= 0) timeout = default_timeout;
+	if ((slot = current) == NULL) {
+		slot = (SLOT *)scm_gc_malloc(sizeof(SLOT), "watch-slot");
+		slot->thread = scm_current_thread();
+		slot->sock = sock;
+		slot->state = RUNNING;
+		slot->start = accepted / 1000000000.0;
+		slot->queries = NULL;
+		slot->prev = NULL;
+		}
+	scm_lock_mutex(wmutex);
+	snprintf(slot->route, sizeof(slot->route), "%s", route);
+	snprintf(slot->url, sizeof(slot->url), "%s", url);
+	slot->deadline = (timeout > 0 ? slot->start + timeout : 0);
+	if (slot != current) {
+		if (!started) {
+			started = 1;
+			scm_spawn_thread(watchdog, NULL, NULL, NULL);
+			}
+		if ((slot->next = slots) != NULL) slots->prev = slot;
+		slots = slot;
+		current = slot;
+		}
+	now = now_secs();
+	if ((slot->state == RUNNING) && (slot->deadline > 0) &&
+			(now >= slot->deadline)) overrun(slot, now);
+	ok = (slot->state != ANSWERED);
+	scm_unlock_mutex(wmutex);
+	return ok;
+	}
+
+void watch_end(void) {
+	SLOT *slot;
+	if ((slot = current) == NULL) return;
+	current = NULL;
+	scm_lock_mutex(wmutex);
+	if (slot->prev != NULL) slot->prev->next = slot->next;
+	else slots = slot->next;
+	if (slot->next != NULL) slot->next->prev = slot->prev;
+	scm_unlock_mutex(wmutex);
+	}
+
+/*
+** The worker is about to write its reply. Returns 0 if the watchdog
+** has already answered for it.
+*/
+int watch_sending(void) {
+	int ok;
+	if (current == NULL) return 1;
+	scm_lock_mutex(wmutex);
+	ok = (current->state == RUNNING);
+	if (ok) current->state = SENDING;
+	scm_unlock_mutex(wmutex);
+	return ok;
+	}
+
+double watch_remaining(void) {
+	double deadline, left;
+	if (current != NULL) deadline = current->deadline;
+	else if (carried != NULL) deadline = carried->deadline;
+	else return 0;
+	if (deadline <= 0) return 0;
+	left = deadline - now_secs();
+	return (left > 0.001 ? left : 0.001);
+	}
+
+/*
+** A scope for work done on other threads on behalf of this one,
+** ending secs from now. Work on a pool thread carries the scope of
+** the request it serves.
+*/
+WATCH_SCOPE *watch_scope(double secs) {
+	WATCH_SCOPE *scope;
+	scope = (WATCH_SCOPE *)scm_gc_malloc(sizeof(WATCH_SCOPE),
+				"watch-scope");
+	if (current != NULL) scope->slot = current;
+	else if (carried != NULL) scope->slot = carried->slot;
+	else scope->slot = NULL;
+	scope->deadline = now_secs() + secs;
+	return scope;
+	}
+
+WATCH_SCOPE *watch_carry(WATCH_SCOPE *scope) {
+	WATCH_SCOPE *prev;
+	prev = carried;
+	carried = scope;
+	return prev;
+	}
+
+/*
+** The caller has stopped waiting for the scope's work: cancel its
+** queries and cut watch_remaining short for anything still running.
+*/
+void watch_expire(WATCH_SCOPE *scope) {
+	QUERY *query;
+	scm_lock_mutex(wmutex);
+	scope->deadline = now_secs();
+	query = (scope->slot != NULL ? scope->slot->queries : unwatched);
+	for (; query != NULL; query = query->next)
+		if (query->scope == scope) cancel(query);
+	scm_unlock_mutex(wmutex);
+	}
+
+/*
+** Record the cancel handle for the query this thread is about to
+** run, or clear it with NULL. The caller owns the handle unless
+** clearing returns 0: the watchdog took it for cancelling and the
+** canceller thread frees it.
+*/
+int watch_query(PGcancel *cancel) {
+	QUERY *query;
+	int owned;
+	query = &running;
+	if (cancel == NULL) {
+		if (query->head == NULL) return 1;
+		scm_lock_mutex(wmutex);
+		if (query->prev != NULL) query->prev->next = query->next;
+		else *query->head = query->next;
+		if (query->next != NULL) query->next->prev = query->prev;
+		query->head = NULL;
+		query->cancel = NULL;
+		owned = !query->taken;
+		scm_unlock_mutex(wmutex);
+		return owned;
+		}
+	if (current != NULL) {
+		query->head = &current->queries;
+		query->scope = NULL;
+		}
+	else if (carried != NULL) {
+		query->head = (carried->slot != NULL ?
+				&carried->slot->queries : &unwatched);
+		query->scope = carried;
+		}
+	else return 1;
+	scm_lock_mutex(wmutex);
+	query->cancel = cancel;
+	query->taken = 0;
+	query->prev = NULL;
+	if ((query->next = *query->head) != NULL) query->next->prev = query;
+	*query->head = query;
+	scm_unlock_mutex(wmutex);
+	return 1;
+	}
+
+/*
+** Threads currently running a request, for the profiler.
+*/
+int watch_threads(SCM *threads, int max) {
+	SLOT *slot;
+	int n;
+	n = 0;
+	scm_lock_mutex(wmutex);
+	for (slot = slots; (slot != NULL) && (n < max); slot = slot->next)
+		threads[n++] = slot->thread;
+	scm_unlock_mutex(wmutex);
+	return n;
+	}
+
+static SCM set_request_timeout(SCM secs) {
+	default_timeout = scm_to_double(secs);
+	scm_remember_upto_here_1(secs);
+	return SCM_UNSPECIFIED;
+	}
+
+static SCM watchdog_stats(void) {
+	SLOT *slot;
+	SCM stats;
+	int active;
+	scm_lock_mutex(wmutex);
+	active = 0;
+	for (slot = slots; slot != NULL; slot = slot->next) active++;
+	stats = SCM_EOL;
+	stats = scm_acons(scm_from_locale_symbol("answered"),
+			scm_from_ulong(answered), stats);
+	stats = scm_acons(scm_from_locale_symbol("cancelled"),
+			scm_from_ulong(cancels), stats);
+	stats = scm_acons(scm_from_locale_symbol("overruns"),
+			scm_from_ulong(overruns), stats);
+	stats = scm_acons(scm_from_locale_symbol("active"),
+			scm_from_int(active), stats);
+	scm_unlock_mutex(wmutex);
+	scm_remember_upto_here_1(stats);
+	return stats;
+	}
+
+void init_watchdog(void) {
+	scm_permanent_object(wmutex = scm_make_mutex());
+	scm_permanent_object(trace_thunk = scm_c_make_gsubr("overrun-trace",
+			0, 0, 0, log_trace));
+	scm_c_define_gsubr("request-timeout", 1, 0, 0, set_request_timeout);
+	scm_c_define_gsubr("watchdog-stats", 0, 0, 0, watchdog_stats);
+	}
@@ -0,0 +1,37 @@
+/*
+** Copyright (c) 2013 Peter Yadlowsky <pmy@virginia.edu>
+**
+** This program is free software ; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation ; either version 3 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY ; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program ; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+#include <libguile.h>
+
+#define DEFAULT_REQUEST_TIMEOUT 60.0
+#define WATCHDOG_INTVL_MS 250
+
+struct pg_cancel;
+
+typedef struct watch_scope WATCH_SCOPE;
+
+void init_watchdog(void);
+int watch_begin(int, const char *, const char *, double, unsigned long);
+void watch_end(void);
+int watch_sending(void);
+double watch_remaining(void);
+WATCH_SCOPE *watch_scope(double);
+WATCH_SCOPE *watch_carry(WATCH_SCOPE *);
+void watch_expire(WATCH_SCOPE *);
+int watch_query(struct pg_cancel *);
+int watch_threads(SCM *, int);